@@ -14,7 +14,11 @@
 const char RESPONSE_OK[] = "OK\r\n";
 const char RESPONSE_ERROR[] = "ERROR\r\n";
 const char RESPONSE_FAIL[] = "FAIL";
-const char RESPONSE_READY[] = "READY!";
+const char RESPONSE_READY[] = "ready\r\n"; // Firmware started after a reset
+const char RESPONSE_PROMPT[] = ">"; // CIPSEND data prompt
+const char RESPONSE_BUSY_P[] = "busy p..."; // Still processing the previous command; input dropped
+const char RESPONSE_BUSY_S[] = "busy s..."; // Still sending data; input dropped
+const char RESPONSE_DNS_FAIL[] = "DNS Fail"; // AT+CIPDOMAIN: the name doesn't resolve
 
 ///////////////////////
 // Basic AT Commands //
@@ -51,6 +55,7 @@ const char ESP8266_GET_STA_MAC[] = "+CIPSTAMAC"; // Get MAC address of station
 const char ESP8266_TCP_STATUS[] = "+CIPSTATUS"; // Get connection status
 const char ESP8266_TCP_CONNECT[] = "+CIPSTART"; // Establish TCP connection or register UDP port
 const char ESP8266_TCP_SEND[] = "+CIPSEND"; // Send Data
+const char ESP8266_TCP_SEND_BUFFER[] = "+CIPSENDBUF"; // Write Data into the TCP-send-buffer
 const char ESP8266_TCP_CLOSE[] = "+CIPCLOSE"; // Close TCP/UDP connection
 const char ESP8266_GET_LOCAL_IP[] = "+CIFSR"; // Get local IP address
 const char ESP8266_TCP_MULTIPLE[] = "+CIPMUX"; // Set multiple connections mode
@@ -58,6 +63,12 @@ const char ESP8266_SERVER_CONFIG[] = "+CIPSERVER"; // Configure as server
 const char ESP8266_TRANSMISSION_MODE[] = "+CIPMODE"; // Set transmission mode
 //!const char ESP8266_SET_SERVER_TIMEOUT[] = "+CIPSTO"; // Set timeout when ESP8266 runs as TCP server
 const char ESP8266_PING[] = "+PING"; // Function PING
+const char ESP8266_IPD_INFO[] = "+CIPDINFO"; // Show remote IP and port with +IPD
+const char ESP8266_DNS_LOOKUP[] = "+CIPDOMAIN"; // Resolve a host name
+const char ESP8266_RECV_MODE[] = "+CIPRECVMODE"; // Active (pushed +IPD data) or passive receive
+const char ESP8266_RECV_DATA[] = "+CIPRECVDATA"; // Pull received data in passive mode
+const char ESP8266_RECV_LEN[] = "+CIPRECVLEN"; // Bytes waiting per link in passive mode
+const char ESP8266_TRANSPARENT_ESCAPE[] = "+++"; // Leave transparent transmission (not an AT command)
 
 //////////////////////////
 // Custom GPIO Commands //
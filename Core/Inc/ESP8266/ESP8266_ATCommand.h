@@ -0,0 +1,236 @@
+#pragma once
+
+#include <limits>
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ESP8266_AT.h"
+#include "IPAddress.h"
+
+////////////////////////
+// Buffer Definitions //
+////////////////////////
+// Longest command: AT+CWJAP="<ssid>","<pwd>","<bssid>" with a 32 character
+// SSID and 64 character password where every character needs a '\', a 17
+// character BSSID, and the NUL.
+#ifndef WIFI_TX_BUFFER_LEN
+#define WIFI_TX_BUFFER_LEN (sizeof("AT+CWJAP=\"\",\"\",\"\"\r\n") + 2 * 32 + 2 * 64 + 17)
+#endif
+
+namespace ESP8266AT
+{
+	////////////////////
+	// Argument Kinds //
+	////////////////////
+	struct Int {};		// Decimal number
+	struct String {};	// "Quoted", with '"', ',' and '\' escaped
+
+	template <typename... Kinds> struct Signature {};
+	template <typename... Signatures> struct Overloads {};
+	typedef Overloads<> NoSetup;
+
+	// Maps a C++ argument type to the kind it is written as.
+	template <typename T, typename Enable = void> struct KindOf { typedef void type; };
+	template <typename T> struct KindOf<T, typename std::enable_if<std::is_integral<T>::value>::type> { typedef Int type; };
+	template <typename T> struct KindOf<T, typename std::enable_if<std::is_enum<T>::value>::type> { typedef Int type; };
+	template <> struct KindOf<const char *> { typedef String type; };
+	template <> struct KindOf<char *> { typedef String type; };
+	template <> struct KindOf<IPAddress> { typedef String type; };
+
+	template <typename Setup, typename... Kinds> struct Accepts : std::false_type {};
+	template <typename... Kinds> struct Accepts<Signature<Kinds...>, Kinds...> : std::true_type {};
+	template <typename First, typename... Rest, typename... Kinds> struct Accepts<Overloads<First, Rest...>, Kinds...>
+		: std::integral_constant<bool, Accepts<First, Kinds...>::value or Accepts<Overloads<Rest...>, Kinds...>::value> {};
+
+	///////////////////
+	// Command Table //
+	///////////////////
+	// Text: what follows "AT"; Query: "AT<cmd>?" allowed; Execute: "AT<cmd>"
+	// allowed; Setup: argument lists accepted by "AT<cmd>=...".
+#define ESP8266_AT_COMMAND(NAME, TEXT, QUERY, EXECUTE, ...) \
+	struct NAME \
+	{ \
+		static constexpr const char * Text() { return TEXT; } \
+		static constexpr bool Query = QUERY; \
+		static constexpr bool Execute = EXECUTE; \
+		typedef __VA_ARGS__ Setup; \
+	}
+
+	ESP8266_AT_COMMAND(TEST, ESP8266_TEST, false, true, NoSetup);
+	ESP8266_AT_COMMAND(RESET, ESP8266_RESET, false, true, NoSetup);
+	ESP8266_AT_COMMAND(VERSION, ESP8266_VERSION, false, true, NoSetup);
+	ESP8266_AT_COMMAND(ECHO_ENABLE, ESP8266_ECHO_ENABLE, false, true, NoSetup);
+	ESP8266_AT_COMMAND(ECHO_DISABLE, ESP8266_ECHO_DISABLE, false, true, NoSetup);
+	ESP8266_AT_COMMAND(UART, ESP8266_UART, true, false, Signature<Int, Int, Int, Int, Int>);	// baud,databits,stopbits,parity,flowcontrol
+	ESP8266_AT_COMMAND(WIFI_MODE, ESP8266_WIFI_MODE, true, false, Signature<Int>);
+	ESP8266_AT_COMMAND(CONNECT_AP, ESP8266_CONNECT_AP, true, false, Overloads<
+		Signature<String>,						// ssid
+		Signature<String, String>,				// ssid,pwd
+		Signature<String, String, String>>);	// ssid,pwd,bssid
+	ESP8266_AT_COMMAND(DISCONNECT, ESP8266_DISCONNECT, false, true, NoSetup);
+	ESP8266_AT_COMMAND(GET_STA_MAC, ESP8266_GET_STA_MAC, true, false, NoSetup);
+	ESP8266_AT_COMMAND(TCP_STATUS, ESP8266_TCP_STATUS, false, true, NoSetup);
+	ESP8266_AT_COMMAND(TCP_CONNECT, ESP8266_TCP_CONNECT, false, false, Overloads<
+		Signature<String, String, Int>,			// type,remote,port
+		Signature<String, String, Int, Int>,		// type,remote,port,keepalive
+		Signature<String, String, Int, Int, Int>,	// "UDP",remote,port,localport,mode
+		Signature<Int, String, String, Int>,		// link,type,remote,port
+		Signature<Int, String, String, Int, Int>,	// link,type,remote,port,keepalive
+		Signature<Int, String, String, Int, Int, Int>>);	// link,"UDP",remote,port,localport,mode
+	ESP8266_AT_COMMAND(TCP_SEND, ESP8266_TCP_SEND, false, true, Overloads<
+		Signature<Int>,							// length
+		Signature<Int, Int>,					// link,length
+		Signature<Int, String, Int>,			// length,remote,port (UDP)
+		Signature<Int, Int, String, Int>>);		// link,length,remote,port (UDP)
+	ESP8266_AT_COMMAND(TCP_SEND_BUFFER, ESP8266_TCP_SEND_BUFFER, false, false, Overloads<
+		Signature<Int>,							// length
+		Signature<Int, Int>>);					// link,length
+	ESP8266_AT_COMMAND(TCP_CLOSE, ESP8266_TCP_CLOSE, false, true, Signature<Int>);
+	ESP8266_AT_COMMAND(GET_LOCAL_IP, ESP8266_GET_LOCAL_IP, false, true, NoSetup);
+	ESP8266_AT_COMMAND(TCP_MULTIPLE, ESP8266_TCP_MULTIPLE, true, false, Signature<Int>);
+	ESP8266_AT_COMMAND(SERVER_CONFIG, ESP8266_SERVER_CONFIG, true, false, Overloads<
+		Signature<Int>,							// mode
+		Signature<Int, Int>>);					// mode,port
+	ESP8266_AT_COMMAND(TRANSMISSION_MODE, ESP8266_TRANSMISSION_MODE, true, false, Signature<Int>);
+	ESP8266_AT_COMMAND(PING, ESP8266_PING, false, false, Signature<String>);
+	ESP8266_AT_COMMAND(IPD_INFO, ESP8266_IPD_INFO, true, false, Signature<Int>);
+	ESP8266_AT_COMMAND(DNS_LOOKUP, ESP8266_DNS_LOOKUP, false, false, Signature<String>);	// host
+	ESP8266_AT_COMMAND(RECV_MODE, ESP8266_RECV_MODE, true, false, Signature<Int>);	// 0 active, 1 passive
+	ESP8266_AT_COMMAND(RECV_DATA, ESP8266_RECV_DATA, false, false, Overloads<
+		Signature<Int>,							// length
+		Signature<Int, Int>>);					// link,length
+	ESP8266_AT_COMMAND(RECV_LEN, ESP8266_RECV_LEN, true, false, NoSetup);
+}
+
+class ESP8266CommandBuffer
+{
+public:
+	ESP8266CommandBuffer() {}
+
+	// Build "AT<cmd>?\r\n"
+	template <typename Command>
+	bool Query()
+	{
+		static_assert(Command::Query, "AT command has no query form");
+		return Begin(Command::Text()) and Put('?') and End();
+	}
+
+	// Build "AT<cmd>\r\n"
+	template <typename Command>
+	bool Execute()
+	{
+		static_assert(Command::Execute, "AT command has no execute form");
+		return Begin(Command::Text()) and End();
+	}
+
+	// Build "AT<cmd>=<arg>,<arg>...\r\n"
+	template <typename Command, typename... Args>
+	bool Setup(const Args&... args)
+	{
+		static_assert(ESP8266AT::Accepts<typename Command::Setup,
+			typename ESP8266AT::KindOf<typename std::decay<Args>::type>::type...>::value,
+			"argument types do not match the AT command");
+		if (not Begin(Command::Text()) or not Put('='))
+			return false;
+		bool first = true;
+		bool results[] = { true, (PutArgument(args, first))... };
+		for (bool result : results)
+			if (not result)
+				return false;
+		return End();
+	}
+
+	const char * Data() const { return m_Data; }
+	size_t Size() const { return m_Length; }
+
+private:
+	bool Begin(const char * text)
+	{
+		m_Length = 0;
+		m_Data[0] = '\0';
+		return Put("AT", 2) and Put(text, strlen(text));
+	}
+
+	bool End()
+	{
+		if (not Put("\r\n", 2))
+			return false;
+		m_Data[m_Length] = '\0';
+		return true;
+	}
+
+	bool Put(char c)
+	{
+		if (m_Length + 1 >= sizeof(m_Data))	// Keep room for the NUL
+			return false;
+		m_Data[m_Length++] = c;
+		return true;
+	}
+
+	bool Put(const char * p, size_t len)
+	{
+		if (m_Length + len >= sizeof(m_Data))
+			return false;
+		memcpy(&m_Data[m_Length], p, len);
+		m_Length += len;
+		return true;
+	}
+
+	bool PutUnsigned(unsigned long value)
+	{
+		char digits[std::numeric_limits<unsigned long>::digits10 + 1];
+		size_t n = 0;
+		do {
+			digits[n++] = '0' + (value % 10);
+			value /= 10;
+		} while (value);
+		while (n)
+			if (not Put(digits[--n]))
+				return false;
+		return true;
+	}
+
+	template <typename T>
+	bool PutValue(T value, typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value>::type * = nullptr)
+	{
+		long v = (long)value;
+		if (std::is_signed<T>::value and v < 0)
+			return Put('-') and PutUnsigned(0UL - (unsigned long)v);
+		return PutUnsigned((unsigned long)value);
+	}
+
+	bool PutValue(const char * str)
+	{
+		if (not Put('"'))
+			return false;
+		for (; *str; str++)
+		{
+			if ((*str == '"' or *str == ',' or *str == '\\') and not Put('\\'))
+				return false;
+			if (not Put(*str))
+				return false;
+		}
+		return Put('"');
+	}
+
+	bool PutValue(IPAddress ip)
+	{
+		return Put('"') and PutUnsigned(ip[0]) and Put('.') and PutUnsigned(ip[1]) and Put('.')
+			and PutUnsigned(ip[2]) and Put('.') and PutUnsigned(ip[3]) and Put('"');
+	}
+
+	template <typename T>
+	bool PutArgument(const T& value, bool& first)
+	{
+		if (not first and not Put(','))
+			return false;
+		first = false;
+		return PutValue(value);
+	}
+
+	char m_Data[WIFI_TX_BUFFER_LEN];
+	size_t m_Length = 0;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <limits>
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "IPAddress.h"
+
+// Tokenizer for AT responses of the form "+TAG:field,field,...\r\n".
+// Works directly on the receive buffer: spans point into it and nothing is
+// copied until a caller asks for a C string. Every read is bounded by the
+// span it is given, so the parser does not rely on NUL termination and has
+// no HAL dependencies (it builds and can be fuzzed on the host).
+
+namespace ESP8266AT
+{
+	// Read-only view of part of a response. Not NUL terminated.
+	struct Span
+	{
+		const char * Begin = nullptr;
+		const char * End = nullptr;
+
+		Span() {}
+		Span(const char * begin, const char * end) : Begin(begin), End(end) {}
+
+		size_t Size() const { return End - Begin; }
+		bool Empty() const { return Begin == End; }
+		bool Equals(const char * text) const;
+		bool StartsWith(const char * text) const;
+		const char * Find(const char * text) const;		// First occurrence, or nullptr
+	};
+
+	// Int<T>() parses signed T as a long and unsigned T as an unsigned long,
+	// then checks T's bounds in that type. Exact holds when the bounds
+	// convert without wrapping, which a cast of an unsigned bound to long
+	// does not guarantee (uint32_t max is -1 as a 32 bit long).
+	template <typename T>
+	struct IntRange
+	{
+		typedef typename std::conditional<std::is_signed<T>::value, long, unsigned long>::type Wide;
+		static constexpr bool Exact =
+			(Wide)std::numeric_limits<T>::min() == std::numeric_limits<T>::min() and
+			(Wide)std::numeric_limits<T>::max() == std::numeric_limits<T>::max();
+	};
+
+	// Consumes the comma separated fields of one line, left to right. Each
+	// extractor reads one field plus its trailing ','. A malformed field makes
+	// the extractor return false without moving the reader.
+	class FieldReader
+	{
+	public:
+		FieldReader() {}
+		explicit FieldReader(Span fields) : m_Pos(fields.Begin), m_End(fields.End) {}
+
+		bool Int(long& value);								// -?[0-9]+
+		bool Int(unsigned long& value);						// [0-9]+
+		template <typename T>
+		bool Int(T& value)									// Int() range checked against T
+		{
+			typedef typename IntRange<T>::Wide Wide;
+			static_assert(std::is_integral<T>::value and IntRange<T>::Exact, "Int() can't range check this type");
+			Wide v;
+			const char * start = m_Pos;
+			if (not Int(v))
+				return false;
+			if (v < (Wide)std::numeric_limits<T>::min() or v > (Wide)std::numeric_limits<T>::max())
+			{
+				m_Pos = start;
+				return false;
+			}
+			value = (T)v;
+			return true;
+		}
+		bool Quoted(Span& value);							// "..." - value excludes the quotes, escapes kept
+		bool Word(Span& value);								// Unquoted token up to the next ','
+		bool String(char * dst, size_t dstLen);				// Quoted or unquoted, unescaped and NUL terminated
+		bool IP(IPAddress& ip);								// a.b.c.d, quoted or not
+		bool MAC(uint8_t (&mac)[6]);						// aa:bb:cc:dd:ee:ff, quoted or not
+		bool Skip();										// Discard one field of any kind
+
+		bool AtEnd() const { return m_Pos == m_End; }
+		Span Rest() const { return Span(m_Pos, m_End); }
+
+	private:
+		bool endField(const char * p);
+
+		const char * m_Pos = nullptr;
+		const char * m_End = nullptr;
+	};
+
+	// One line of a response. For "+TAG:fields" Tag is "+TAG"; a line with no
+	// ':' (e.g. "No AP", "+12") is all Tag and has no fields.
+	struct Line
+	{
+		Span Text;
+		Span Tag;
+		FieldReader Fields;
+
+		// Matches the tag exactly or with the _CUR/_DEF suffix used by AT 1.x.
+		bool Is(const char * tag) const;
+	};
+
+	// Walks a response buffer one line at a time, skipping blank lines.
+	class ResponseScanner
+	{
+	public:
+		ResponseScanner(const char * data, size_t size) : m_Pos(data), m_End(data + size) {}
+
+		bool Next(Line& line);
+		void SkipTo(const char * p) { if (p > m_Pos) m_Pos = (p < m_End) ? p : m_End; }	// Continue scanning from p
+
+	private:
+		const char * m_Pos;
+		const char * m_End;
+	};
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "ESP8266_AT.h"
+#include "ESP8266_ATCommand.h"
+#include "ESP8266_ATParse.h"
 #include "WiFiDevice.h"
 #include "WiFiBuffer.h"
 
@@ -41,10 +43,14 @@ public:
 	int16_t WiFiGetMode();
 	int16_t WiFiSetMode(wifi_mode mode);
 	int16_t WiFiConnect(const char * ssid, const char * pwd);
-	int16_t WiFiGetAP(char * ssid);
+	int16_t WiFiJoinStart(const char * ssid, const char * pwd, const char * bssid = nullptr);
+	int16_t WiFiJoinPoll(uint32_t timeSliceInMS = WIFI_JOIN_POLL_SLICE);
+	bool WiFiIsAssociated();
+	int16_t WiFiGetAP(char * ssid, char * bssid = nullptr, uint8_t * channel = nullptr);
 	int16_t WiFiLocalMAC(char * mac);
 	int16_t WiFiDisconnect();
 	IPAddress WiFiLocalIP();
+	int16_t WiFiResolve(const char * host, IPAddress& ip);
 	
 	/////////////////////
 	// TCP/IP Commands //
@@ -54,6 +60,14 @@ public:
 	int16_t TCPConnect(uint8_t linkID, const char * destination, uint16_t port, uint16_t keepAlive);
 	int16_t TCPSend(uint8_t linkID, WiFiBuffer Data);
 	int16_t TCPSend(uint8_t linkID, const uint8_t *buf, size_t size);
+	int16_t TCPWrite(uint8_t linkID, const uint8_t *buf, size_t size);
+	int16_t TCPFlush(uint8_t linkID);
+	int16_t TCPFlushExpired();
+	void TCPSetCoalescing(bool enable, uint32_t flushDeadlineInMS = WIFI_SEND_FLUSH_DEADLINE);
+	int16_t TCPSendStream(uint8_t linkID, const uint8_t *buf, size_t size,
+		size_t * pSent = nullptr, SendProgressFunction progress = nullptr);
+	int16_t TCPSendStream(uint8_t linkID, SendProducerFunction producer,
+		size_t * pSent = nullptr, SendProgressFunction progress = nullptr);
 	int16_t TCPClose(uint8_t linkID);
 	int16_t TCPSetTransferMode(uint8_t mode);
 	int16_t TCPSetMux(uint8_t mux);
@@ -61,6 +75,50 @@ public:
 	int16_t TCPPing(IPAddress ip);
 	int16_t TCPPing(char * server);
 	bool TCPIsConnected(uint8_t linkID);
+	void TCPProcessEvents();
+
+	////////////////////
+	// Send Scheduler //
+	////////////////////
+	void TCPSetLinkClass(uint8_t linkID, wifi_send_class sendClass, uint8_t weight = 1);
+	int16_t TCPQueue(uint8_t linkID, const uint8_t *buf, size_t size);
+	int16_t TCPSchedule(uint32_t timeSliceInMS = 0);
+	size_t TCPQueued(uint8_t linkID);
+	const wifi_link_stats& TCPLinkStats(uint8_t linkID);
+	void TCPResetLinkStats(uint8_t linkID);
+
+	/////////////////////
+	// Connection Pool //
+	/////////////////////
+	int16_t TCPAcquire(const char * destination, uint16_t port, uint16_t keepAlive = WIFI_POOL_KEEPALIVE);
+	int16_t TCPRelease(uint8_t linkID, bool reusable = true);
+	int16_t TCPPoolExpire();
+
+	///////////////////
+	// UDP Datagrams //
+	///////////////////
+	int16_t UDPOpen(uint8_t linkID, const char * destination, uint16_t remotePort,
+		uint16_t localPort = 0, wifi_udp_mode mode = WIFI_UDP_PEER_FIXED);
+	int16_t UDPSend(uint8_t linkID, const uint8_t *buf, size_t size);
+	int16_t UDPSendTo(uint8_t linkID, const wifi_datagram& datagram);
+	DatagramHandlerFunction UDPRegisterReceiveHandler(DatagramHandlerFunction handler);
+
+	/////////////////////
+	// Passive Receive //
+	/////////////////////
+	int16_t TCPSetReceiveMode(bool passive);
+	int16_t TCPUpdatePending();
+	size_t TCPPending(uint8_t linkID);
+	int16_t TCPReceive(uint8_t linkID, uint8_t * buf, size_t size);
+
+	//////////////////////////////
+	// Transparent Transmission //
+	//////////////////////////////
+	int16_t TCPStartPassthrough(const char * destination, uint16_t port, uint16_t keepAlive = 0);
+	int16_t TCPPassthroughWrite(const uint8_t *buf, size_t size);
+	int16_t TCPPassthroughRead(uint8_t *buf, size_t size, uint32_t timeoutInMS);
+	int16_t TCPStopPassthrough();
+	bool TCPIsPassthrough();
 
 	//////////////////////////
 	// Custom GPIO Commands //
@@ -81,9 +139,53 @@ private:
 	//////////////////////////
 	// Command Send/Receive //
 	//////////////////////////
-	void sendCommand(const char * cmd, enum wifi_command_type type = WIFI_CMD_EXECUTE, WiFiBuffer params = {});		// const char * params = NULL
+	void sendCommand();
+	bool sendBuilt(bool built);
+
+	// Output: false if the command doesn't fit m_Tx; it isn't sent and the
+	// next read returns WIFI_CMD_BAD at once.
+	template <typename Command>
+	bool sendExecute()						// AT<cmd>
+	{
+		return sendBuilt(m_Tx.Execute<Command>());
+	}
+
+	template <typename Command>
+	bool sendQuery()						// AT<cmd>?
+	{
+		return sendBuilt(m_Tx.Query<Command>());
+	}
+
+	template <typename Command, typename... Args>
+	bool sendSetup(const Args&... args)		// AT<cmd>=<args>
+	{
+		return sendBuilt(m_Tx.Setup<Command>(args...));
+	}
+
 	int16_t readForResponse(const char * rsp, unsigned int timeoutInMS, size_t readLen = WIFI_RX_BUFFER_LEN);
+	int16_t readForResponse(const char * rsp, unsigned int timeoutInMS, size_t readLen, uint32_t& waited);
 	int16_t readForResponses(const char * pass, const char * fail, unsigned int timeout, size_t readLen = WIFI_RX_BUFFER_LEN);
+	int16_t readForResponses(const char * pass, const char * fail, unsigned int timeout, size_t readLen, uint32_t& waited);
+	size_t readResponse(const char * pass, const char * fail, unsigned int timeoutInMS, size_t readLen);
+	int16_t readUntil(const char * pass, const char * fail, unsigned int timeoutInMS);
+	int16_t readUntil(const char * pass, const char * fail, unsigned int timeoutInMS, uint32_t& waited);
+	int16_t readForPing();
+	bool commandBad();
+	bool responseBusy();
+	bool busyBackoff(uint32_t& waited);
+	bool retryCommand(bool busy, uint32_t& waited);
+	template <typename Command>
+	int16_t queryInt();						// AT<cmd>? -> +<cmd>:<n>
+	void processNotifications();
+
+	//////////////////////
+	// Link State Cache //
+	//////////////////////
+	int16_t reconcileStatus();
+	void linkOpened(uint8_t linkID);
+	void linkClosed(uint8_t linkID);
+	void wifiDisconnected();
+	int16_t restoreConnectionOptions();
 	
 	//////////////////
 	// Buffer Stuff //
@@ -94,12 +196,99 @@ private:
 	/// Success: Returns pointer to beginning of string
 	/// Fail: returns NULL
 	char * searchBuffer(const char * test);
+
+	ESP8266AT::ResponseScanner scanResponse();
 	
 	uint8_t sync();
 
+	///////////////////
+	// Send Pipeline //
+	///////////////////
+	int16_t sendSegment(uint8_t linkID, const uint8_t *buf, size_t size);
+	int16_t waitForSegments(uint8_t linkID, uint8_t maxInFlight);
+	int8_t scheduleNext(size_t& len);
+	int16_t sendQueued(uint8_t linkID, size_t len);
+	void dropQueued(uint8_t linkID);
+
 	//////////////////
 	// Control pins //
 	//////////////////
 	WiFi_GPIO_Pin m_Reset;
 	WiFi_GPIO_Pin m_Enable;
+
+	ESP8266CommandBuffer m_Tx;
+	bool m_CommandSent = false;			// m_Tx went out and its answer hasn't been read yet
+	bool m_CommandBad = false;			// m_Tx overflowed, nothing was sent; see sendBuilt()
+
+	////////////////////////
+	// Connection Options //
+	////////////////////////
+	uint8_t m_Mux = 0;					// AT+CIPMUX; link IDs are omitted when 0
+	bool m_Passthrough = false;			// AT+CIPMODE=1 and AT+CIPSEND active
+	uint32_t m_LastPassthroughTX = 0;	// HAL tick of the last transparent write
+	bool m_RestoreMux = false;			// CIPMUX was 1 before transparent mode, see restoreConnectionOptions()
+	bool m_RestorePassive = false;		// Likewise CIPRECVMODE
+
+	struct SendState {
+		WiFiBuffer Pending;				// Coalesced writes not yet handed to the module
+		uint32_t PendingSince = 0;		// HAL tick of the oldest byte in Pending
+		uint8_t InFlight = 0;			// CIPSENDBUF segments without "SEND OK"
+		uint32_t LastSegment = 0;		// Last segment ID returned by CIPSENDBUF
+		bool Failed = false;			// A segment came back with "SEND FAIL"
+	} m_Send[WIFI_MAX_SOCK_NUM];
+	enum {
+		SENDBUF_UNKNOWN,
+		SENDBUF_SUPPORTED,
+		SENDBUF_UNSUPPORTED
+	} m_SendBuf = SENDBUF_UNKNOWN;
+	bool m_Coalesce = false;
+	uint32_t m_FlushDeadline = WIFI_SEND_FLUSH_DEADLINE;
+
+	struct LinkQueue {
+		WiFiBuffer Data;				// Queued by TCPQueue(), sent by TCPSchedule()
+		wifi_send_class Class = WIFI_CLASS_NORMAL;
+		uint8_t Weight = 1;
+		size_t Deficit = 0;				// Bytes the link may still send this round
+		bool InTurn = false;			// Deficit granted, round not finished
+		uint32_t Queued = 0;			// Running byte counts, for the marks below
+		uint32_t Sent = 0;
+		struct {
+			uint32_t End;				// Queued count after the write
+			uint32_t Tick;				// HAL tick of the write
+		} Marks[WIFI_SCHED_MARKS];
+		uint8_t MarkHead = 0;
+		uint8_t MarkCount = 0;
+		wifi_link_stats Stats;
+	} m_Queue[WIFI_MAX_SOCK_NUM];
+	uint8_t m_SchedTurn[WIFI_CLASSES] = {};	// Link whose round it is, per class
+
+	struct PoolEntry {
+		char Host[WIFI_HOST_LEN];		// Endpoint the link is connected to
+		uint16_t Port = 0;
+		uint32_t LastUsed = 0;			// HAL tick of the last acquire/release (LRU)
+		bool Pooled = false;			// Opened by TCPAcquire() and still open
+	} m_Pool[WIFI_MAX_SOCK_NUM];
+
+	struct DNSEntry {
+		char Host[WIFI_HOST_LEN];
+		IPAddress Address;
+		uint32_t Expires = 0;			// HAL tick after which the entry is stale
+		bool Resolved = false;			// false: negative entry ("DNS Fail")
+		bool Used = false;
+	} m_DNS[WIFI_DNS_CACHE_SIZE];
+
+	int8_t m_TransferMode = -1;			// AT+CIPMODE, -1 unknown
+	bool m_PassiveRecv = false;			// AT+CIPRECVMODE=1
+	size_t m_RecvPending[WIFI_MAX_SOCK_NUM] = {};	// Bytes the module holds per link (passive mode)
+	bool m_Joining = false;				// AT+CWJAP sent, answer not complete yet
+	uint32_t m_JoinStarted = 0;
+	char m_JoinLine[24];				// Line of the join answer being received
+	uint8_t m_JoinLineLen = 0;
+	uint8_t m_JoinReason = 0;			// +CWJAP:<reason> of the last failed join
+
+	bool m_DatagramInfo = false;		// AT+CIPDINFO=1 sent since the last reset
+	DatagramHandlerFunction m_DatagramHandler;
+
+	bool m_StatusValid = false;			// m_Status has been filled by AT+CIPSTATUS
+	uint32_t m_StatusUpdated = 0;		// HAL tick of the last AT+CIPSTATUS
 };
@@ -3,30 +3,36 @@
 //#include "string.h"
 #include "string"
 #include "cstring"
-# include "stdexcept"
 
 class IPAddress{
-	uint8_t addr[4];
+	uint8_t addr[4] = { 0, 0, 0, 0 };
 	int16_t error = 0;
 public:
+	static const int16_t ERR_FORMAT = -5;	// Same value as WIFI_CMD_BAD
+
 	IPAddress() {};
 
+	// Dotted quad; anything else leaves 0.0.0.0 with Error() ERR_FORMAT.
 	IPAddress(const char * ip)
 	{
 		const char * p = ip;
-		for (uint8_t i = 0; i < 4; i++)
+		bool ok = (p != nullptr);
+		for (uint8_t i = 0; ok and i < 4; i++)
 		{
-			char tempOctet[4];
-			memset(tempOctet, 0, 4); // Clear tempOctet
-
-			size_t octetLength = strspn(p, "0123456789"); // Find length of numerical string:
-			if (octetLength >= 4) // If it's too big, return an error
-				throw std::out_of_range("Invalid IP Address.");
-
-			strncpy(tempOctet, p, octetLength); // Copy string to temp char array:
-			addr[i] = atoi(tempOctet); // Move the temp char into IP Address octet
-
-			p += (octetLength + 1); // Increment p to next octet
+			if (i > 0)
+				ok = (*p++ == '.');
+			unsigned int octet = 0;
+			uint8_t digits = 0;
+			for (; ok and digits < 4 and *p >= '0' and *p <= '9'; p++, digits++)
+				octet = octet * 10 + (*p - '0');
+			ok = ok and digits > 0 and digits <= 3 and octet <= 255;
+			if (ok)
+				addr[i] = octet;
+		}
+		if (not ok or *p != '\0')
+		{
+			memset(addr, 0, sizeof(addr));
+			error = ERR_FORMAT;
 		}
 	}
 
@@ -35,6 +41,16 @@ public:
 		error = err;
 	}
 
+	bool IsValid() const
+	{
+		return error == 0;
+	}
+
+	int16_t Error() const
+	{
+		return error;
+	}
+
 	uint8_t& operator[](int idx)
 	{
 		return addr[idx];
@@ -1,13 +1,7 @@
 #pragma once
 
+#include "functional"
 #include "IPAddress.h"
-#include "STM32TCP.h"
-
-namespace EPRI{
-	class STM32TCPSocket;
-}
-
-using namespace EPRI;
 
 ////////////////////////
 // Buffer Definitions //
@@ -24,12 +18,49 @@ using namespace EPRI;
 #define WIFI_CONNECT_TIMEOUT 30000
 #define COMMAND_RESET_TIMEOUT 5000
 #define CLIENT_CONNECT_TIMEOUT 5000
+#define PASSTHROUGH_GUARD_TIME 20		// Idle time required around "+++"
+#define PASSTHROUGH_EXIT_TIME 1000		// Time before the next AT command after "+++"
+#define WIFI_RESPONSE_SLICE 10			// Read slice while waiting for a final result
+#define WIFI_RESET_PULSE 10				// Low time of a hardware reset
+#define WIFI_BUSY_BACKOFF_MIN 10		// First wait after "busy p/s...", in ms
+#define WIFI_BUSY_BACKOFF_MAX 200		// Wait cap, in ms
+#define WIFI_BUSY_RETRY_TIME 2000		// Longest a command or send is held for a busy module
 
 #define WIFI_MAX_SOCK_NUM 5
 #define WIFI_SOCK_NOT_AVAIL 255
 #define WIFI_MAX_TCP_LEN 2048
+#define WIFI_SEND_WINDOW 4				// CIPSENDBUF segments in flight per link
+#define WIFI_SEND_FLUSH_DEADLINE 20		// Default coalescing deadline in ms
+#define WIFI_SCHED_QUANTUM 512			// Bytes per scheduler round of a weight 1 link
+#define WIFI_SCHED_SEGMENT 512			// Largest segment of a non-interactive link
+#define WIFI_SCHED_QUEUE_LIMIT 8192		// Bytes a link may have queued
+#define WIFI_SCHED_MARKS 8				// Queued writes timed per link for latency
+#define WIFI_STATUS_RECONCILE_PERIOD 30000	// Max age of the link state cache before AT+CIPSTATUS
+#define WIFI_SSID_LEN 33				// 32 chars + NUL, size of WiFiGetAP() output
+#define WIFI_MAC_STR_LEN 18				// "aa:bb:cc:dd:ee:ff" + NUL, size of WiFiLocalMAC() output
+#define WIFI_VERSION_LEN 64				// Size of each GetVersion() output
+#define WIFI_HOST_LEN 64				// Longest pooled host name + NUL
+#define WIFI_POOL_KEEPALIVE 60000		// TCP keep-alive of pooled connections in ms
+#define WIFI_POOL_IDLE_TIMEOUT 30000	// Idle pooled connections older than this are closed
+#define WIFI_DNS_CACHE_SIZE 4			// Host names remembered by WiFiResolve()
+#define WIFI_DNS_TTL 300000				// Lifetime of a resolved address in ms
+#define WIFI_DNS_NEGATIVE_TTL 10000		// Lifetime of a failed lookup in ms
+#define WIFI_DNS_TIMEOUT 5000
+#define WIFI_JOIN_BACKOFF_MIN 500		// First retry delay after a failed join, in ms
+#define WIFI_JOIN_BACKOFF_MAX 16000		// Retry delay cap, in ms
+#define WIFI_JOIN_POLL_SLICE 50			// Longest a join poll blocks, in ms
+#define WIFI_SOCKET_POLL_PERIOD 100		// Longest a quiet socket goes without Poll(), in ms
+
+#include "STM32TCP.h"					// After the definitions above, which STM32TCP.h uses
+
+namespace EPRI{
+	class STM32TCPSocket;
+}
+
+using namespace EPRI;
 
 enum wifi_cmd_rsp {
+	WIFI_RSP_BUSY = -6,			// Module still busy after WIFI_BUSY_RETRY_TIME
 	WIFI_CMD_BAD = -5,
 	WIFI_RSP_MEMORY_ERR = -4,
 	WIFI_RSP_FAIL = -3,
@@ -80,6 +111,12 @@ enum wifi_tetype {
 	WIFI_SERVER
 };
 
+enum wifi_udp_mode {
+	WIFI_UDP_PEER_FIXED = 0,	// Remote never changes
+	WIFI_UDP_PEER_ONCE = 1,		// Remote becomes the sender of the next datagram received
+	WIFI_UDP_PEER_ANY = 2		// Remote follows the sender of every datagram received
+};
+
 struct wifi_ipstatus
 {
 	uint8_t linkID;
@@ -89,6 +126,88 @@ struct wifi_ipstatus
 	wifi_tetype tetype;
 };
 
+struct wifi_datagram
+{
+	IPAddress remoteIP;
+	uint16_t remotePort;		// 0: the link's current peer
+	const uint8_t * data;
+	size_t size;
+};
+
+// Send classes are served in strict priority; links of the same class share
+// the UART by weight (deficit round-robin).
+enum wifi_send_class {
+	WIFI_CLASS_INTERACTIVE,	// Control and request/response traffic
+	WIFI_CLASS_NORMAL,
+	WIFI_CLASS_BULK,		// Uploads; only gets the UART when nothing else waits
+	WIFI_CLASSES
+};
+
+struct wifi_link_stats
+{
+	uint32_t bytesQueued = 0;		// Accepted by TCPQueue()
+	uint32_t bytesSent = 0;			// Handed to the module
+	uint32_t bytesDropped = 0;		// Discarded after a failed send or a closed link
+	uint32_t segments = 0;
+	uint32_t latencyLast = 0;		// ms from TCPQueue() until the write reached the module
+	uint32_t latencyMax = 0;
+	uint32_t latencySum = 0;
+	uint32_t latencyCount = 0;
+
+	uint32_t LatencyAverage() const { return latencyCount ? latencySum / latencyCount : 0; }
+};
+
+enum wifi_boot_step {
+	WIFI_BOOT_RESET,		// Reset until "ready"
+	WIFI_BOOT_PROBE,		// Reading back the state the module came up in
+	WIFI_BOOT_MODE,			// AT+CWMODE
+	WIFI_BOOT_JOIN,			// AT+CWJAP until associated, retries included
+	WIFI_BOOT_SERVICE,		// Server or client link ready
+	WIFI_BOOT_STEPS
+};
+
+// Cold start breakdown: Begin() records the module steps, the socket's
+// Open() the rest. Steps after the first WIFI_BOOT_SERVICE are ignored.
+struct wifi_boot_timing
+{
+	uint32_t start = 0;						// Tick Begin() was entered
+	uint32_t mark = 0;						// Tick the last step ended
+	uint32_t elapsed[WIFI_BOOT_STEPS] = {};	// ms per step
+	uint8_t skipped = 0;					// Bit per step: state already matched
+	bool complete = false;
+
+	void Start()
+	{
+		*this = wifi_boot_timing();
+		start = mark = HAL_GetTick();
+	}
+
+	void Step(wifi_boot_step step, bool wasSkipped = false)
+	{
+		if (complete or start == 0)
+			return;
+		uint32_t now = HAL_GetTick();
+		elapsed[step] += now - mark;
+		mark = now;
+		if (wasSkipped)
+			skipped |= (1 << step);
+		complete = (step == WIFI_BOOT_SERVICE);
+	}
+
+	bool Skipped(wifi_boot_step step) const { return skipped & (1 << step); }
+	uint32_t Total() const { return mark - start; }
+};
+
+// Time lost to "busy p..." / "busy s..." answers
+struct wifi_busy_stats
+{
+	uint32_t events = 0;			// Busy answers received
+	uint32_t retries = 0;			// Commands and sends repeated after one
+	uint32_t failures = 0;			// Given up after WIFI_BUSY_RETRY_TIME
+	uint32_t busyTime = 0;			// ms spent waiting in all
+	uint32_t longest = 0;			// Longest wait for a single command or send, in ms
+};
+
 struct wifi_status
 {
 	wifi_connect_status stat;
@@ -116,19 +235,12 @@ public:
 	WiFiDevice() {};
 	virtual ~WiFiDevice() {};
 
-	enum wifi_debug_lvl {
-		LVL_NONE = 0,
-		LVL_LOW = 1,
-#ifdef DEBUG
-		LVL_HIGH = 2,
-		LVL_ALL = 3
-#endif
-	} WIFI_DEBUG_LVL =
-#ifdef DEBUG
-		LVL_HIGH;
-#else
-		LVL_LOW;
-#endif
+	// (Bytes handed to the module so far, total bytes or 0 if unknown)
+	typedef std::function<void(size_t, size_t)>			SendProgressFunction;
+	// Fills at most the given number of bytes; returns 0 once exhausted.
+	typedef std::function<size_t(uint8_t *, size_t)>	SendProducerFunction;
+	// (Link ID, datagram) - the data is only valid during the call
+	typedef std::function<void(uint8_t, const wifi_datagram&)>	DatagramHandlerFunction;
 
 	virtual bool Begin(STM32TCPSocket * pSocket) = 0;
 
@@ -153,12 +265,14 @@ public:
 #endif
 	virtual int16_t WiFiSetMode(wifi_mode mode) = 0;
 	virtual int16_t WiFiConnect(const char * ssid, const char * pwd) = 0;
-#ifdef DEBUG
-	virtual int16_t WiFiGetAP(char * ssid) = 0;
-#endif
+	virtual int16_t WiFiJoinStart(const char * ssid, const char * pwd, const char * bssid = nullptr) = 0;
+	virtual int16_t WiFiJoinPoll(uint32_t timeSliceInMS = WIFI_JOIN_POLL_SLICE) = 0;	// >0 joined, 0 joining, <0 failed
+	virtual bool WiFiIsAssociated() = 0;
+	virtual int16_t WiFiGetAP(char * ssid, char * bssid = nullptr, uint8_t * channel = nullptr) = 0;
 	virtual int16_t WiFiLocalMAC(char * mac) = 0;
 	virtual int16_t WiFiDisconnect() = 0;
 	virtual IPAddress WiFiLocalIP() = 0;
+	virtual int16_t WiFiResolve(const char * host, IPAddress& ip) = 0;
 
 	/////////////////////
 	// TCP/IP Commands //
@@ -168,6 +282,14 @@ public:
 	virtual int16_t TCPConnect(uint8_t linkID, const char * destination, uint16_t port, uint16_t keepAlive) = 0;	// Client connection
 	virtual int16_t TCPSend(uint8_t linkID, WiFiBuffer Data) = 0;		// Himanshu
 	virtual int16_t TCPSend(uint8_t linkID, const uint8_t *buf, size_t size) = 0;
+	virtual int16_t TCPWrite(uint8_t linkID, const uint8_t *buf, size_t size) = 0;	// Coalesced send
+	virtual int16_t TCPFlush(uint8_t linkID) = 0;
+	virtual int16_t TCPFlushExpired() = 0;
+	virtual void TCPSetCoalescing(bool enable, uint32_t flushDeadlineInMS = WIFI_SEND_FLUSH_DEADLINE) = 0;
+	virtual int16_t TCPSendStream(uint8_t linkID, const uint8_t *buf, size_t size,
+		size_t * pSent = nullptr, SendProgressFunction progress = nullptr) = 0;
+	virtual int16_t TCPSendStream(uint8_t linkID, SendProducerFunction producer,
+		size_t * pSent = nullptr, SendProgressFunction progress = nullptr) = 0;
 	virtual int16_t TCPClose(uint8_t linkID) = 0;
 	virtual int16_t TCPSetTransferMode(uint8_t mode) = 0;
 	virtual int16_t TCPSetMux(uint8_t mux) = 0;
@@ -177,6 +299,50 @@ public:
 	virtual int16_t TCPPing(char * server) = 0;
 #endif
 	virtual bool TCPIsConnected(uint8_t linkID) = 0;
+	virtual void TCPProcessEvents() = 0;	// Update link state from unsolicited output in the RX buffer
+
+	////////////////////
+	// Send Scheduler //
+	////////////////////
+	virtual void TCPSetLinkClass(uint8_t linkID, wifi_send_class sendClass, uint8_t weight = 1) = 0;
+	virtual int16_t TCPQueue(uint8_t linkID, const uint8_t *buf, size_t size) = 0;	// Sent by TCPSchedule()
+	virtual int16_t TCPSchedule(uint32_t timeSliceInMS = 0) = 0;	// >0 drained, 0 data left, <0 failed; 0 ms: until drained
+	virtual size_t TCPQueued(uint8_t linkID) = 0;
+	virtual const wifi_link_stats& TCPLinkStats(uint8_t linkID) = 0;
+	virtual void TCPResetLinkStats(uint8_t linkID) = 0;
+
+	/////////////////////
+	// Connection Pool //
+	/////////////////////
+	virtual int16_t TCPAcquire(const char * destination, uint16_t port, uint16_t keepAlive = WIFI_POOL_KEEPALIVE) = 0;
+	virtual int16_t TCPRelease(uint8_t linkID, bool reusable = true) = 0;
+	virtual int16_t TCPPoolExpire() = 0;
+
+	///////////////////
+	// UDP Datagrams //
+	///////////////////
+	virtual int16_t UDPOpen(uint8_t linkID, const char * destination, uint16_t remotePort,
+		uint16_t localPort = 0, wifi_udp_mode mode = WIFI_UDP_PEER_FIXED) = 0;
+	virtual int16_t UDPSend(uint8_t linkID, const uint8_t *buf, size_t size) = 0;	// To the link's peer
+	virtual int16_t UDPSendTo(uint8_t linkID, const wifi_datagram& datagram) = 0;
+	virtual DatagramHandlerFunction UDPRegisterReceiveHandler(DatagramHandlerFunction handler) = 0;
+
+	/////////////////////
+	// Passive Receive //
+	/////////////////////
+	virtual int16_t TCPSetReceiveMode(bool passive) = 0;
+	virtual int16_t TCPUpdatePending() = 0;
+	virtual size_t TCPPending(uint8_t linkID) = 0;	// Announced by +IPD, not pulled yet
+	virtual int16_t TCPReceive(uint8_t linkID, uint8_t * buf, size_t size) = 0;
+
+	//////////////////////////////
+	// Transparent Transmission //
+	//////////////////////////////
+	virtual int16_t TCPStartPassthrough(const char * destination, uint16_t port, uint16_t keepAlive = 0) = 0;
+	virtual int16_t TCPPassthroughWrite(const uint8_t *buf, size_t size) = 0;
+	virtual int16_t TCPPassthroughRead(uint8_t *buf, size_t size, uint32_t timeoutInMS) = 0;
+	virtual int16_t TCPStopPassthrough() = 0;
+	virtual bool TCPIsPassthrough() = 0;
 
     ///////////////////////////////////
 	// Virtual Functions from Stream //
@@ -187,6 +353,8 @@ public:
 	virtual void Flush() = 0;
 
 	int16_t m_State[WIFI_MAX_SOCK_NUM];
+	wifi_boot_timing m_Boot;
+	wifi_busy_stats m_Busy;
 protected:
     STM32TCPSocket* m_Serial;
     wifi_status m_Status;
@@ -194,7 +362,7 @@ protected:
     //////////////////////////
 	// Command Send/Receive //
 	//////////////////////////
-	virtual void sendCommand(const char * cmd, enum wifi_command_type type = WIFI_CMD_EXECUTE, WiFiBuffer params = {}) = 0;		// const char * params = NULL
+	virtual void sendCommand() = 0;		// Transmits the command prepared in the device's TX buffer
 	virtual int16_t readForResponse(const char * rsp, unsigned int timeoutInMS, size_t readLen = WIFI_RX_BUFFER_LEN) = 0;
 	virtual int16_t readForResponses(const char * pass, const char * fail, unsigned int timeout, size_t readLen = WIFI_RX_BUFFER_LEN) = 0;
 
@@ -139,6 +139,23 @@ standard names. */
 
 /* USER CODE BEGIN Defines */
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
+#ifdef STM32_TIMELINE
+/* Context switches go into the event timeline, see STM32Timeline.h. */
+#if defined(__ICCARM__) || defined(__CC_ARM) || defined(__GNUC__)
+#ifdef __cplusplus
+extern "C"
+#endif
+void TimelineTaskSwitchedIn(uint32_t TaskNumber);
+#endif
+#define traceTASK_SWITCHED_IN() TimelineTaskSwitchedIn(pxCurrentTCB->uxTCBNumber)
+#endif
+/* STM32_STATIC_ALLOCATION: the application's tasks and timers, the objects
+RunServer() starts with and the operator new pools are all static, sized at
+compile time, so they show in the map file and boot never touches the heap
+for them. heap_4 is left to what the application itself allocates. */
+#if defined(STM32_STATIC_ALLOCATION) && (configSUPPORT_STATIC_ALLOCATION != 1)
+#error STM32_STATIC_ALLOCATION needs configSUPPORT_STATIC_ALLOCATION
+#endif
 /* USER CODE END Defines */
 
 #endif /* FREERTOS_CONFIG_H */
@@ -74,18 +74,34 @@
 
 #include <WiFiBuffer.h>
 
+#ifndef STM32_LOG_RING_SIZE
+#define STM32_LOG_RING_SIZE 4096	// Bytes of printf output waiting for USART3, power of two
+#endif
+#ifndef STM32_TRACE_LINE_MAX
+#define STM32_TRACE_LINE_MAX 32		// Widest TRACE_BUFFER() line, bytes
+#endif
+
 namespace EPRI
 {
     class STM32Debug
     {
     	static uint8_t instantiations;
     public:
+        enum TraceColumns : uint8_t
+        {
+            TRACE_OFFSET = 0x04,	// "0010: " before the bytes of each line
+            TRACE_ASCII = 0x08		// "|text|" after them, '.' for unprintable bytes
+        };
+
         STM32Debug();
         virtual ~STM32Debug();
         
         virtual void TRACE(const char * Format, ...);
-        virtual void TRACE_BUFFER(const char * Marker, const uint8_t * Buffer, size_t BufferSize, uint8_t BytesPerLine = 16);
-        virtual void TRACE_VECTOR(const char * Marker, const WiFiBuffer& Data, uint8_t BytesPerLine = 16);
+        virtual void TRACE_BUFFER(const char * Marker, const uint8_t * Buffer, size_t BufferSize, uint8_t BytesPerLine = 16,
+            uint8_t Columns = 0);
+        virtual void TRACE_VECTOR(const char * Marker, const WiFiBuffer& Data, uint8_t BytesPerLine = 16,
+            uint8_t Columns = 0);
+        uint32_t LogDropped() const;	// printf bytes lost to a full log ring
         
     };
     
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <type_traits>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+// Deferred logging
+//
+// Built with LOG_DEFERRED, LOG_PRINTF() does not format anything on the
+// target: it records the address of its format string plus the raw
+// arguments as one binary frame in the log ring, and TRACE_BUFFER() records
+// the bytes instead of a hex dump. The format strings live in the .logfmt
+// section, which the linker scripts keep in the ELF but never load, so they
+// cost no flash either. Tools/LogDecoder turns the UART stream back into
+// the text a normal build prints, using the ELF.
+//
+// Without LOG_DEFERRED, LOG_PRINTF() is printf().
+//
+// Frame, little endian:
+//    0xA5 | length (u16) | type (u8) | tick (u32) | payload | check (u8)
+// length counts type to payload; check is the XOR of length to payload.
+//    'F' format:  id (u32, address in .logfmt) | arguments
+//    'B' buffer:  flags (u8) | bytes per line (u8) | marker length (u8) | marker | data
+//    'T' text:    printf output, e.g. TRACE() with a run-time format
+// Each argument is a tag and its value: 'i'/'u' 32 bit, 'l'/'q' 64 bit,
+// 'd' double, 'p' pointer (u32), 's' u16 length and the characters.
+//
+// %s arguments are read up to their NUL (at most STM32_LOG_STRING_MAX
+// bytes) when they are logged, not when they are printed; data that isn't
+// NUL terminated (e.g. "%.*s") belongs in TRACE_BUFFER().
+
+#ifndef STM32_LOG_STRING_MAX
+#define STM32_LOG_STRING_MAX 512		// Longest %s argument recorded
+#endif
+#ifndef STM32_LOG_BUFFER_CHUNK
+#define STM32_LOG_BUFFER_CHUNK 256		// TRACE_BUFFER() data per frame
+#endif
+
+// Log levels
+//
+// Every subsystem has a level fixed at compile time (STM32_LOG_LEVEL_<name>,
+// default STM32_LOG_LEVEL: LOG_TRACE in DEBUG builds, LOG_INFO otherwise).
+// LOG_ENABLED() is a constant false above it, so the message, its arguments
+// and the test compile to nothing. Levels that are compiled in can still be
+// switched off and on at run time with Log::SetLevel(), which edits a mask
+// of one byte per subsystem, bit n for level n.
+//
+//    LOG_MSG(LOG_AT, LOG_DEBUG, "Response : %s\r\n", Text);
+//    if (LOG_ENABLED(LOG_AT, LOG_TRACE))
+//        Base()->GetDebug()->TRACE_VECTOR("SR", Data);
+
+#ifndef STM32_LOG_LEVEL
+#ifdef DEBUG
+#define STM32_LOG_LEVEL LOG_TRACE
+#else
+#define STM32_LOG_LEVEL LOG_INFO
+#endif
+#endif
+#ifndef STM32_LOG_LEVEL_SERIAL
+#define STM32_LOG_LEVEL_SERIAL STM32_LOG_LEVEL	// STM32SerialSocket
+#endif
+#ifndef STM32_LOG_LEVEL_AT
+#define STM32_LOG_LEVEL_AT STM32_LOG_LEVEL		// ESP8266 commands and responses
+#endif
+#ifndef STM32_LOG_LEVEL_TCP
+#define STM32_LOG_LEVEL_TCP STM32_LOG_LEVEL		// STM32TCPSocket
+#endif
+#ifndef STM32_LOG_LEVEL_APP
+#define STM32_LOG_LEVEL_APP STM32_LOG_LEVEL		// The application
+#endif
+#ifndef STM32_LOG_RUNTIME_LEVEL
+#define STM32_LOG_RUNTIME_LEVEL LOG_DEBUG		// Run-time level of every subsystem at boot
+#endif
+
+#define LOG_ENABLED(SUBSYSTEM, LEVEL) \
+	(std::integral_constant<bool, EPRI::Log::Compiled(EPRI::Log::SUBSYSTEM, EPRI::Log::LEVEL)>::value and \
+		EPRI::Log::Enabled(EPRI::Log::SUBSYSTEM, EPRI::Log::LEVEL))
+
+#define LOG_MSG(SUBSYSTEM, LEVEL, FORMAT, ...) \
+	do { \
+		if (LOG_ENABLED(SUBSYSTEM, LEVEL)) \
+			LOG_PRINTF(FORMAT, ##__VA_ARGS__); \
+	} while (0)
+
+#ifdef LOG_DEFERRED
+#define LOG_PRINTF(FORMAT, ...) \
+	do { \
+		static const char _LogFormat[] __attribute__((section(".logfmt"), used)) = FORMAT; \
+		EPRI::Log::Format(_LogFormat, ##__VA_ARGS__); \
+	} while (0)
+#else
+#define LOG_PRINTF(FORMAT, ...) printf(FORMAT, ##__VA_ARGS__)
+#endif
+
+namespace EPRI
+{
+	namespace Log
+	{
+		enum : uint8_t { FRAME_SYNC = 0xA5 };
+
+		enum Subsystem : uint8_t
+		{
+			LOG_SERIAL,
+			LOG_AT,
+			LOG_TCP,
+			LOG_APP,
+			LOG_SUBSYSTEMS
+		};
+
+		enum Level : uint8_t
+		{
+			LOG_NONE = 0,
+			LOG_ERROR = 1,		// Failures
+			LOG_INFO = 2,		// State changes: joined, server started...
+			LOG_DEBUG = 3,		// Every command and response
+			LOG_TRACE = 4		// Hex dumps of the serial traffic
+		};
+
+		constexpr bool Compiled(Subsystem Which, Level Verbosity)
+		{
+			return Verbosity != LOG_NONE and Verbosity <=
+				((Which == LOG_SERIAL) ? STM32_LOG_LEVEL_SERIAL :
+				(Which == LOG_AT) ? STM32_LOG_LEVEL_AT :
+				(Which == LOG_TCP) ? STM32_LOG_LEVEL_TCP : STM32_LOG_LEVEL_APP);
+		}
+
+		extern volatile uint32_t Mask;		// Run-time levels, see SetLevel()
+
+		inline bool Enabled(Subsystem Which, Level Verbosity)
+		{
+			return (Mask >> (8 * Which + Verbosity)) & 1U;
+		}
+
+		// SetLevel()
+		// Shows the levels of [Which] up to [Verbosity] (LOG_NONE: nothing);
+		// a level that isn't compiled in stays silent.
+		void SetLevel(Subsystem Which, Level Verbosity);
+		Level GetLevel(Subsystem Which);
+
+		enum FrameType : uint8_t
+		{
+			FRAME_FORMAT = 'F',
+			FRAME_BUFFER = 'B',
+			FRAME_TEXT = 'T'
+		};
+
+		enum BufferFlags : uint8_t
+		{
+			BUFFER_FIRST = 0x01,	// Starts with the marker line
+			BUFFER_LAST = 0x02,		// Ends the dump
+			BUFFER_OFFSET = 0x04,	// STM32Debug::TRACE_OFFSET
+			BUFFER_ASCII = 0x08		// STM32Debug::TRACE_ASCII
+		};
+
+		// One frame written straight into the log ring (STM32Debug.cpp). The
+		// length is given up front so writers claim their space in one go.
+		class Frame
+		{
+		public:
+			bool Begin(FrameType Type, size_t PayloadLength);	// false: ring full, frame dropped
+			void Put(const void * Data, size_t Length);
+			void End();
+
+		private:
+			uint32_t m_Start = 0;
+			uint32_t m_Position = 0;
+			size_t m_Size = 0;
+			uint8_t m_Check = 0;
+			bool m_Active = false;
+		};
+
+		void Text(const char * Data, size_t Length);
+		size_t Room();		// Bytes the log ring can take right now
+		void Buffer(const char * Marker, const uint8_t * Data, size_t Size, uint8_t BytesPerLine, uint8_t Columns = 0);
+
+		//////////////////////
+		// Argument Records //
+		//////////////////////
+		inline size_t StringLength(const char * Value)
+		{
+			return (Value == nullptr) ? 0 : strnlen(Value, STM32_LOG_STRING_MAX);
+		}
+
+		inline size_t ArgSize(const char * Value) { return 3 + StringLength(Value); }
+		template <typename T>
+		inline size_t ArgSize(const T *) { return 5; }
+		template <typename T>
+		inline typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value, size_t>::type
+			ArgSize(T) { return (sizeof(T) > 4) ? 9 : 5; }
+		template <typename T>
+		inline typename std::enable_if<std::is_floating_point<T>::value, size_t>::type
+			ArgSize(T) { return 9; }
+
+		inline void PutArg(Frame& Out, const char * Value)
+		{
+			uint16_t Length = StringLength(Value);
+			Out.Put("s", 1);
+			Out.Put(&Length, 2);
+			Out.Put(Value, Length);
+		}
+		template <typename T>
+		inline void PutArg(Frame& Out, const T * Value)
+		{
+			uint32_t Address = (uint32_t)(uintptr_t)Value;
+			Out.Put("p", 1);
+			Out.Put(&Address, 4);
+		}
+		template <typename T>
+		inline typename std::enable_if<std::is_integral<T>::value or std::is_enum<T>::value>::type
+			PutArg(Frame& Out, T Value)
+		{
+			bool Signed = std::is_signed<T>::value;
+			if (sizeof(T) > 4)
+			{
+				uint64_t Raw = (uint64_t)Value;
+				Out.Put(Signed ? "l" : "q", 1);
+				Out.Put(&Raw, 8);
+			}
+			else
+			{
+				uint32_t Raw = Signed ? (uint32_t)(int32_t)Value : (uint32_t)Value;
+				Out.Put(Signed ? "i" : "u", 1);
+				Out.Put(&Raw, 4);
+			}
+		}
+		template <typename T>
+		inline typename std::enable_if<std::is_floating_point<T>::value>::type
+			PutArg(Frame& Out, T Value)
+		{
+			double Raw = Value;
+			Out.Put("d", 1);
+			Out.Put(&Raw, 8);
+		}
+
+		inline size_t ArgsSize() { return 0; }
+		template <typename First, typename... Rest>
+		inline size_t ArgsSize(const First& Value, const Rest&... Others)
+		{
+			return ArgSize(Value) + ArgsSize(Others...);
+		}
+
+		// Format()
+		// Use LOG_PRINTF(): [Id] must point into .logfmt.
+		template <typename... Args>
+		void Format(const char * Id, const Args&... Values)
+		{
+			Frame Out;
+			if (not Out.Begin(FRAME_FORMAT, 4 + ArgsSize(Values...)))
+				return;
+			uint32_t Address = (uint32_t)(uintptr_t)Id;
+			Out.Put(&Address, 4);
+			int Expand[] = { 0, (PutArg(Out, Values), 0)... };
+			(void)Expand;
+			Out.End();
+		}
+	}
+}
@@ -79,7 +79,7 @@
 #include <FreeRTOS.h>
 #include <timers.h>
 
-#include "functional"
+#include "Delegate.h"
 #include "ERROR_TYPE.h"
 #include "WiFiBuffer.h"
 #include "STM32Serial.h"
@@ -165,10 +165,12 @@ namespace EPRI
         friend void ::CallbackThread(void const * argument);
        
     public:
-        typedef std::function<void(ERROR_TYPE)>         ConnectCallbackFunction;
-		typedef std::function<void(ERROR_TYPE, size_t)> WriteCallbackFunction;
-		typedef std::function<void(ERROR_TYPE, size_t)> ReadCallbackFunction;
-		typedef std::function<void(ERROR_TYPE)>         CloseCallbackFunction;
+        // Called from CallbackThread and the socket's own tasks; see Delegate.h
+        // for what they can hold (nothing that allocates).
+        typedef Delegate<void(ERROR_TYPE)>         ConnectCallbackFunction;
+		typedef Delegate<void(ERROR_TYPE, size_t)> WriteCallbackFunction;
+		typedef Delegate<void(ERROR_TYPE, size_t)> ReadCallbackFunction;
+		typedef Delegate<void(ERROR_TYPE)>         CloseCallbackFunction;
 		enum FlushDirection
 		{
 			RECEIVE  = 0,
@@ -117,15 +117,18 @@ namespace EPRI
 				UDP
 			}                   m_Protocol = TCP;
 			bool                m_ReuseAddress = true;
+			bool                m_PassiveReceive = false;	// TCP data is pulled with WiFiDevice::TCPReceive()
 
 			_Options(SocketMode Mode = MODE_SERVER,
 				IPVersion Version = VERSION4,
 				Protocol Prot = TCP,
-				bool ReuseAddress = true) :
+				bool ReuseAddress = true,
+				bool PassiveReceive = false) :
 				m_Mode(Mode),
 				m_IPVersion(Version),
 				m_Protocol(Prot),
-				m_ReuseAddress(ReuseAddress)
+				m_ReuseAddress(ReuseAddress),
+				m_PassiveReceive(PassiveReceive)
 			{
 			}
 
@@ -147,16 +150,17 @@ namespace EPRI
         //
         virtual ERROR_TYPE Open(const char * DestinationAddress = nullptr, int Port = DEFAULT_WiFi_PORT,
         		const char * AccessPoint = DEFAULT_ACCESSPOINT, const char * PassPhrase = DEFAULT_PASSPHRASE);
-//        virtual ConnectCallbackFunction RegisterConnectHandler(ConnectCallbackFunction Callback);
+        virtual ConnectCallbackFunction RegisterConnectHandler(ConnectCallbackFunction Callback);
         virtual ERROR_TYPE Write(const char * Data, size_t Count = 0, bool Asynchronous = false);
         virtual ERROR_TYPE Write(const WiFiBuffer& Data, bool Asynchronous = false);
 //        virtual WriteCallbackFunction RegisterWriteHandler(WriteCallbackFunction Callback);
-//        virtual ERROR_TYPE Read(WiFiBuffer * pData,
-//        	size_t ReadAtLeast = 0,
-//        	uint32_t TimeOutInMS = 0,
-//			size_t * pActualBytes = nullptr);
+        // An asynchronous read (pData == nullptr) also drives Poll(), see OnRead().
+        virtual ERROR_TYPE Read(WiFiBuffer * pData,
+        	size_t ReadAtLeast = 0,
+        	uint32_t TimeOutInMS = 0,
+			size_t * pActualBytes = nullptr);
 //        virtual bool AppendAsyncReadResult(WiFiBuffer * pData, size_t ReadAtLeast = 0);
-//        virtual ReadCallbackFunction RegisterReadHandler(ReadCallbackFunction Callback);
+        virtual ReadCallbackFunction RegisterReadHandler(ReadCallbackFunction Callback);
         virtual ERROR_TYPE Close();
 //        virtual CloseCallbackFunction RegisterCloseHandler(CloseCallbackFunction Callback);
         virtual bool IsConnected();
@@ -169,7 +173,28 @@ namespace EPRI
         //
         virtual ERROR_TYPE Flush(FlushDirection Direction);
         virtual ERROR_TYPE SetOptions(const STM32Serial::Options& SerialOpt, const STM32TCP::Options& IPOpt);
-        
+        //
+        // Non-blocking Open
+        //
+        // Progress is reported through the connect handler as
+        // JoinProgress(<event>); SUCCESSFUL once the socket is usable.
+        enum JoinEvent : uint16_t
+        {
+        	JOIN_ATTEMPT = 1,	// AT+CWJAP sent
+        	JOIN_RETRY,			// Attempt failed, waiting out the backoff
+        	JOIN_ASSOCIATED,	// Got an IP, starting the server/client
+        	JOIN_LOST			// Association dropped, rejoining
+        };
+        static ERROR_TYPE JoinProgress(JoinEvent Event);
+        // The strings must outlive the connection; they are reused on rejoin.
+        virtual ERROR_TYPE OpenAsync(const char * DestinationAddress = nullptr, int Port = DEFAULT_WiFi_PORT,
+        		const char * AccessPoint = DEFAULT_ACCESSPOINT, const char * PassPhrase = DEFAULT_PASSPHRASE);
+        // Blocks for at most about TimeSliceInMS. Returns SUCCESSFUL while online,
+        // JoinProgress(<event>) while joining, anything else on failure. Once an
+        // asynchronous read is armed the socket calls it itself, so a lost AP is
+        // rejoined without the application polling.
+        virtual ERROR_TYPE Poll(uint32_t TimeSliceInMS = WIFI_JOIN_POLL_SLICE);
+
         struct Connection {
 			std::string AccessPoint, PassPhrase;
 			IPAddress TCPAddress;
@@ -185,9 +210,21 @@ namespace EPRI
 
     private:
         void SetPortOptions();
+        void OnRead(ERROR_TYPE Error, size_t BytesReceived);
+        ERROR_TYPE ArmRead();
+        ERROR_TYPE PollUntilSettled(ERROR_TYPE RetVal);
+        ERROR_TYPE Joined();
+        ERROR_TYPE StartService();
+        void PrintBootTiming();
+        void ScheduleRetry();
 
         WiFiDevice *					m_WiFi;
         STM32TCP::Options				m_IPOptions;
+        ReadCallbackFunction			m_Handler;				// The application's read handler
+        size_t							m_ReadAtLeast = 1;		// Its asynchronous read,
+        uint32_t						m_ReadTimeout = 0;		// 0: none, see ArmRead()
+        bool							m_InReadHandler = false;
+        bool							m_ReadRequested = false;	// Re-armed by OnRead() after Poll()
 //		ConnectCallbackFunction         m_Connect;
 //		WriteCallbackFunction           m_Write;
 //		ReadCallbackFunction            m_Read;
@@ -196,6 +233,30 @@ namespace EPRI
         
         using SavedConnectionsList = std::list<Connection>;
 		SavedConnectionsList 			m_Connections;
+
+		enum JoinState : uint8_t
+		{
+			STATE_IDLE,
+			STATE_JOIN,					// Send the next AT+CWJAP
+			STATE_JOINING,				// Waiting for its answer
+			STATE_BACKOFF,				// Waiting until m_RetryAt
+			STATE_ONLINE
+		}								m_JoinState = STATE_IDLE;
+		const char *					m_Destination = nullptr;
+		int								m_Port = DEFAULT_WiFi_PORT;
+		const char *					m_AccessPoint = nullptr;
+		const char *					m_PassPhrase = nullptr;
+		uint32_t						m_Backoff = WIFI_JOIN_BACKOFF_MIN;
+		uint32_t						m_RetryAt = 0;
+		bool							m_HintedJoin = false;	// Current attempt is pinned to m_LastAP
+		bool							m_SerialOpen = false;	// USART6 opened by the constructor
+		struct
+		{
+			char						SSID[WIFI_SSID_LEN];
+			char						BSSID[WIFI_MAC_STR_LEN];
+			uint8_t						Channel;
+			bool						Valid = false;
+		}								m_LastAP;				// Where the last successful join ended up
     };
 
 }
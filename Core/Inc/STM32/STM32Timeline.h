@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+
+// Event timeline
+//
+// Built with STM32_TIMELINE, the TIMELINE_*() macros record (DWT cycle
+// count, event, argument) into a ring that tasks and ISRs write without a
+// lock, and the FreeRTOS traceTASK_SWITCHED_IN() hook (FreeRTOSConfig.h)
+// records every context switch. Once the ring is full the oldest events
+// are overwritten, so it always holds the last STM32_TIMELINE_EVENTS.
+//
+// Timeline::Dump() stops recording and prints the ring as "@TL" lines on
+// the log UART; Tools/TimelineTrace turns them into Chrome trace JSON
+// (chrome://tracing or ui.perfetto.dev).
+//
+// Without STM32_TIMELINE the macros compile to nothing.
+
+#ifndef STM32_TIMELINE_EVENTS
+#define STM32_TIMELINE_EVENTS 512		// Events kept, power of two (12 bytes each)
+#endif
+
+// X(name): the events; TL_<name> in code, <name> in the trace.
+#define STM32_TIMELINE_IDS(X) \
+	X(AT_COMMAND)		/* sendCommand() to its response; arg: command length */ \
+	X(AT_BUSY)			/* Command resent after "busy p/s"; arg: ms waited */ \
+	X(SEND)				/* TCPSend()/UDPSendTo(); arg: bytes */ \
+	X(UART_RX)			/* USART6 receive complete; arg: bytes */ \
+	X(RX_TIMEOUT)		/* vTimerCallback(); arg: bytes */ \
+	X(CALLBACK)			/* CallbackThread running the read handler; arg: bytes */ \
+	X(SOCKET_READ)		/* Socket_Read_Handler(); arg: bytes */
+
+#ifdef __cplusplus
+extern "C"
+#endif
+void TimelineTaskSwitchedIn(uint32_t TaskNumber);
+
+#ifdef __cplusplus
+namespace EPRI
+{
+	namespace Timeline
+	{
+		enum Id : uint16_t
+		{
+#define STM32_TIMELINE_ID(NAME) TL_##NAME,
+			STM32_TIMELINE_IDS(STM32_TIMELINE_ID)
+#undef STM32_TIMELINE_ID
+			TL_IDS
+		};
+
+		enum Kind : uint8_t
+		{
+			TL_BEGIN = 'B',
+			TL_END = 'E',
+			TL_INSTANT = 'I',
+			TL_SWITCH = 'S'		// Arg: FreeRTOS task number
+		};
+
+		void Start();			// Enables the cycle counter and recording
+		void Record(Kind What, Id Which, uint32_t Arg);
+		void Dump();			// Prints and clears the ring, then records again
+
+		class Span
+		{
+		public:
+			Span(Id Which, uint32_t Arg) : m_Which(Which) { Record(TL_BEGIN, Which, Arg); }
+			~Span() { Record(TL_END, m_Which, 0); }
+			Span(const Span&) = delete;
+			Span& operator=(const Span&) = delete;
+
+		private:
+			Id m_Which;
+		};
+	}
+}
+
+#ifdef STM32_TIMELINE
+#define TIMELINE_START()				EPRI::Timeline::Start()
+#define TIMELINE_BEGIN(ID, ARG)			EPRI::Timeline::Record(EPRI::Timeline::TL_BEGIN, EPRI::Timeline::ID, (ARG))
+#define TIMELINE_END(ID, ARG)			EPRI::Timeline::Record(EPRI::Timeline::TL_END, EPRI::Timeline::ID, (ARG))
+#define TIMELINE_INSTANT(ID, ARG)		EPRI::Timeline::Record(EPRI::Timeline::TL_INSTANT, EPRI::Timeline::ID, (ARG))
+#define TIMELINE_SPAN(ID, ARG)			EPRI::Timeline::Span _TimelineSpan(EPRI::Timeline::ID, (ARG))
+#define TIMELINE_DUMP()					EPRI::Timeline::Dump()
+#else
+#define TIMELINE_START()				do {} while (0)
+#define TIMELINE_BEGIN(ID, ARG)			do {} while (0)
+#define TIMELINE_END(ID, ARG)			do {} while (0)
+#define TIMELINE_INSTANT(ID, ARG)		do {} while (0)
+#define TIMELINE_SPAN(ID, ARG)			do {} while (0)
+#define TIMELINE_DUMP()					do {} while (0)
+#endif
+#endif
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+
+// Delegate
+//
+// Callback with fixed inline storage, used where std::function was: it
+// never allocates, copies as plain bytes, and a call is one indirect jump
+// through the stored thunk. It holds one of
+//    - a free function (or captureless lambda)
+//    - a functor or lambda capturing up to Size bytes, trivially copyable:
+//      capture pointers and values, not containers or std::string
+//    - an object and one of its member functions, see Bind()
+// A functor that doesn't fit fails to compile rather than going to the heap.
+//
+//    Delegate<void(ERROR_TYPE, size_t)> OnRead = Socket_Read_Handler;
+//    OnRead = [pSocket](ERROR_TYPE Error, size_t Bytes) { ... };
+//    OnRead = Delegate<void(ERROR_TYPE, size_t)>::Bind<Server, &Server::OnRead>(this);
+
+namespace EPRI
+{
+	template <typename Signature, size_t Size = 2 * sizeof(void *)>
+	class Delegate;
+
+	template <typename R, typename... Args, size_t Size>
+	class Delegate<R(Args...), Size>
+	{
+	public:
+		typedef R (*Function)(Args...);
+
+		Delegate() = default;
+		Delegate(std::nullptr_t) {}
+		Delegate(Function Target)
+		{
+			if (Target != nullptr)
+				Store(Target, &CallFunction);
+		}
+		template <typename F, typename = typename std::enable_if<
+			not std::is_function<F>::value
+			and not std::is_same<typename std::decay<F>::type, Delegate>::value>::type>
+		Delegate(const F& Functor)
+		{
+			static_assert(sizeof(F) <= Size, "Functor does not fit the delegate storage");
+			static_assert(alignof(F) <= alignof(void *), "Functor is over-aligned for the delegate storage");
+			static_assert(std::is_trivially_copyable<F>::value, "Functor must be trivially copyable");
+			Store(Functor, &CallFunctor<F>);
+		}
+
+		// Bind()
+		// Input: [Object] the member function is called on; it must outlive the delegate
+		template <typename T, R (T::*Method)(Args...)>
+		static Delegate Bind(T * Object)
+		{
+			Delegate RetVal;
+			RetVal.Store(Object, &CallMethod<T, Method>);
+			return RetVal;
+		}
+
+		explicit operator bool() const { return m_Invoke != nullptr; }
+		bool operator==(std::nullptr_t) const { return m_Invoke == nullptr; }
+		bool operator!=(std::nullptr_t) const { return m_Invoke != nullptr; }
+
+		// Calling an empty delegate is a null call, as it was a
+		// std::bad_function_call: test it first.
+		R operator()(Args... Arguments) const
+		{
+			return m_Invoke(m_Storage, static_cast<Args&&>(Arguments)...);
+		}
+
+	private:
+		typedef R (*Invoke)(const void *, Args&&...);
+
+		template <typename T>
+		void Store(const T& Target, Invoke Thunk)
+		{
+			new (m_Storage) T(Target);
+			m_Invoke = Thunk;
+		}
+
+		static R CallFunction(const void * Storage, Args&&... Arguments)
+		{
+			return (*static_cast<const Function *>(Storage))(static_cast<Args&&>(Arguments)...);
+		}
+
+		template <typename F>
+		static R CallFunctor(const void * Storage, Args&&... Arguments)
+		{
+			return (*static_cast<const F *>(Storage))(static_cast<Args&&>(Arguments)...);
+		}
+
+		template <typename T, R (T::*Method)(Args...)>
+		static R CallMethod(const void * Storage, Args&&... Arguments)
+		{
+			return ((*static_cast<T * const *>(Storage))->*Method)(static_cast<Args&&>(Arguments)...);
+		}
+
+		Invoke m_Invoke = nullptr;
+		alignas(void *) unsigned char m_Storage[Size] = {};
+	};
+}
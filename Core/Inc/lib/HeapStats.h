@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Heap statistics
+//
+// operator new/delete (FreeRTOSNew.cpp) put an 8 byte header in front of
+// every block, holding the requested size and the caller, so delete can
+// take the block off the live counts. The heap_4 side (free bytes, largest
+// free block) covers every pvPortMalloc() user, the kernel included.
+//
+// Sizes up to 128 bytes come from pools of fixed size blocks, one per size
+// class, taken and given back without a lock. A pool's arena is a single
+// heap_4 block allocated on the first new, or a static array when built
+// with STM32_STATIC_ALLOCATION. When a pool is empty its sizes
+// fall back to heap_4; HEAP_POOL_<size> sets the number of blocks, 0 sends
+// that class straight to heap_4.
+//
+// With HEAP_STATS_SITES > 0, live bytes are also counted per call site,
+// by the return address of operator new: look the addresses up in the map
+// file or with addr2line. For containers the site is inside the library
+// (e.g. std::vector growth), which still tells the allocation pattern.
+
+#ifndef HEAP_STATS_SITES
+#define HEAP_STATS_SITES 0		// Call sites tracked; 0 turns tagging off
+#endif
+
+#define HEAP_POOLS 4			// Payloads of 16, 32, 64 and 128 bytes
+#ifndef HEAP_POOL_16
+#define HEAP_POOL_16 64			// Blocks of each pool, 8 byte header included in the block
+#endif
+#ifndef HEAP_POOL_32
+#define HEAP_POOL_32 48
+#endif
+#ifndef HEAP_POOL_64
+#define HEAP_POOL_64 32
+#endif
+#ifndef HEAP_POOL_128
+#define HEAP_POOL_128 16
+#endif
+
+namespace EPRI
+{
+	struct HeapStats
+	{
+		// Block sizes: up to 16, 32, 64... 1024 bytes, then larger.
+		static const size_t BUCKETS = 8;
+
+		// operator new/delete
+		uint32_t liveBytes;					// Requested, without headers
+		uint32_t peakBytes;
+		uint32_t liveBlocks;
+		uint32_t allocations;				// Since boot
+		uint32_t frees;
+		uint32_t failures;					// new returning nullptr
+		uint32_t bucketAllocations[BUCKETS];	// Since boot
+		uint32_t bucketLive[BUCKETS];
+
+		// heap_4, pool arenas counted as allocated
+		size_t heapFree;
+		size_t heapMinimumEverFree;
+		size_t largestFreeBlock;
+		size_t freeBlocks;
+		uint32_t mallocFailures;			// vApplicationMallocFailedHook()
+		uint32_t stackOverflows;			// vApplicationStackOverflowHook()
+
+		// Fragmentation()
+		// Output: percentage of the free heap outside the largest free
+		// block; 0 when all of it can be had in one allocation.
+		uint8_t Fragmentation() const
+		{
+			return (heapFree == 0) ? 0 : 100 - (uint8_t)((uint64_t)largestFreeBlock * 100 / heapFree);
+		}
+	};
+
+	struct HeapSite
+	{
+		uintptr_t caller;					// Return address of operator new
+		uint32_t liveBytes;
+		uint32_t liveBlocks;
+		uint32_t allocations;				// Since boot
+	};
+
+	struct HeapPoolStats
+	{
+		size_t blockSize;					// Largest request served
+		uint16_t blocks;					// 0: arena couldn't be allocated or pool disabled
+		uint32_t free;
+		uint32_t minimumFree;				// Low water mark
+		uint32_t allocations;				// Since boot
+		uint32_t exhausted;					// Requests sent to heap_4 while empty
+	};
+
+	void GetHeapStats(HeapStats& Stats);
+	// GetHeapSites()
+	// Output: number of sites copied to [Sites], at most [Count]
+	size_t GetHeapSites(HeapSite * Sites, size_t Count);
+	size_t GetHeapPools(HeapPoolStats * Stats, size_t Count);
+	void DumpHeapStats();					// printf(), from a task
+}
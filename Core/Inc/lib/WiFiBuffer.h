@@ -32,6 +32,7 @@ public:
 	size_t Append(const std::string& Value);
 	size_t Append(const std::vector<uint8_t>& Value);
 	size_t AppendExtra(size_t Count);
+	void Truncate(size_t Size);
 	void Clear();
 
 	bool Get(std::string * pValue, size_t Count, bool Append = false);
@@ -56,6 +56,7 @@ void TIM1_UP_TIM10_IRQHandler(void);
 void USART3_IRQHandler(void);
 void USART6_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void DMA1_Stream3_IRQHandler(void);
 
 /* USER CODE END EFP */
 
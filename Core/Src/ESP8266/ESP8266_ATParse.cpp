@@ -0,0 +1,339 @@
+#include <string.h>
+
+#include "ESP8266_ATParse.h"
+
+namespace ESP8266AT
+{
+	//////////////////////
+	// Character Table  //
+	//////////////////////
+	namespace {
+	enum : uint8_t
+	{
+		CC_DIGIT	= 0x01,
+		CC_HEX		= 0x02,
+		CC_EOL		= 0x04,	// '\r', '\n', and NUL padding after a short read
+		CC_STOP		= 0x08,	// Ends an unquoted field: ',' or end of line
+	};
+
+	enum : uint8_t
+	{
+		D = CC_DIGIT | CC_HEX,
+		H = CC_HEX,
+		E = CC_EOL | CC_STOP,
+		S = CC_STOP,
+	};
+
+	// Indexed by character; bytes >= 0x80 belong to no class.
+	static const uint8_t s_Class[256] =
+	{
+		E, 0, 0, 0, 0, 0, 0, 0, 0, 0, E, 0, 0, E, 0, 0,	// 0x00
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x10
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0,	// 0x20
+		D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0,	// 0x30
+		0, H, H, H, H, H, H, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x40
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x50
+		0, H, H, H, H, H, H, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x60
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	// 0x70
+	};
+
+	static inline bool is(char c, uint8_t cls)
+	{
+		return s_Class[(uint8_t)c] & cls;
+	}
+
+	static inline uint8_t hexValue(char c)
+	{
+		return is(c, CC_DIGIT) ? c - '0' : (c | 0x20) - 'a' + 10;
+	}
+	}
+
+	//////////
+	// Span //
+	//////////
+	bool Span::Equals(const char * text) const
+	{
+		size_t len = strlen(text);
+		return Size() == len and memcmp(Begin, text, len) == 0;
+	}
+
+	bool Span::StartsWith(const char * text) const
+	{
+		size_t len = strlen(text);
+		return Size() >= len and memcmp(Begin, text, len) == 0;
+	}
+
+	const char * Span::Find(const char * text) const
+	{
+		size_t len = strlen(text);
+		if (len == 0 or Size() < len)
+			return nullptr;
+		for (const char * p = Begin; p + len <= End; p++)
+		{
+			p = (const char *)memchr(p, text[0], End - p);
+			if (p == nullptr or p + len > End)
+				return nullptr;
+			if (memcmp(p, text, len) == 0)
+				return p;
+		}
+		return nullptr;
+	}
+
+	/////////////////
+	// FieldReader //
+	/////////////////
+	// Types the driver reads; checked in the target build, where long is 32 bits.
+	static_assert(IntRange<uint8_t>::Exact and IntRange<uint16_t>::Exact and IntRange<uint32_t>::Exact,
+		"Int() bounds wrap for an unsigned field type");
+	static_assert(IntRange<int8_t>::Exact and IntRange<int16_t>::Exact and IntRange<int32_t>::Exact,
+		"Int() bounds wrap for a signed field type");
+	static_assert(IntRange<size_t>::Exact and IntRange<long>::Exact and IntRange<unsigned long>::Exact,
+		"Int() bounds wrap for a native field type");
+
+	// endField()
+	// p points just past a field; accepts it if a separator or the end of
+	// the line follows.
+	bool FieldReader::endField(const char * p)
+	{
+		if (p == m_End)
+		{
+			m_Pos = p;
+			return true;
+		}
+		if (*p == ',')
+		{
+			m_Pos = p + 1;
+			return true;
+		}
+		return false;
+	}
+
+	bool FieldReader::Int(long& value)
+	{
+		const char * p = m_Pos;
+		bool negative = (p < m_End and *p == '-');
+		if (negative)
+			p++;
+		if (p == m_End or not is(*p, CC_DIGIT))
+			return false;
+
+		unsigned long v = 0;
+		for (; p < m_End and is(*p, CC_DIGIT); p++)
+		{
+			unsigned long d = *p - '0';
+			if (v > ((unsigned long)std::numeric_limits<long>::max() - d) / 10)
+				return false;	// Overflow
+			v = v * 10 + d;
+		}
+		if (not endField(p))
+			return false;
+		value = negative ? -(long)v : (long)v;
+		return true;
+	}
+
+	bool FieldReader::Int(unsigned long& value)
+	{
+		const char * p = m_Pos;
+		if (p == m_End or not is(*p, CC_DIGIT))
+			return false;
+
+		unsigned long v = 0;
+		for (; p < m_End and is(*p, CC_DIGIT); p++)
+		{
+			unsigned long d = *p - '0';
+			if (v > (std::numeric_limits<unsigned long>::max() - d) / 10)
+				return false;	// Overflow
+			v = v * 10 + d;
+		}
+		if (not endField(p))
+			return false;
+		value = v;
+		return true;
+	}
+
+	bool FieldReader::Quoted(Span& value)
+	{
+		const char * p = m_Pos;
+		if (p == m_End or *p != '"')
+			return false;
+		const char * begin = ++p;
+		for (; p < m_End and *p != '"'; p++)
+		{
+			if (*p == '\\' and p + 1 < m_End)
+				p++;
+		}
+		if (p == m_End)
+			return false;	// Unterminated
+		const char * end = p;
+		if (not endField(p + 1))
+			return false;
+		value = Span(begin, end);
+		return true;
+	}
+
+	bool FieldReader::Word(Span& value)
+	{
+		const char * p = m_Pos;
+		while (p < m_End and not is(*p, CC_STOP))
+			p++;
+		const char * begin = m_Pos;
+		if (not endField(p))
+			return false;
+		value = Span(begin, p);
+		return true;
+	}
+
+	bool FieldReader::String(char * dst, size_t dstLen)
+	{
+		if (dstLen == 0)
+			return false;
+		const char * start = m_Pos;
+		Span value;
+		bool quoted = (m_Pos < m_End and *m_Pos == '"');
+		if (not (quoted ? Quoted(value) : Word(value)))
+			return false;
+
+		size_t n = 0;
+		for (const char * p = value.Begin; p < value.End; p++)
+		{
+			if (quoted and *p == '\\' and p + 1 < value.End)
+				p++;
+			if (n + 1 >= dstLen)
+			{
+				m_Pos = start;
+				return false;	// Doesn't fit
+			}
+			dst[n++] = *p;
+		}
+		dst[n] = '\0';
+		return true;
+	}
+
+	bool FieldReader::IP(IPAddress& ip)
+	{
+		const char * p = m_Pos;
+		bool quoted = (p < m_End and *p == '"');
+		if (quoted)
+			p++;
+
+		IPAddress result;
+		for (uint8_t i = 0; i < 4; i++)
+		{
+			if (i > 0)
+			{
+				if (p == m_End or *p != '.')
+					return false;
+				p++;
+			}
+			unsigned int octet = 0;
+			uint8_t digits = 0;
+			for (; p < m_End and is(*p, CC_DIGIT); p++)
+			{
+				if (++digits > 3)
+					return false;
+				octet = octet * 10 + (*p - '0');
+			}
+			if (digits == 0 or octet > 255)
+				return false;
+			result[i] = octet;
+		}
+
+		if (quoted)
+		{
+			if (p == m_End or *p != '"')
+				return false;
+			p++;
+		}
+		if (not endField(p))
+			return false;
+		ip = result;
+		return true;
+	}
+
+	bool FieldReader::MAC(uint8_t (&mac)[6])
+	{
+		const char * p = m_Pos;
+		bool quoted = (p < m_End and *p == '"');
+		if (quoted)
+			p++;
+
+		uint8_t result[6];
+		for (uint8_t i = 0; i < 6; i++)
+		{
+			if (i > 0)
+			{
+				if (p == m_End or *p != ':')
+					return false;
+				p++;
+			}
+			if (m_End - p < 2 or not is(p[0], CC_HEX) or not is(p[1], CC_HEX))
+				return false;
+			result[i] = (hexValue(p[0]) << 4) | hexValue(p[1]);
+			p += 2;
+		}
+
+		if (quoted)
+		{
+			if (p == m_End or *p != '"')
+				return false;
+			p++;
+		}
+		if (not endField(p))
+			return false;
+		memcpy(mac, result, sizeof result);
+		return true;
+	}
+
+	bool FieldReader::Skip()
+	{
+		Span ignored;
+		if (m_Pos < m_End and *m_Pos == '"')
+			return Quoted(ignored);
+		return Word(ignored);
+	}
+
+	//////////
+	// Line //
+	//////////
+	bool Line::Is(const char * tag) const
+	{
+		if (not Tag.StartsWith(tag))
+			return false;
+		Span suffix(Tag.Begin + strlen(tag), Tag.End);
+		return suffix.Empty() or suffix.Equals("_CUR") or suffix.Equals("_DEF");
+	}
+
+	/////////////////////
+	// ResponseScanner //
+	/////////////////////
+
+	// Next()
+	// Output:
+	//    - true: line holds the next non-empty line
+	//    - false: no more lines
+	bool ResponseScanner::Next(Line& line)
+	{
+		while (m_Pos < m_End and is(*m_Pos, CC_EOL))
+			m_Pos++;
+		if (m_Pos == m_End)
+			return false;
+
+		const char * begin = m_Pos;
+		while (m_Pos < m_End and not is(*m_Pos, CC_EOL))
+			m_Pos++;
+
+		line.Text = Span(begin, m_Pos);
+		const char * colon = (const char *)memchr(begin, ':', m_Pos - begin);
+		if (colon == nullptr)
+		{
+			line.Tag = line.Text;
+			line.Fields = FieldReader(Span(m_Pos, m_Pos));
+		}
+		else
+		{
+			line.Tag = Span(begin, colon);
+			line.Fields = FieldReader(Span(colon + 1, m_Pos));
+		}
+		return true;
+	}
+}
@@ -1,35 +1,70 @@
 #include "cmsis_os.h"
 #include <ESP8266_WiFi.h>
-
-#define WIFI_DISABLE_ECHO
+#include "STM32Debug.h"
+#include "STM32Log.h"
+#include "STM32Timeline.h"
 
 ////////////////////////
 // Buffer Definitions //
 ////////////////////////
-WiFiBuffer wifiTxBuffer;
 WiFiBuffer wifiRxBuffer(WIFI_RX_BUFFER_LEN);
 
 ////////////////////
 // Initialization //
 ////////////////////
 
+static size_t countDigits(size_t value)
+{
+	size_t digits = 1;
+	while (value >= 10)
+	{
+		value /= 10;
+		digits++;
+	}
+	return digits;
+}
+
 ESP8266Device::ESP8266Device(WiFi_GPIO_Pin Reset /*= {0,0}*/, WiFi_GPIO_Pin Enable /*= {0,0}*/)
 	: WiFiDevice()
 	, m_Reset(Reset)
 	, m_Enable(Enable)
 {
+	m_Status.stat = WIFI_STATUS_NOWIFI;
 	for (int i=0; i<WIFI_MAX_SOCK_NUM; i++)
+	{
 		m_State[i] = AVAILABLE;
+		m_Status.ipstatus[i].linkID = 255;
+	}
 }
 
+// Begin()
+// Boot sequence: reset, then read back what the module came up with
+// (CWMODE_DEF and an auto-joined AP survive the reset) so only commands
+// that change something get sent. Each step is timed into m_Boot.
+// Echo comes back on with every reset and is turned off; the responses
+// are still parsed correctly with it on.
 bool ESP8266Device::Begin(STM32TCPSocket * pSocket)		// OK if sendCommand and readForResponse are OK
 {
 	m_Serial = pSocket;
+	m_Boot.Start();
 	Reset();
+	m_Boot.Step(WIFI_BOOT_RESET);
 	if(Test())
 	{
-		if(!WiFiSetMode(WIFI_MODE_STA))
+		Echo(false);
+		int16_t mode = WiFiGetMode();
+		int16_t mux = queryInt<ESP8266AT::TCP_MULTIPLE>();
+		int16_t transferMode = queryInt<ESP8266AT::TRANSMISSION_MODE>();
+		if (mux >= 0)
+			m_Mux = (mux > 0);
+		m_TransferMode = transferMode;
+		TCPUpdateStatus();
+		m_Boot.Step(WIFI_BOOT_PROBE);
+
+		bool modeMatches = (mode == WIFI_MODE_STA);
+		if(!modeMatches and WiFiSetMode(WIFI_MODE_STA) <= 0)
 			return false;
+		m_Boot.Step(WIFI_BOOT_MODE, modeMatches);
 		return true;
 	}
 
@@ -42,7 +77,7 @@ bool ESP8266Device::Begin(STM32TCPSocket * pSocket)		// OK if sendCommand and re
 
 bool ESP8266Device::Test()
 {
-	sendCommand(ESP8266_TEST); // Send AT
+	sendExecute<ESP8266AT::TEST>(); // Send AT
 
 	if (readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT) > 0)
 		return true;
@@ -50,20 +85,32 @@ bool ESP8266Device::Test()
 	return false;
 }
 
+// Reset()
+// Returns once the firmware prints "ready", not after a fixed delay. With a
+// reset pin the pulse alone restarts the module; AT+RST is only sent without one.
 bool ESP8266Device::Reset()
 {
+	m_DatagramInfo = false;
+	m_Mux = 0;
+	m_TransferMode = 0;
+	m_PassiveRecv = false;
+	memset(m_RecvPending, 0, sizeof(m_RecvPending));
+	for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+		dropQueued(i);
+	m_StatusValid = false;
+	m_Status.stat = WIFI_STATUS_NOWIFI;
+
 	if(m_Reset.Pin)
 	{
 		HAL_GPIO_WritePin(m_Reset.GPIO_Port, m_Reset.Pin, GPIO_PIN_RESET);
-		osDelay(1000);
+		osDelay(WIFI_RESET_PULSE);
 		HAL_GPIO_WritePin(m_Reset.GPIO_Port, m_Reset.Pin, GPIO_PIN_SET);
-		this->Read(1000);
-		this->Flush();
 	}
+	else
+		sendExecute<ESP8266AT::RESET>(); // Send AT+RST
 
-	sendCommand(ESP8266_RESET); // Send AT+RST
-	
-	if (readForResponse(RESPONSE_READY, COMMAND_RESET_TIMEOUT) > 0 and osOK == osDelay(2000))
+	// The boot ROM's 74880 baud output comes first and is skipped over.
+	if (readForResponse(RESPONSE_READY, COMMAND_RESET_TIMEOUT) > 0)
 		return true;
 	
 	return false;
@@ -91,9 +138,9 @@ bool ESP8266Device::Disable()
 bool ESP8266Device::Echo(bool enable)
 {
 	if (enable)
-		sendCommand(ESP8266_ECHO_ENABLE);
+		sendExecute<ESP8266AT::ECHO_ENABLE>();
 	else
-		sendCommand(ESP8266_ECHO_DISABLE);
+		sendExecute<ESP8266AT::ECHO_DISABLE>();
 	
 	if (readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT) > 0)
 		return true;
@@ -103,18 +150,12 @@ bool ESP8266Device::Echo(bool enable)
 
 bool ESP8266Device::SetBaud(unsigned long baud)
 {
-	char parameters[16];
-	memset(parameters, 0, 16);
-
 	// Constrain parameters:
 	baud = std::max(110UL, baud);
 	baud = std::min(baud, 115200UL);
 	
-	// Put parameters into string
-	sprintf(parameters, "%lu,8,1,0,0", baud);
-	
 	// Send AT+UART=baud,databits,stopbits,parity,flowcontrol
-	sendCommand(ESP8266_UART, WIFI_CMD_SETUP, WiFiBuffer(parameters, strlen(parameters)));
+	sendSetup<ESP8266AT::UART>(baud, 8, 1, 0, 0);
 	
 	if (readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT) > 0)
 		return true;
@@ -124,7 +165,7 @@ bool ESP8266Device::SetBaud(unsigned long baud)
 
 int16_t ESP8266Device::GetVersion(char * ATversion, char * SDKversion, char * compileTime)
 {
-	sendCommand(ESP8266_VERSION); // Send AT+GMR
+	sendExecute<ESP8266AT::VERSION>(); // Send AT+GMR
 	// Example Response: AT version:0.30.0.0(Jul  3 2015 19:35:49)\r\n (43 chars)
 	//                   SDK version:1.2.0\r\n (19 chars)
 	//                   compile time:Jul  7 2015 18:34:26\r\n (36 chars)
@@ -134,30 +175,29 @@ int16_t ESP8266Device::GetVersion(char * ATversion, char * SDKversion, char * co
 	int16_t rsp = (readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT) > 0);
 	if (rsp > 0)
 	{
-		char *p, *q;
-		// Look for "AT version" in the rxBuffer
-		p = strstr((const char *)wifiRxBuffer.GetData(), "AT version:");
-		if (p == NULL) return WIFI_RSP_UNKNOWN;
-		p += strlen("AT version:");
-		q = strchr(p, '\r'); // Look for \r
-		if (q == NULL) return WIFI_RSP_UNKNOWN;
-		strncpy(ATversion, p, q-p);
-
-		// Look for "SDK version:" in the rxBuffer
-		p = strstr((const char *)wifiRxBuffer.GetData(), "SDK version:");
-		if (p == NULL) return WIFI_RSP_UNKNOWN;
-		p += strlen("SDK version:");
-		q = strchr(p, '\r'); // Look for \r
-		if (q == NULL) return WIFI_RSP_UNKNOWN;
-		strncpy(SDKversion, p, q-p);
-		
-		// Look for "compile time:" in the rxBuffer
-		p = strstr((const char *)wifiRxBuffer.GetData(), "compile time:");
-		if (p == NULL) return WIFI_RSP_UNKNOWN;
-		p += strlen("compile time:");
-		q = strchr(p, '\r'); // Look for \r
-		if (q == NULL) return WIFI_RSP_UNKNOWN;
-		strncpy(compileTime, p, q-p);
+		uint8_t found = 0;
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
+		{
+			char * dst;
+			if (line.Is("AT version"))
+				dst = ATversion;
+			else if (line.Is("SDK version"))
+				dst = SDKversion;
+			else if (line.Is("compile time"))
+				dst = compileTime;
+			else
+				continue;
+			// The value contains ':' and ',' so take the rest of the line as is
+			ESP8266AT::Span value = line.Fields.Rest();
+			size_t len = std::min(value.Size(), (size_t)WIFI_VERSION_LEN - 1);
+			memcpy(dst, value.Begin, len);
+			dst[len] = '\0';
+			found++;
+		}
+		if (found < 3)
+			return WIFI_RSP_UNKNOWN;
 	}
 	
 	return rsp;
@@ -174,20 +214,21 @@ int16_t ESP8266Device::GetVersion(char * ATversion, char * SDKversion, char * co
 //    - Fail: <0 (wifi_cmd_rsp)
 int16_t ESP8266Device::WiFiGetMode()
 {
-	sendCommand(ESP8266_WIFI_MODE, WIFI_CMD_QUERY);
+	sendQuery<ESP8266AT::WIFI_MODE>();
 	
 	// Example response: \r\nAT+CWMODE_CUR?\r+CWMODE_CUR:2\r\n\r\nOK\r\n
 	// Look for the OK:
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 	if (rsp > 0)
 	{
-		// Then get the number after ':':
-		char * p = strchr((const char *)wifiRxBuffer.GetData(), ':');
-		if (p != NULL)
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
 		{
-			char mode = *(p+1);
-			if ((mode >= '1') && (mode <= '3'))
-				return (mode - 48); // Convert ASCII to decimal
+			uint8_t mode;
+			if (line.Is(ESP8266_WIFI_MODE) and line.Fields.Int(mode)
+				and (mode >= WIFI_MODE_STA) and (mode <= WIFI_MODE_STAAP))
+				return mode;
 		}
 		
 		return WIFI_RSP_UNKNOWN;
@@ -203,9 +244,7 @@ int16_t ESP8266Device::WiFiGetMode()
 //    - Fail: <0 (wifi_cmd_rsp)
 int16_t ESP8266Device::WiFiSetMode(wifi_mode mode)
 {
-	WiFiBuffer params;
-	params.Append(std::to_string(mode));
-	sendCommand(ESP8266_WIFI_MODE, WIFI_CMD_SETUP, params);
+	sendSetup<ESP8266AT::WIFI_MODE>(mode);
 	
 	return readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 }
@@ -217,25 +256,133 @@ int16_t ESP8266Device::WiFiSetMode(wifi_mode mode)
 //    - Fail: <0 (wifi_cmd_rsp)
 int16_t ESP8266Device::WiFiConnect(const char * ssid, const char * pwd)
 {
-	WiFiBuffer params;
-	params.AppendBuffer("\"", 1U);
-	params.AppendBuffer(ssid, strlen(ssid));
-	params.AppendBuffer("\"", 1U);
 	if (pwd != NULL)
+		sendSetup<ESP8266AT::CONNECT_AP>(ssid, pwd);
+	else
+		sendSetup<ESP8266AT::CONNECT_AP>(ssid);
+
+	int16_t rsp = readForResponses(RESPONSE_OK, RESPONSE_FAIL, WIFI_CONNECT_TIMEOUT);
+//	return readForResponses("WIFI CONNECTED", RESPONSE_FAIL, WIFI_CONNECT_TIMEOUT);
+	if (rsp > 0 and m_Status.stat == WIFI_STATUS_NOWIFI)
+		m_Status.stat = WIFI_STATUS_GOTIP;	// OK only comes once the address is assigned
+	return rsp;
+}
+
+// WiFiJoinStart()
+// Sends AT+CWJAP and returns without waiting; drive it with WiFiJoinPoll().
+// A bssid ("aa:bb:cc:dd:ee:ff") pins the join to that access point, which
+// skips the scan for the strongest one.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::WiFiJoinStart(const char * ssid, const char * pwd, const char * bssid /*= nullptr*/)
+{
+	if (ssid == nullptr or m_Joining or m_Passthrough)
+		return WIFI_CMD_BAD;
+
+	clearBuffer();
+	bool sent;
+	if (bssid != nullptr)
+		sent = sendSetup<ESP8266AT::CONNECT_AP>(ssid, pwd ? pwd : "", bssid);
+	else if (pwd != nullptr)
+		sent = sendSetup<ESP8266AT::CONNECT_AP>(ssid, pwd);
+	else
+		sent = sendSetup<ESP8266AT::CONNECT_AP>(ssid);
+	if (not sent)
 	{
-		params.AppendBuffer(",\"", 2U);
-		params.AppendBuffer(pwd, strlen(pwd));
-		params.AppendBuffer("\"", 1U);
+		commandBad();		// Reported here, there is no read to return it
+		return WIFI_CMD_BAD;
 	}
-	sendCommand(ESP8266_CONNECT_AP, WIFI_CMD_SETUP, params);
 
-	return readForResponses(RESPONSE_OK, RESPONSE_FAIL, WIFI_CONNECT_TIMEOUT);
-//	return readForResponses("WIFI CONNECTED", RESPONSE_FAIL, WIFI_CONNECT_TIMEOUT);
+	m_Joining = true;
+	m_JoinStarted = HAL_GetTick();
+	m_JoinLineLen = 0;
+	m_JoinReason = 0;
+	return 1;
+}
+
+// WiFiJoinPoll()
+// Consumes the answer to WiFiJoinStart() for at most timeSliceInMS, one
+// line at a time, so the caller's task is never held for the whole join.
+// No other command may be sent until this returns non-zero.
+// Output:
+//    - Success: >0 (joined and got an IP)
+//    - 0: still joining
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::WiFiJoinPoll(uint32_t timeSliceInMS /*= WIFI_JOIN_POLL_SLICE*/)
+{
+	if (not m_Joining)
+		return WIFI_CMD_BAD;
+
+	uint32_t start = HAL_GetTick();
+	for (;;)
+	{
+		uint32_t now = HAL_GetTick();
+		if (now - m_JoinStarted >= WIFI_CONNECT_TIMEOUT)
+		{
+			m_Joining = false;
+			return WIFI_RSP_TIMEOUT;
+		}
+		if (now - start >= timeSliceInMS)
+			return 0;
+
+		clearBuffer();
+		if (this->Read(timeSliceInMS - (now - start), 1, false) == 0)
+			return 0;
+		char c = wifiRxBuffer[0];
+		if (c != '\n')
+		{
+			if (c != '\r' and m_JoinLineLen < sizeof(m_JoinLine) - 1)
+				m_JoinLine[m_JoinLineLen++] = c;
+			continue;
+		}
+
+		// Example answer: WIFI DISCONNECT\r\nWIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n
+		// - or -          +CWJAP:1\r\n\r\nFAIL\r\n
+		ESP8266AT::Span line(m_JoinLine, m_JoinLine + m_JoinLineLen);
+		m_JoinLineLen = 0;
+		if (line.Equals("WIFI GOT IP"))
+			m_Status.stat = WIFI_STATUS_GOTIP;
+		else if (line.Equals("WIFI DISCONNECT"))
+			wifiDisconnected();
+		else if (line.StartsWith(ESP8266_CONNECT_AP))
+		{
+			ESP8266AT::FieldReader(ESP8266AT::Span(line.Begin + strlen(ESP8266_CONNECT_AP) + 1, line.End)).Int(m_JoinReason);
+		}
+		else if (line.Equals("OK"))
+		{
+			m_Joining = false;
+			if (m_Status.stat == WIFI_STATUS_NOWIFI)
+				m_Status.stat = WIFI_STATUS_GOTIP;
+			return 1;
+		}
+		else if (line.Equals("FAIL") or line.Equals("ERROR"))
+		{
+			m_Joining = false;
+			LOG_MSG(LOG_AT, LOG_ERROR, "Join failed (reason %d)\r\n", m_JoinReason);
+			return WIFI_RSP_FAIL;
+		}
+	}
 }
 
-int16_t ESP8266Device::WiFiGetAP(char * ssid)
+// WiFiIsAssociated()
+// From the link state cache: true once the station has an IP.
+bool ESP8266Device::WiFiIsAssociated()
+{
+	// STATUS 0/1 (AT 2.x, station idle) and 5 mean no association.
+	return m_Status.stat >= WIFI_STATUS_GOTIP and m_Status.stat <= WIFI_STATUS_DISCONNECTED;
+}
+
+// WiFiGetAP()
+// Input: ssid - at least WIFI_SSID_LEN chars
+//        bssid - optional, at least WIFI_MAC_STR_LEN chars
+//        channel - optional
+// Output:
+//    - Success: 1 (ssid filled in), 0 (not connected)
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::WiFiGetAP(char * ssid, char * bssid /*= nullptr*/, uint8_t * channel /*= nullptr*/)
 {
-	sendCommand(ESP8266_CONNECT_AP, WIFI_CMD_QUERY); // Send "AT+CWJAP?"
+	sendQuery<ESP8266AT::CONNECT_AP>(); // Send "AT+CWJAP?"
 	
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 	// Example Responses: No AP\r\n\r\nOK\r\n
@@ -243,20 +390,29 @@ int16_t ESP8266Device::WiFiGetAP(char * ssid)
 	// +CWJAP:"WiFiSSID","00:aa:bb:cc:dd:ee",6,-45\r\n\r\nOK\r\n
 	if (rsp > 0)
 	{
-		// Look for "No AP"
-		if (strstr((const char *)wifiRxBuffer.GetData(), "No AP") != NULL)
-			return 0;
-		
-		// Look for "+CWJAP"
-		char * p = strstr((const char *)wifiRxBuffer.GetData(), ESP8266_CONNECT_AP);
-		if (p != NULL)
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
 		{
-			p += strlen(ESP8266_CONNECT_AP) + 2;
-			char * q = strchr(p, '"');
-			if (q == NULL) return WIFI_RSP_UNKNOWN;
-			strncpy(ssid, p, q-p); // Copy string to temp char array:
-			return 1;
+			if (line.Tag.Equals("No AP"))
+				return 0;
+			if (line.Is(ESP8266_CONNECT_AP))
+			{
+				// +CWJAP:"ssid","bssid",channel,rssi
+				ESP8266AT::FieldReader& fields = line.Fields;
+				char mac[WIFI_MAC_STR_LEN];
+				if (not fields.String(ssid, WIFI_SSID_LEN))
+					return WIFI_RSP_UNKNOWN;
+				if (bssid == nullptr and channel == nullptr)
+					return 1;
+				if (not fields.String(bssid ? bssid : mac, WIFI_MAC_STR_LEN))
+					return WIFI_RSP_UNKNOWN;
+				if (channel != nullptr and not fields.Int(*channel))
+					return WIFI_RSP_UNKNOWN;
+				return 1;
+			}
 		}
+		return WIFI_RSP_UNKNOWN;
 	}
 	
 	return rsp;
@@ -264,12 +420,13 @@ int16_t ESP8266Device::WiFiGetAP(char * ssid)
 
 int16_t ESP8266Device::WiFiDisconnect()
 {
-	sendCommand(ESP8266_DISCONNECT); // Send AT+CWQAP
+	sendExecute<ESP8266AT::DISCONNECT>(); // Send AT+CWQAP
 	// Example response: \r\n\r\nOK\r\nWIFI DISCONNECT\r\n
 	// "WIFI DISCONNECT" comes up to 500ms _after_ OK. 
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 	if (rsp > 0)
 	{
+		wifiDisconnected();
 		rsp = readForResponse("WIFI DISCONNECT", COMMAND_RESPONSE_TIMEOUT);
 		if (rsp > 0)
 			return rsp;
@@ -280,23 +437,25 @@ int16_t ESP8266Device::WiFiDisconnect()
 }
 
 // TCPStatus()
+// Answered from the link state cache; AT+CIPSTATUS is only sent when the
+// cache is older than WIFI_STATUS_RECONCILE_PERIOD.
 // Input: none
 // Output:
-//    - Success: 2, 3, 4, or 5 (WIFI_STATUS_GOTIP, WIFI_STATUS_CONNECTED, WIFI_STATUS_DISCONNECTED, WIFI_STATUS_NOWIFI)
+//    - Success: 1 (station has an IP), 0 (no IP)
 //    - Fail: <0 (wifi_cmd_rsp)
 int16_t ESP8266Device::TCPStatus()
 {
-	int16_t statusRet = TCPUpdateStatus();
+	int16_t statusRet = reconcileStatus();
 	if (statusRet > 0)
 	{
 		switch (m_Status.stat)
 		{
-		case WIFI_STATUS_GOTIP: // 3
+		case WIFI_STATUS_GOTIP: // 2
+		case WIFI_STATUS_CONNECTED: // 3 - A link is open, see linkOpened()
 		case WIFI_STATUS_DISCONNECTED: // 4 - "Client" disconnected, not wifi
 			return 1;
 			break;
-		case WIFI_STATUS_CONNECTED: // Connected, but haven't gotten an IP
-		case WIFI_STATUS_NOWIFI: // No WiFi configured
+		case WIFI_STATUS_NOWIFI: // 5 - No WiFi configured
 			return 0;
 			break;
 		}
@@ -306,7 +465,7 @@ int16_t ESP8266Device::TCPStatus()
 
 int16_t ESP8266Device::TCPUpdateStatus()
 {
-	sendCommand(ESP8266_TCP_STATUS); // Send AT+CIPSTATUS\r\n
+	sendExecute<ESP8266AT::TCP_STATUS>(); // Send AT+CIPSTATUS\r\n
 	// Example response: (connected as client)
 	// STATUS:3\r\n
 	// +CIPSTATUS:0,"TCP","93.184.216.34",80,0\r\n\r\nOK\r\n 
@@ -314,75 +473,69 @@ int16_t ESP8266Device::TCPUpdateStatus()
 	// STATUS:3\r\n
 	// +CIPSTATUS:0,"TCP","192.168.0.100",54723,1\r\n
 	// +CIPSTATUS:1,"TCP","192.168.0.101",54724,1\r\n\r\nOK\r\n 
+	// Newer firmware adds the local port before the last field.
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 	if (rsp > 0)
 	{
-		char * p = searchBuffer("STATUS:");
-		if (p == NULL)
-			return WIFI_RSP_UNKNOWN;
-		
-		p += strlen("STATUS:");
-		m_Status.stat = (wifi_connect_status)(*p - 48);
-		
-		for (int i=0; i<WIFI_MAX_SOCK_NUM; i++)
+		bool haveStatus = false;
+		bool seen[WIFI_MAX_SOCK_NUM] = { false };
+
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
 		{
-			p = strstr(p, "+CIPSTATUS:");
-			if (p == NULL)
+			if (line.Is("STATUS"))
 			{
-				// Didn't find any IPSTATUS'. Set linkID to 255.
-				for (int j=i; j<WIFI_MAX_SOCK_NUM; j++)
-					m_Status.ipstatus[j].linkID = 255;
-				return rsp;
+				uint8_t stat;
+				if (line.Fields.Int(stat))
+				{
+					m_Status.stat = (wifi_connect_status)stat;
+					haveStatus = true;
+				}
 			}
-			else
+			else if (line.Is(ESP8266_TCP_STATUS))
 			{
-				p += strlen("+CIPSTATUS:");
-				// Find linkID:
-				uint8_t linkId = *p - 48;
-				if (linkId >= WIFI_MAX_SOCK_NUM)
-					return rsp;
-				m_Status.ipstatus[linkId].linkID = linkId;
-				
-				// Find type (p pointing at linkID):
-				p += 3; // Move p to either "T" or "U"
-				if (*p == 'T')
-					m_Status.ipstatus[linkId].type = WIFI_TCP;
-				else if (*p == 'U')
-					m_Status.ipstatus[linkId].type = WIFI_UDP;
+				ESP8266AT::FieldReader& fields = line.Fields;
+				uint8_t linkID;
+				ESP8266AT::Span type;
+				IPAddress remoteIP;
+				uint16_t port;
+				uint16_t next;		// tetype, or the local port on newer firmware
+				uint8_t tetype;
+				if (not (fields.Int(linkID) and fields.Quoted(type) and fields.IP(remoteIP)
+					and fields.Int(port) and fields.Int(next)))
+					continue;
+				if (fields.AtEnd())
+					tetype = (uint8_t)next;
+				else if (not fields.Int(tetype))
+					continue;
+				if (linkID >= WIFI_MAX_SOCK_NUM)
+					continue;
+
+				wifi_ipstatus& status = m_Status.ipstatus[linkID];
+				status.linkID = linkID;
+				if (type.Equals("TCP"))
+					status.type = WIFI_TCP;
+				else if (type.Equals("UDP"))
+					status.type = WIFI_UDP;
 				else
-					m_Status.ipstatus[linkId].type = WIFI_TYPE_UNDEFINED;
-				
-				// Find remoteIP (p pointing at first letter or type):
-				p += 6; // Move p to first digit of first octet.
-				for (uint8_t j = 0; j < 4; j++)
-				{
-					char tempOctet[4];
-					memset(tempOctet, 0, 4); // Clear tempOctet
-					
-					size_t octetLength = strspn(p, "0123456789"); // Find length of numerical string:
-					
-					strncpy(tempOctet, p, octetLength); // Copy string to temp char array:
-					m_Status.ipstatus[linkId].remoteIP[j] = atoi(tempOctet); // Move the temp char into IP Address octet
-					
-					p += (octetLength + 1); // Increment p to next octet
-				}
-				
-				// Find port (p pointing at ',' between IP and port:
-				p += 1; // Move p to first digit of port
-				char tempPort[6];
-				memset(tempPort, 0, 6);
-				size_t portLen = strspn(p, "0123456789"); // Find length of numerical string:
-				strncpy(tempPort, p, portLen);
-				m_Status.ipstatus[linkId].port = atoi(tempPort);
-				p += portLen + 1;
-				
-				// Find tetype (p pointing at tetype)
-				if (*p == '0')
-					m_Status.ipstatus[linkId].tetype = WIFI_CLIENT;
-				else if (*p == '1')
-					m_Status.ipstatus[linkId].tetype = WIFI_SERVER;
+					status.type = WIFI_TYPE_UNDEFINED;
+				status.remoteIP = remoteIP;
+				status.port = port;
+				status.tetype = tetype ? WIFI_SERVER : WIFI_CLIENT;
+				seen[linkID] = true;
 			}
 		}
+
+		if (not haveStatus)
+			return WIFI_RSP_UNKNOWN;
+
+		// Links that weren't listed are closed
+		for (int i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+			if (not seen[i])
+				m_Status.ipstatus[i].linkID = 255;
+		m_StatusValid = true;
+		m_StatusUpdated = HAL_GetTick();
 	}
 	
 	return rsp;
@@ -395,7 +548,7 @@ int16_t ESP8266Device::TCPUpdateStatus()
 //    - Fail: 0
 IPAddress ESP8266Device::WiFiLocalIP()
 {
-	sendCommand(ESP8266_GET_LOCAL_IP); // Send AT+CIFSR\r\n
+	sendExecute<ESP8266AT::GET_LOCAL_IP>(); // Send AT+CIFSR\r\n
 	// Example Response: +CIFSR:STAIP,"192.168.0.114"\r\n
 	//                   +CIFSR:STAMAC,"18:fe:34:9d:b7:d9"\r\n
 	//                   \r\n
@@ -404,85 +557,146 @@ IPAddress ESP8266Device::WiFiLocalIP()
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 	if (rsp > 0)
 	{
-		// Look for "STAIP" in the rxBuffer
-		char * p = strstr((const char *)wifiRxBuffer.GetData(), "STAIP");
-		if (p != NULL)
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
 		{
+			ESP8266AT::Span kind;
 			IPAddress returnIP;
-			
-			p += 7; // Move p seven places. (skip STAIP,")
-			for (uint8_t i = 0; i < 4; i++)
-			{
-				char tempOctet[4];
-				memset(tempOctet, 0, 4); // Clear tempOctet
-				
-				size_t octetLength = strspn(p, "0123456789"); // Find length of numerical string:
-				if (octetLength >= 4) // If it's too big, return an error
-					return WIFI_RSP_UNKNOWN;
-				
-				strncpy(tempOctet, p, octetLength); // Copy string to temp char array:
-				returnIP[i] = atoi(tempOctet); // Move the temp char into IP Address octet
-				
-				p += (octetLength + 1); // Increment p to next octet
-			}
-			
-			return returnIP;
+			if (line.Is(ESP8266_GET_LOCAL_IP) and line.Fields.Word(kind) and kind.Equals("STAIP")
+				and line.Fields.IP(returnIP))
+				return returnIP;
 		}
+		return WIFI_RSP_UNKNOWN;
 	}
 	
 	return rsp;
 }
 
+// WiFiLocalMAC()
+// Input: mac - at least WIFI_MAC_STR_LEN chars
+// Output:
+//    - Success: 1 (mac filled in as "aa:bb:cc:dd:ee:ff")
+//    - Fail: <0 (wifi_cmd_rsp)
 int16_t ESP8266Device::WiFiLocalMAC(char * mac)
 {
-	sendCommand(ESP8266_GET_STA_MAC, WIFI_CMD_QUERY); // Send "AT+CIPSTAMAC?"
+	sendQuery<ESP8266AT::GET_STA_MAC>(); // Send "AT+CIPSTAMAC?"
+	// Example Response: +CIPSTAMAC:"18:fe:34:9d:b7:d9"\r\n\r\nOK\r\n
 
 	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
 
 	if (rsp > 0)
 	{
-		// Look for "+CIPSTAMAC"
-		char * p = strstr((const char *)wifiRxBuffer.GetData(), ESP8266_GET_STA_MAC);
-		if (p != NULL)
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
 		{
-			p += strlen(ESP8266_GET_STA_MAC) + 2;
-			char * q = strchr(p, '"');
-			if (q == NULL) return WIFI_RSP_UNKNOWN;
-			p = ++q;
-			q = strchr(q, '"');
-			strncpy(mac, p, q - p); // Copy string to temp char array:
-			return 1;
+			uint8_t bytes[6];
+			if (line.Is(ESP8266_GET_STA_MAC) and line.Fields.MAC(bytes))
+			{
+				sprintf(mac, "%02x:%02x:%02x:%02x:%02x:%02x",
+					bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+				return 1;
+			}
 		}
+		return WIFI_RSP_UNKNOWN;
 	}
 
 	return rsp;
 }
 
+// WiFiResolve()
+// Looks a host name up with AT+CIPDOMAIN through a small cache. Answers
+// are kept for WIFI_DNS_TTL, and "DNS Fail" for WIFI_DNS_NEGATIVE_TTL, so
+// a burst of reconnects costs at most one lookup per name. Other failures
+// (timeout, busy, a bare ERROR while the AP is down, an unreadable answer)
+// say nothing about the name and aren't cached. Dotted quads are parsed
+// without asking the module.
+// Output:
+//    - Success: >0, ip filled in
+//    - Fail: <0 (wifi_cmd_rsp), WIFI_RSP_FAIL if the name doesn't resolve
+int16_t ESP8266Device::WiFiResolve(const char * host, IPAddress& ip)
+{
+	if (host == nullptr)
+		return WIFI_CMD_BAD;
+	size_t hostLen = strlen(host);
+	if (ESP8266AT::FieldReader(ESP8266AT::Span(host, host + hostLen)).IP(ip))
+		return 1;
+	if (hostLen >= WIFI_HOST_LEN)
+		return WIFI_CMD_BAD;
+
+	// Look for the name, and for the slot to reuse if it isn't there:
+	// a free one, else the one closest to expiry.
+	uint32_t now = HAL_GetTick();
+	DNSEntry * slot = nullptr;
+	for (DNSEntry& entry : m_DNS)
+	{
+		bool fresh = entry.Used and (int32_t)(entry.Expires - now) > 0;
+		if (fresh and strcmp(entry.Host, host) == 0)
+		{
+			if (not entry.Resolved)
+				return WIFI_RSP_FAIL;
+			ip = entry.Address;
+			return 1;
+		}
+		if (not fresh)
+			entry.Used = false;
+		if (slot == nullptr or (slot->Used and (not entry.Used or (int32_t)(entry.Expires - slot->Expires) < 0)))
+			slot = &entry;
+	}
+
+	sendSetup<ESP8266AT::DNS_LOOKUP>(host);
+	// Example responses: +CIPDOMAIN:93.184.216.34\r\n\r\nOK\r\n
+	//                    DNS Fail\r\n\r\nERROR\r\n
+	int16_t rsp = readUntil(RESPONSE_OK, RESPONSE_ERROR, WIFI_DNS_TIMEOUT);
+	bool resolved = false;
+	if (rsp > 0)
+	{
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (not resolved and scanner.Next(line))
+			resolved = line.Is(ESP8266_DNS_LOOKUP) and line.Fields.IP(ip);
+		if (not resolved)
+			return WIFI_RSP_UNKNOWN;	// Nothing learned; try again next time
+	}
+	else if (rsp != WIFI_RSP_FAIL or not searchBuffer(RESPONSE_DNS_FAIL))
+		return (rsp < 0) ? rsp : WIFI_RSP_UNKNOWN;	// ERROR for another reason, busy, timeout
+
+	strcpy(slot->Host, host);
+	slot->Address = ip;
+	slot->Resolved = resolved;
+	slot->Expires = now + (resolved ? WIFI_DNS_TTL : WIFI_DNS_NEGATIVE_TTL);
+	slot->Used = true;
+	return resolved ? 1 : WIFI_RSP_FAIL;
+}
+
 /////////////////////
 // TCP/IP Commands //
 /////////////////////
 
 int16_t ESP8266Device::TCPConnect(uint8_t linkID, const char * destination, uint16_t port, uint16_t keepAlive)
 {
-	WiFiBuffer params;
-	params.Append(linkID);
-	params.AppendBuffer(",\"TCP\",\"", 8U);
-	params.AppendBuffer(destination, strlen(destination));
-	params.AppendBuffer("\",", 2U);
-	params.Append(std::to_string(port));
-	if (keepAlive > 0)
-	{
-		params.AppendBuffer(",", 1U);
-		// keepAlive is in units of 500 milliseconds.
-		// Max is 7200 * 500 = 3600000 ms = 60 minutes.
-		params.Append(std::to_string(keepAlive / 500));
-	}
-	sendCommand(ESP8266_TCP_CONNECT, WIFI_CMD_SETUP, params);
+	// Connect by address so the module doesn't resolve the name every time
+	IPAddress remote;
+	int16_t rsp = WiFiResolve(destination, remote);
+	if (rsp < 0)
+		return rsp;
+
+	// keepAlive is in units of 500 milliseconds.
+	// Max is 7200 * 500 = 3600000 ms = 60 minutes.
+	if (m_Mux and keepAlive > 0)
+		sendSetup<ESP8266AT::TCP_CONNECT>(linkID, "TCP", remote, port, keepAlive / 500);
+	else if (m_Mux)
+		sendSetup<ESP8266AT::TCP_CONNECT>(linkID, "TCP", remote, port);
+	else if (keepAlive > 0)
+		sendSetup<ESP8266AT::TCP_CONNECT>("TCP", remote, port, keepAlive / 500);
+	else
+		sendSetup<ESP8266AT::TCP_CONNECT>("TCP", remote, port);
 
 	// Example good: CONNECT\r\n\r\nOK\r\n
 	// Example bad: DNS Fail\r\n\r\nERROR\r\n
 	// Example meh: ALREADY CONNECTED\r\n\r\nERROR\r\n
-	int16_t rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, CLIENT_CONNECT_TIMEOUT);
+	rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, CLIENT_CONNECT_TIMEOUT);
 	
 	if (rsp < 0)
 	{
@@ -490,179 +704,1270 @@ int16_t ESP8266Device::TCPConnect(uint8_t linkID, const char * destination, uint
 		// Search for "ALREADY", and return success if we see it.
 		char * p = searchBuffer("ALREADY");
 		if (p != NULL)
+		{
+			linkOpened(m_Mux ? linkID : 0);
 			return 2;
+		}
 		// Otherwise the connection failed. Return the error code:
 		return rsp;
 	}
+
+	// "CONNECT" has marked the link open; fill in what only we know.
+	uint8_t link = m_Mux ? linkID : 0;
+	if (link < WIFI_MAX_SOCK_NUM)
+	{
+		wifi_ipstatus& status = m_Status.ipstatus[link];
+		linkOpened(link);
+		status.type = WIFI_TCP;
+		status.port = port;
+		status.tetype = WIFI_CLIENT;
+		status.remoteIP = remote;
+	}
 	// Return 1 on successful (new) connection
 	return 1;
 }
 
 int16_t ESP8266Device::TCPSend(uint8_t linkID, WiFiBuffer Data)					// Himanshu
 {
-	if (Data.Size() > WIFI_MAX_TCP_LEN)
+	return TCPSend(linkID, Data.GetData(), Data.Size());
+}
+
+// TCPSend()
+// Data the module dropped with "busy s..." is sent again, see busyBackoff().
+// The command itself is resent by retryCommand(); both share one [waited].
+int16_t ESP8266Device::TCPSend(uint8_t linkID, const uint8_t *buf, size_t size)	//! TODO - modify the Read function in Socket class.
+{
+	if (size > WIFI_MAX_TCP_LEN)
 		return WIFI_CMD_BAD;
-	char params[8];
-	sprintf(params, "%d,%d", linkID, Data.Size());
-	sendCommand(ESP8266_TCP_SEND, WIFI_CMD_SETUP, WiFiBuffer(params, strlen(params)));
+	TIMELINE_SPAN(TL_SEND, size);
+	int16_t rsp;
+	uint32_t waited = 0;
+	do {
+		if (m_Mux)
+			sendSetup<ESP8266AT::TCP_SEND>(linkID, size);
+		else
+			sendSetup<ESP8266AT::TCP_SEND>(size);
 
-	int16_t rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
-	if (rsp >= 0)
-	{
-		this->Write(Data);
-		size_t readLen = strlen("\r\nRecv ") + std::to_string(Data.Size()).size() + strlen(" bytes\r\n\r\nSEND OK\r\n");
-		rsp = readForResponse("SEND OK", COMMAND_RESPONSE_TIMEOUT, readLen);
+		rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT, WIFI_RX_BUFFER_LEN, waited);
+		if (rsp == WIFI_RSP_FAIL or rsp == WIFI_RSP_BUSY or rsp == WIFI_CMD_BAD)
+			return rsp;		// Busy: still, after retryCommand() used up [waited]
+
+		this->Write((const char *)buf, size);
+		size_t readLen = strlen("Recv ") + countDigits(size) + strlen(" bytes\r\n\r\nSEND OK\r\n");
+		rsp = readForResponse("SEND OK", COMMAND_RESPONSE_TIMEOUT, readLen, waited);
 		if (rsp > 0)
-			return Data.Size();
+			return size;
+	} while (rsp == WIFI_RSP_BUSY and busyBackoff(waited));
+	
+	return rsp;
+}
+
+// TCPWrite()
+// Like TCPSend(), but with coalescing enabled small writes are collected per
+// link and handed to the module as WIFI_MAX_TCP_LEN segments, or when the
+// oldest pending byte is older than the flush deadline (see TCPFlushExpired).
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPWrite(uint8_t linkID, const uint8_t *buf, size_t size)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM)
+		return WIFI_CMD_BAD;
+	if (not m_Coalesce)
+	{
+		int16_t rsp = 1;
+		for (size_t offset = 0; offset < size and rsp > 0; offset += WIFI_MAX_TCP_LEN)
+			rsp = sendSegment(linkID, buf + offset, std::min(size - offset, (size_t)WIFI_MAX_TCP_LEN));
+		return rsp;
 	}
 
-	return rsp;
+	SendState& link = m_Send[linkID];
+	if (link.Pending.Size() == 0)
+		link.PendingSince = HAL_GetTick();
+	link.Pending.AppendBuffer(buf, size);
+
+	while (link.Pending.Size() >= WIFI_MAX_TCP_LEN)
+	{
+		int16_t rsp = sendSegment(linkID, link.Pending.GetData(), WIFI_MAX_TCP_LEN);
+		if (rsp < 0)
+			return rsp;
+		if (link.Pending.Size() == WIFI_MAX_TCP_LEN)
+			link.Pending.Clear();
+		else
+		{
+			link.Pending.SetReadPosition(WIFI_MAX_TCP_LEN);
+			link.Pending.RemoveReadBytes();
+		}
+		link.PendingSince = HAL_GetTick();
+	}
+
+	int16_t rsp = TCPFlushExpired();
+	return (rsp < 0) ? rsp : 1;
 }
 
-int16_t ESP8266Device::TCPSend(uint8_t linkID, const uint8_t *buf, size_t size)	//! TODO - modify the Read function in Socket class.
+int16_t ESP8266Device::TCPFlush(uint8_t linkID)
 {
-	if (size > WIFI_MAX_TCP_LEN)
+	if (linkID >= WIFI_MAX_SOCK_NUM)
 		return WIFI_CMD_BAD;
-	WiFiBuffer params;
-	params.Append(std::to_string(linkID) + "," + std::to_string(size));
-	sendCommand(ESP8266_TCP_SEND, WIFI_CMD_SETUP, params);
-	
-	int16_t rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
-	//if (rsp > 0)
-	if (rsp != WIFI_RSP_FAIL)
+
+	SendState& link = m_Send[linkID];
+	int16_t rsp = 1;
+	if (link.Pending.Size() > 0)
 	{
-		this->Write((const char *)buf, size);
-		size_t readLen = strlen("Recv ") + std::to_string(size).size() + strlen(" bytes\r\n\r\nSEND OK\r\n");
-		rsp = readForResponse("SEND OK", COMMAND_RESPONSE_TIMEOUT, readLen);
-		if (rsp > 0)
-			return size;
+		// Pending never holds a full segment (see TCPWrite).
+		rsp = sendSegment(linkID, link.Pending.GetData(), link.Pending.Size());
+		link.Pending.Clear();
+	}
+	if (rsp > 0 and link.Failed)
+	{
+		link.Failed = false;
+		rsp = WIFI_RSP_FAIL;
+	}
+	return rsp;
+}
+
+// TCPFlushExpired()
+// Flushes every link whose oldest pending byte has waited longer than the
+// flush deadline. Called by TCPWrite() and from STM32TCPSocket::Poll(), so
+// the last writes of a burst go out without another write.
+int16_t ESP8266Device::TCPFlushExpired()
+{
+	int16_t rsp = 1;
+	uint32_t now = HAL_GetTick();
+	for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+	{
+		if (m_Send[i].Pending.Size() > 0 and now - m_Send[i].PendingSince >= m_FlushDeadline)
+		{
+			int16_t linkRsp = TCPFlush(i);
+			if (linkRsp < 0)
+				rsp = linkRsp;
+		}
 	}
-	
 	return rsp;
 }
 
+void ESP8266Device::TCPSetCoalescing(bool enable, uint32_t flushDeadlineInMS /*= WIFI_SEND_FLUSH_DEADLINE*/)
+{
+	if (not enable)
+	{
+		for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+			TCPFlush(i);
+	}
+	m_Coalesce = enable;
+	m_FlushDeadline = flushDeadlineInMS;
+}
+
 int16_t ESP8266Device::TCPClose(uint8_t linkID)	// upto 5??
 {
-	WiFiBuffer params;
-	params.Append(std::to_string(linkID));
-	sendCommand(ESP8266_TCP_CLOSE, WIFI_CMD_SETUP, params);
+	if (linkID < WIFI_MAX_SOCK_NUM)
+	{
+		TCPFlush(linkID);
+		// Scheduled data still goes out, ahead of the other links.
+		LinkQueue& queue = m_Queue[linkID];
+		while (queue.Data.Size() > 0 and
+			sendQueued(linkID, std::min(queue.Data.Size(), (size_t)WIFI_MAX_TCP_LEN)) > 0);
+		m_Send[linkID].InFlight = 0;
+	}
+	if (!m_Mux)
+	{
+		sendExecute<ESP8266AT::TCP_CLOSE>(); // Send AT+CIPCLOSE
+		int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+		if (rsp > 0)
+		{
+			linkClosed(0);
+			rsp = restoreConnectionOptions();
+		}
+		return rsp;
+	}
+	sendSetup<ESP8266AT::TCP_CLOSE>(linkID);
 	
 	// Eh, client virtual function doesn't have a return value.
 	// We'll wait for the OK or timeout anyway.
-	return readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp > 0)
+		linkClosed(linkID);
+	return rsp;
 }
 
+// TCPSetTransferMode()
+// Skipped when the module is known to be in the requested mode.
 int16_t ESP8266Device::TCPSetTransferMode(uint8_t mode)
 {
-	char params[2] = {0, 0};
-	params[0] = (mode > 0) ? '1' : '0';
-	sendCommand(ESP8266_TRANSMISSION_MODE, WIFI_CMD_SETUP, WiFiBuffer(params, sizeof params));
+	if (m_TransferMode == ((mode > 0) ? 1 : 0))
+		return 1;
+	sendSetup<ESP8266AT::TRANSMISSION_MODE>((mode > 0) ? 1 : 0);
 	
-	return readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	m_TransferMode = (rsp > 0) ? (mode > 0) : -1;
+	return rsp;
 }
 
+// TCPSetMux()
+// Skipped when the module is already in the requested mode: AT+CIPMUX is
+// refused while any link is open, e.g. idle pooled connections.
 int16_t ESP8266Device::TCPSetMux(uint8_t mux)
 {
-	char params[2] = {0, 0};
-	params[0] = (mux > 0) ? '1' : '0';
-	sendCommand(ESP8266_TCP_MULTIPLE, WIFI_CMD_SETUP, WiFiBuffer(params, sizeof params));
+	if ((mux > 0) == (m_Mux > 0))
+		return 1;
+	sendSetup<ESP8266AT::TCP_MULTIPLE>((mux > 0) ? 1 : 0);
 	
-	return readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp > 0)
+		m_Mux = (mux > 0);
+	return rsp;
 }
 
 int16_t ESP8266Device::TCPConfigureServer(uint16_t port, uint8_t create)
 {
-	char params[10];
 	if (create > 1) create = 1;
-	sprintf(params, "%d,%d", create, port);
-	sendCommand(ESP8266_SERVER_CONFIG, WIFI_CMD_SETUP, WiFiBuffer(params, sizeof params));
+	sendSetup<ESP8266AT::SERVER_CONFIG>(create, port);
 	
 	return readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);	
 }
 
 int16_t ESP8266Device::TCPPing(IPAddress ip)
 {
-	char ipStr[17];
-	sprintf(ipStr, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
-	return TCPPing(ipStr);
+	sendSetup<ESP8266AT::PING>(ip);
+	return readForPing();
 }
 
 int16_t ESP8266Device::TCPPing(char * server)
 {
-	char params[strlen(server) + 3];
-	sprintf(params, "\"%s\"", server);
 	// Send AT+Ping=<server>
-	sendCommand(ESP8266_PING, WIFI_CMD_SETUP, WiFiBuffer(params, sizeof params));
+	sendSetup<ESP8266AT::PING>(server);
+	return readForPing();
+}
+
+int16_t ESP8266Device::readForPing()
+{
 	// Example responses:
 	//  * Good response: +12\r\n\r\nOK\r\n
 	//  * Timeout response: +timeout\r\n\r\nERROR\r\n
 	//  * Error response (unreachable): ERROR\r\n\r\n
+	// Newer firmware reports +PING:12 / +PING:TIMEOUT instead.
 	int16_t rsp = readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_PING_TIMEOUT);
-	if (rsp > 0)
-	{
-		char * p = searchBuffer("+");
-		p += 1; // Move p forward 1 space
-		char * q = strchr(p, '\r'); // Find the first \r
-		if (q == NULL)
-			return WIFI_RSP_UNKNOWN;
-		char tempRsp[10];
-		strncpy(tempRsp, p, q - p);
-		return atoi(tempRsp);
-	}
-	else
+
+	ESP8266AT::ResponseScanner scanner = scanResponse();
+	ESP8266AT::Line line;
+	while (scanner.Next(line))
 	{
-		if (searchBuffer("timeout") != NULL)
+		ESP8266AT::FieldReader fields = line.Fields;
+		if (not line.Is(ESP8266_PING))
+		{
+			if (line.Text.Size() < 2 or line.Text.Begin[0] != '+')
+				continue;
+			fields = ESP8266AT::FieldReader(ESP8266AT::Span(line.Text.Begin + 1, line.Text.End));
+		}
+
+		int16_t ms;
+		ESP8266AT::Span word;
+		if (rsp > 0 and fields.Int(ms))
+			return ms;
+		if (fields.Word(word) and (word.Equals("timeout") or word.Equals("TIMEOUT")))
 			return 0;
 	}
 	
-	return rsp;
+	return (rsp > 0) ? WIFI_RSP_UNKNOWN : rsp;
 }
 
+// TCPIsConnected()
+// Answered from the link state cache, see TCPStatus().
 bool ESP8266Device::TCPIsConnected(uint8_t linkID)
 {
-	return true;	// TODO - use linkID for MUXing
+	if (linkID >= WIFI_MAX_SOCK_NUM)
+		return false;
+	reconcileStatus();
+	return m_Status.ipstatus[linkID].linkID == linkID;
 }
 
-//////////////////////////
-// Custom GPIO Commands //
-//////////////////////////
-int16_t ESP8266Device::pinMode(uint8_t pin, uint8_t mode)		// DO NOT USE THIS YET - DANGEROUS
+// TCPProcessEvents()
+// Feeds unsolicited output received outside a command (e.g. by the serial
+// socket's async read handler into wifiRxBuffer) to the link state cache.
+// In transparent mode the buffer holds the peer's data and is left alone.
+void ESP8266Device::TCPProcessEvents()
 {
-//	char params[5];
-//
-//	char modeC = 'i'; // Default mode to input
-//	if (mode == GPIO_MODE_OUTPUT_PP)
-//		modeC = 'o'; // o = OUTPUT
-//	else if (mode == GPIO_PULLUP)
-//		modeC = 'p'; // p = INPUT_PULLUP
-//
-//	snprintf(params, sizeof params, "%d,%c", pin, modeC);
-//	sendCommand(ESP8266_PINMODE, WIFI_CMD_SETUP, params);
-//
-//	return readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
-	return -1;
+	if (not m_Passthrough)
+		processNotifications();
 }
 
-int16_t ESP8266Device::digitalWrite(uint8_t pin, uint8_t state)	// DO NOT USE THIS YET - DANGEROUS
+// restoreConnectionOptions()
+// Puts back the receive mode and multiple connections that transparent
+// mode turned off. AT+CIPMUX=1 is refused while the single connection is
+// open, so that part waits until it has been closed (see TCPClose()).
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::restoreConnectionOptions()
 {
-//	char params[5];
-//
-//	char stateC = 'l'; // Default state to LOW
-//	if (state == SET)
-//		stateC = 'h'; // h = HIGH
-//
-//	snprintf(params, sizeof params, "%d,%c", pin, stateC);
-//	sendCommand(ESP8266_PINWRITE, WIFI_CMD_SETUP, params);
-//
-//	return readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
-	return -1;
+	int16_t rsp = 1;
+	if (m_Passthrough)
+		return rsp;
+	if (m_RestorePassive)
+	{
+		m_RestorePassive = false;
+		rsp = TCPSetReceiveMode(true);
+	}
+	if (m_RestoreMux and m_Status.ipstatus[0].linkID != 0)
+	{
+		m_RestoreMux = false;
+		int16_t muxRsp = TCPSetMux(1);
+		if (muxRsp < 0)
+			rsp = muxRsp;
+	}
+	return rsp;
 }
 
-int8_t ESP8266Device::digitalRead(uint8_t pin)					// DO NOT USE THIS YET - DANGEROUS
+// reconcileStatus()
+// Refreshes the cache with AT+CIPSTATUS if it was never filled or is older
+// than WIFI_STATUS_RECONCILE_PERIOD. Events keep it current in between.
+int16_t ESP8266Device::reconcileStatus()
 {
-//	char params[3];
-//
-//	snprintf(params, sizeof params, "%d", pin);
+	if (m_Passthrough)
+		return 1;	// Can't send commands; the cache is all we have
+	if (m_StatusValid and HAL_GetTick() - m_StatusUpdated < WIFI_STATUS_RECONCILE_PERIOD)
+		return 1;
+	return TCPUpdateStatus();
+}
+
+void ESP8266Device::linkOpened(uint8_t linkID)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM)
+		return;
+	wifi_ipstatus& status = m_Status.ipstatus[linkID];
+	if (status.linkID != linkID)
+	{
+		// Remote details of accepted connections arrive with the next
+		// reconcile; until then they read as zero.
+		status.linkID = linkID;
+		status.type = WIFI_TCP;
+		status.remoteIP = IPAddress("0.0.0.0");
+		status.port = 0;
+		status.tetype = WIFI_SERVER;
+	}
+	m_Status.stat = WIFI_STATUS_CONNECTED;
+}
+
+void ESP8266Device::linkClosed(uint8_t linkID)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM)
+		return;
+	m_Status.ipstatus[linkID].linkID = 255;
+	if (m_State[linkID] == AVAILABLE)
+		m_Pool[linkID].Pooled = false;	// Idle pooled link dropped by the peer
+	m_Send[linkID].Pending.Clear();
+	m_Send[linkID].InFlight = 0;
+	m_RecvPending[linkID] = 0;
+	dropQueued(linkID);
+
+	for (int i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+		if (m_Status.ipstatus[i].linkID == i)
+			return;
+	if (m_Status.stat == WIFI_STATUS_CONNECTED)
+		m_Status.stat = WIFI_STATUS_DISCONNECTED;
+}
+
+void ESP8266Device::wifiDisconnected()
+{
+	for (int i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+		linkClosed(i);
+	m_Status.stat = WIFI_STATUS_NOWIFI;
+}
+
+/////////////////////
+// Connection Pool //
+/////////////////////
+
+// TCPAcquire()
+// Hands out a mux link connected to destination:port, in order of
+// preference: an idle pooled connection to the same endpoint, an unused
+// link, or the least recently used idle pooled connection (closed first).
+// Links the pool didn't open (e.g. accepted by the server) are never
+// touched. Give the link back with TCPRelease().
+// Output:
+//    - Success: link ID
+//    - Fail: <0 (wifi_cmd_rsp), WIFI_RSP_MEMORY_ERR if every link is busy
+int16_t ESP8266Device::TCPAcquire(const char * destination, uint16_t port, uint16_t keepAlive /*= WIFI_POOL_KEEPALIVE*/)
+{
+	if (not m_Mux or destination == nullptr or strlen(destination) >= WIFI_HOST_LEN)
+		return WIFI_CMD_BAD;
+
+	reconcileStatus();	// At most one AT+CIPSTATUS; the loop reads the cache
+	uint32_t now = HAL_GetTick();
+	int8_t unused = -1, lru = -1;
+	for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+	{
+		PoolEntry& entry = m_Pool[i];
+		if (m_State[i] != AVAILABLE)
+			continue;
+		if (not entry.Pooled)
+		{
+			if (unused < 0 and m_Status.ipstatus[i].linkID != i)
+				unused = i;
+			continue;
+		}
+
+		if (now - entry.LastUsed >= WIFI_POOL_IDLE_TIMEOUT or m_Status.ipstatus[i].linkID != i)
+		{
+			TCPRelease(i, false);
+			if (unused < 0)
+				unused = i;
+			continue;
+		}
+		if (entry.Port == port and strcmp(entry.Host, destination) == 0)
+		{
+			m_State[i] = TAKEN;
+			entry.LastUsed = now;
+			return i;
+		}
+		if (lru < 0 or now - entry.LastUsed > now - m_Pool[lru].LastUsed)
+			lru = i;
+	}
+
+	int8_t linkID = unused;
+	if (linkID < 0)
+	{
+		if (lru < 0)
+			return WIFI_RSP_MEMORY_ERR;
+		TCPRelease(lru, false);
+		linkID = lru;
+	}
+
+	int16_t rsp = TCPConnect(linkID, destination, port, keepAlive);
+	if (rsp < 0)
+		return rsp;
+
+	PoolEntry& entry = m_Pool[linkID];
+	strcpy(entry.Host, destination);
+	entry.Port = port;
+	entry.LastUsed = HAL_GetTick();
+	entry.Pooled = true;
+	m_State[linkID] = TAKEN;
+	return linkID;
+}
+
+// TCPRelease()
+// Returns a link from TCPAcquire(). A reusable link that is still open
+// stays connected for the next TCPAcquire() to the same endpoint; anything
+// else is closed.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPRelease(uint8_t linkID, bool reusable /*= true*/)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM)
+		return WIFI_CMD_BAD;
+
+	PoolEntry& entry = m_Pool[linkID];
+	int16_t rsp = 1;
+	if (reusable and entry.Pooled and TCPIsConnected(linkID))
+		rsp = TCPFlush(linkID);	// Don't leave coalesced data behind on an idle link
+	else
+	{
+		if (m_Status.ipstatus[linkID].linkID == linkID)
+			rsp = TCPClose(linkID);
+		entry.Pooled = false;
+	}
+	entry.LastUsed = HAL_GetTick();
+	m_State[linkID] = AVAILABLE;
+	return rsp;
+}
+
+// TCPPoolExpire()
+// Closes idle pooled connections older than WIFI_POOL_IDLE_TIMEOUT, so idle
+// links don't hold on to remote resources. Called from STM32TCPSocket::Poll().
+int16_t ESP8266Device::TCPPoolExpire()
+{
+	int16_t rsp = 1;
+	uint32_t now = HAL_GetTick();
+	for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+	{
+		if (m_State[i] == AVAILABLE and m_Pool[i].Pooled and now - m_Pool[i].LastUsed >= WIFI_POOL_IDLE_TIMEOUT)
+		{
+			int16_t linkRsp = TCPRelease(i, false);
+			if (linkRsp < 0)
+				rsp = linkRsp;
+		}
+	}
+	return rsp;
+}
+
+///////////////////
+// UDP Datagrams //
+///////////////////
+
+// UDPOpen()
+// Registers a UDP link: AT+CIPSTART=[<link ID>,]"UDP",<remote>,<remote port>
+// followed by [<local port>,<mode>] when a local port is given. Also turns
+// on AT+CIPDINFO so every +IPD carries the sender's address.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::UDPOpen(uint8_t linkID, const char * destination, uint16_t remotePort,
+	uint16_t localPort /*= 0*/, wifi_udp_mode mode /*= WIFI_UDP_PEER_FIXED*/)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM or destination == nullptr)
+		return WIFI_CMD_BAD;
+
+	IPAddress remote;
+	int16_t rsp = WiFiResolve(destination, remote);
+	if (rsp < 0)
+		return rsp;
+
+	if (not m_DatagramInfo)
+	{
+		sendSetup<ESP8266AT::IPD_INFO>(1);
+		rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+		if (rsp < 0)
+			return rsp;
+		m_DatagramInfo = true;
+	}
+
+	if (m_Mux and localPort)
+		sendSetup<ESP8266AT::TCP_CONNECT>(linkID, "UDP", remote, remotePort, localPort, mode);
+	else if (m_Mux)
+		sendSetup<ESP8266AT::TCP_CONNECT>(linkID, "UDP", remote, remotePort);
+	else if (localPort)
+		sendSetup<ESP8266AT::TCP_CONNECT>("UDP", remote, remotePort, localPort, mode);
+	else
+		sendSetup<ESP8266AT::TCP_CONNECT>("UDP", remote, remotePort);
+
+	// Example response: 0,CONNECT\r\n\r\nOK\r\n
+	rsp = readUntil(RESPONSE_OK, RESPONSE_ERROR, CLIENT_CONNECT_TIMEOUT);
+	if (rsp < 0)
+		return rsp;
+
+	uint8_t link = m_Mux ? linkID : 0;
+	wifi_ipstatus& status = m_Status.ipstatus[link];
+	linkOpened(link);
+	status.type = WIFI_UDP;
+	status.port = remotePort;
+	status.tetype = WIFI_CLIENT;
+	status.remoteIP = remote;
+	return 1;
+}
+
+// UDPSend()
+// Sends one datagram to the link's current peer.
+int16_t ESP8266Device::UDPSend(uint8_t linkID, const uint8_t *buf, size_t size)
+{
+	wifi_datagram datagram;
+	datagram.remotePort = 0;
+	datagram.data = buf;
+	datagram.size = size;
+	return UDPSendTo(linkID, datagram);
+}
+
+// UDPSendTo()
+// Sends one datagram; AT+CIPSEND=[<link ID>,]<len>[,<remote IP>,<remote port>].
+// Datagrams are never coalesced, so message boundaries are kept.
+// Output:
+//    - Success: bytes sent
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::UDPSendTo(uint8_t linkID, const wifi_datagram& datagram)
+{
+	if (datagram.size == 0 or datagram.size > WIFI_MAX_TCP_LEN)
+		return WIFI_CMD_BAD;
+	TIMELINE_SPAN(TL_SEND, datagram.size);
+
+	int16_t rsp;
+	uint32_t waited = 0;
+	do {
+		if (datagram.remotePort == 0)
+		{
+			if (m_Mux)
+				sendSetup<ESP8266AT::TCP_SEND>(linkID, datagram.size);
+			else
+				sendSetup<ESP8266AT::TCP_SEND>(datagram.size);
+		}
+		else
+		{
+			if (m_Mux)
+				sendSetup<ESP8266AT::TCP_SEND>(linkID, datagram.size, datagram.remoteIP, datagram.remotePort);
+			else
+				sendSetup<ESP8266AT::TCP_SEND>(datagram.size, datagram.remoteIP, datagram.remotePort);
+		}
+
+		// Example response: \r\nOK\r\n>
+		rsp = readUntil(RESPONSE_PROMPT, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT, waited);
+		if (rsp < 0)
+			return rsp;
+
+		this->Write((const char *)datagram.data, datagram.size);
+		// Example response: \r\nRecv 12 bytes\r\n\r\nSEND OK\r\n
+		rsp = readUntil("SEND OK\r\n", "SEND FAIL\r\n", COMMAND_RESPONSE_TIMEOUT, waited);
+	} while (rsp == WIFI_RSP_BUSY and busyBackoff(waited));
+	if (rsp < 0)
+		return rsp;
+	return datagram.size;
+}
+
+// UDPRegisterReceiveHandler()
+// The handler is called once per +IPD on a UDP link, from whichever read
+// picked it up. It must not send commands: the data points into the RX
+// buffer. Returns the previous handler. STM32TCPSocket doesn't use it:
+// datagrams reach the socket's read handler as +IPD output, like TCP data.
+WiFiDevice::DatagramHandlerFunction ESP8266Device::UDPRegisterReceiveHandler(DatagramHandlerFunction handler)
+{
+	DatagramHandlerFunction previous = m_DatagramHandler;
+	m_DatagramHandler = handler;
+	return previous;
+}
+
+/////////////////////
+// Passive Receive //
+/////////////////////
+
+// TCPSetReceiveMode()
+// In passive mode the module keeps received TCP data (and tells about it
+// with "+IPD,<link>,<len>") until it is pulled with TCPReceive(), so a
+// burst can no longer overrun the UART ring; the module's window closes
+// instead. Firmware without AT+CIPRECVMODE answers ERROR and stays active.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPSetReceiveMode(bool passive)
+{
+	if (m_Passthrough)
+		return WIFI_CMD_BAD;
+	sendSetup<ESP8266AT::RECV_MODE>(passive ? 1 : 0);
+
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp > 0)
+	{
+		m_PassiveRecv = passive;
+		memset(m_RecvPending, 0, sizeof(m_RecvPending));
+		if (passive)
+			TCPUpdatePending();		// Data that came in before the switch
+	}
+	return rsp;
+}
+
+// TCPUpdatePending()
+// Re-reads the bytes held per link, e.g. after notifications were lost.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPUpdatePending()
+{
+	if (not m_PassiveRecv)
+		return WIFI_CMD_BAD;
+	sendQuery<ESP8266AT::RECV_LEN>();
+
+	// Example response: +CIPRECVLEN:0,120,0,0,0\r\n\r\nOK\r\n (one field per link,
+	// a single one without CIPMUX; closed links may read -1)
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp > 0)
+	{
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
+		{
+			if (not line.Is(ESP8266_RECV_LEN))
+				continue;
+			long len;
+			for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM and line.Fields.Int(len); i++)
+				m_RecvPending[i] = (len > 0) ? len : 0;
+			return 1;
+		}
+		return WIFI_RSP_UNKNOWN;
+	}
+	return rsp;
+}
+
+size_t ESP8266Device::TCPPending(uint8_t linkID)
+{
+	return (linkID < WIFI_MAX_SOCK_NUM) ? m_RecvPending[linkID] : 0;
+}
+
+// TCPReceive()
+// Pulls at most [size] bytes of the link's held data into [buf]; size it
+// to the free space of the consumer's buffer.
+// Output:
+//    - Success: bytes copied, 0 if nothing is held
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPReceive(uint8_t linkID, uint8_t * buf, size_t size)
+{
+	if (not m_PassiveRecv or linkID >= WIFI_MAX_SOCK_NUM or buf == nullptr)
+		return WIFI_CMD_BAD;
+	size = std::min(std::min(size, m_RecvPending[linkID]), (size_t)WIFI_MAX_TCP_LEN);
+	if (size == 0)
+		return 0;
+
+	if (m_Mux)
+		sendSetup<ESP8266AT::RECV_DATA>(linkID, size);
+	else
+		sendSetup<ESP8266AT::RECV_DATA>(size);
+
+	// The header is read a byte at a time, the data in one receive.
+	uint32_t start = 0;
+	auto next = [&]() -> int
+	{
+		uint32_t elapsed = HAL_GetTick() - start;
+		clearBuffer();
+		if (elapsed >= COMMAND_RESPONSE_TIMEOUT or this->Read(COMMAND_RESPONSE_TIMEOUT - elapsed, 1, false) == 0)
+			return -1;
+		return wifiRxBuffer[0];
+	};
+
+	// Example responses:
+	// AT 1.x: +CIPRECVDATA,<len>:<data>\r\n\r\nOK\r\n
+	// AT 2.x: +CIPRECVDATA:<len>,[<remote IP>,<remote port>,]<data>\r\n\r\nOK\r\n
+	// With echo on, "AT+CIPRECVDATA=..." matches first and is stepped over.
+	int c;
+	do
+	{
+		int16_t rsp = readUntil(ESP8266_RECV_DATA, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
+		if (rsp < 0)
+		{
+			if (rsp == WIFI_RSP_FAIL)
+				m_RecvPending[linkID] = 0;	// Nothing held after all
+			return rsp;
+		}
+		start = HAL_GetTick();
+		c = next();
+	} while (c == '=');
+	bool v2 = (c == ':');
+	if (c != ':' and c != ',')
+		return (c < 0) ? WIFI_RSP_TIMEOUT : WIFI_RSP_UNKNOWN;
+	size_t len = 0;
+	while ((c = next()) >= '0' and c <= '9')
+		len = len * 10 + (c - '0');
+	if (c != (v2 ? ',' : ':') or len > size)
+		return (c < 0) ? WIFI_RSP_TIMEOUT : WIFI_RSP_UNKNOWN;
+	for (int commas = 0; v2 and m_DatagramInfo and commas < 2; )
+	{
+		if ((c = next()) < 0)
+			return WIFI_RSP_TIMEOUT;
+		commas += (c == ',');
+	}
+
+	clearBuffer();
+	size_t received = (len > 0) ? this->Read(COMMAND_RESPONSE_TIMEOUT, len, false) : 0;
+	memcpy(buf, wifiRxBuffer.GetData(), std::min(received, len));
+	if (received < len)
+		return WIFI_RSP_TIMEOUT;
+
+	// A short answer means the module had less than announced.
+	if (len < size)
+		m_RecvPending[linkID] = 0;
+	else
+		m_RecvPending[linkID] -= len;
+	readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);	// May carry new +IPD notifications
+	return len;
+}
+
+//////////////////////////////
+// Transparent Transmission //
+//////////////////////////////
+
+// TCPStartPassthrough()
+// Opens a single connection and enters unvarnished transmission
+// (AT+CIPMUX=0, AT+CIPSTART, AT+CIPMODE=1, AT+CIPSEND). Until
+// TCPStopPassthrough() every byte written goes straight to the peer and
+// every received byte arrives on the serial socket without +IPD framing:
+// it is what the socket's read handler gets, or TCPPassthroughRead() pulls.
+// Commands sent meanwhile fail with WIFI_CMD_BAD.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPStartPassthrough(const char * destination, uint16_t port, uint16_t keepAlive /*= 0*/)
+{
+	if (m_Passthrough)
+		return WIFI_CMD_BAD;
+
+	// Transparent mode is only accepted with a single connection, and
+	// pushes the data as it arrives.
+	bool mux = m_Mux, passive = m_PassiveRecv;
+	int16_t rsp = TCPSetMux(0);
+	if (rsp < 0)
+		return rsp;
+	m_RestoreMux = mux;
+	if (m_PassiveRecv and (rsp = TCPSetReceiveMode(false)) < 0)
+	{
+		restoreConnectionOptions();
+		return rsp;
+	}
+	m_RestorePassive = passive;
+
+	rsp = TCPConnect(0, destination, port, keepAlive);
+	if (rsp < 0)
+	{
+		restoreConnectionOptions();
+		return rsp;
+	}
+
+	rsp = TCPSetTransferMode(1);
+	if (rsp < 0)
+	{
+		TCPClose(0);
+		return rsp;
+	}
+
+	sendExecute<ESP8266AT::TCP_SEND>(); // Send AT+CIPSEND
+	// Example response: \r\nOK\r\n\r\n>
+	rsp = readUntil(RESPONSE_PROMPT, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp < 0)
+	{
+		TCPSetTransferMode(0);
+		TCPClose(0);
+		return rsp;
+	}
+
+	m_Passthrough = true;
+	m_LastPassthroughTX = HAL_GetTick();
+	return 1;
+}
+
+int16_t ESP8266Device::TCPPassthroughWrite(const uint8_t *buf, size_t size)
+{
+	if (not m_Passthrough)
+		return WIFI_CMD_BAD;
+
+	// The module forwards whatever it has every 20 ms or WIFI_MAX_TCP_LEN
+	// bytes, so there is no need to frame the data here.
+	size_t offset = 0;
+	while (offset < size)
+	{
+		size_t chunk = std::min(size - offset, (size_t)WIFI_MAX_TCP_LEN);
+		if (this->Write((const char *)buf + offset, chunk) != chunk)
+			return WIFI_RSP_FAIL;
+		offset += chunk;
+	}
+	m_LastPassthroughTX = HAL_GetTick();
+	return 1;
+}
+
+// TCPPassthroughRead()
+// Pulls what the peer sent, as it came: returns once [size] bytes are in
+// or [timeoutInMS] has passed. Only for use while the serial socket has no
+// async read pending, which would take the bytes first.
+// Output:
+//    - Success: bytes read, 0 if nothing came
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPPassthroughRead(uint8_t *buf, size_t size, uint32_t timeoutInMS)
+{
+	if (not m_Passthrough or size == 0 or size > INT16_MAX)
+		return WIFI_CMD_BAD;
+
+	clearBuffer();
+	size_t received = std::min((size_t)this->Read(timeoutInMS, size, false), size);
+	memcpy(buf, wifiRxBuffer.GetData(), received);
+	clearBuffer();
+	return received;
+}
+
+int16_t ESP8266Device::TCPStopPassthrough()
+{
+	if (not m_Passthrough)
+		return WIFI_CMD_BAD;
+
+	// "+++" is only recognised when it arrives as a packet of its own, so the
+	// line must stay idle for the guard time before and after it.
+	uint32_t idle = HAL_GetTick() - m_LastPassthroughTX;
+	if (idle < PASSTHROUGH_GUARD_TIME)
+		osDelay(PASSTHROUGH_GUARD_TIME - idle);
+	this->Write(ESP8266_TRANSPARENT_ESCAPE, strlen(ESP8266_TRANSPARENT_ESCAPE));
+	osDelay(PASSTHROUGH_EXIT_TIME);
+	m_Passthrough = false;
+
+	// The link stays open; use TCPClose() to drop it.
+	int16_t rsp = TCPSetTransferMode(0);
+	if (rsp > 0)
+		rsp = restoreConnectionOptions();
+	return rsp;
+}
+
+bool ESP8266Device::TCPIsPassthrough()
+{
+	return m_Passthrough;
+}
+
+///////////////////
+// Send Pipeline //
+///////////////////
+
+// sendSegment()
+// Hands one segment (<= WIFI_MAX_TCP_LEN) to the module. Where the firmware
+// supports AT+CIPSENDBUF the segment is only written into the module's send
+// buffer and up to WIFI_SEND_WINDOW segments per link may wait for their
+// "SEND OK"; otherwise it falls back to a synchronous TCPSend().
+int16_t ESP8266Device::sendSegment(uint8_t linkID, const uint8_t *buf, size_t size)
+{
+	if (m_SendBuf == SENDBUF_UNSUPPORTED)
+		return TCPSend(linkID, buf, size);
+
+	SendState& link = m_Send[linkID];
+	int16_t rsp = waitForSegments(linkID, WIFI_SEND_WINDOW - 1);
+	if (rsp < 0)
+		return rsp;
+
+	uint32_t waited = 0;
+	do {
+		if (m_Mux)
+			sendSetup<ESP8266AT::TCP_SEND_BUFFER>(linkID, size);
+		else
+			sendSetup<ESP8266AT::TCP_SEND_BUFFER>(size);
+
+		// Example response: 1,64\r\n\r\nOK\r\n> (segment ID, segment length)
+		rsp = readUntil(RESPONSE_PROMPT, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT, waited);
+		if (rsp < 0)
+		{
+			if (rsp != WIFI_RSP_FAIL or m_SendBuf == SENDBUF_SUPPORTED)
+				return rsp;
+			// ERROR the first time round: if a plain CIPSEND works, the
+			// firmware simply doesn't know CIPSENDBUF.
+			rsp = TCPSend(linkID, buf, size);
+			if (rsp > 0)
+				m_SendBuf = SENDBUF_UNSUPPORTED;
+			return rsp;
+		}
+		m_SendBuf = SENDBUF_SUPPORTED;
+
+		const char * p = (const char *)wifiRxBuffer.GetData();
+		p += strspn(p, "\r\n ");
+		link.LastSegment = atoi(p);
+
+		this->Write((const char *)buf, size);
+		// Example response: Recv 64 bytes\r\n
+		rsp = readUntil(" bytes\r\n", RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT, waited);
+	} while (rsp == WIFI_RSP_BUSY and busyBackoff(waited));
+	if (rsp < 0)
+		return rsp;		// Not confirmed: a late SEND OK for it finds InFlight at 0
+	link.InFlight++;
+
+	return size;
+}
+
+// waitForSegments()
+// Blocks until at most [maxInFlight] CIPSENDBUF segments of the link are
+// still waiting for "SEND OK". Reports a "SEND FAIL" seen since the last call.
+int16_t ESP8266Device::waitForSegments(uint8_t linkID, uint8_t maxInFlight)
+{
+	SendState& link = m_Send[linkID];
+	while (link.InFlight > maxInFlight)
+	{
+		// processNotifications() retires the segment.
+		int16_t rsp = readUntil("SEND OK\r\n", "SEND FAIL\r\n", COMMAND_RESPONSE_TIMEOUT);
+		if (rsp == WIFI_RSP_TIMEOUT or rsp == WIFI_RSP_UNKNOWN)
+		{
+			link.InFlight = 0;	// Lost track of the module's buffer
+			return rsp;
+		}
+	}
+	if (link.Failed)
+	{
+		link.Failed = false;
+		return WIFI_RSP_FAIL;
+	}
+	return 1;
+}
+
+// TCPSendStream()
+// Sends a buffer of any size as WIFI_MAX_TCP_LEN segments. With CIPSENDBUF
+// the next segment is already going over the UART while the module is still
+// sending the previous ones; the call returns once every segment has been
+// confirmed. [pSent] receives the number of bytes handed to the module, also
+// on failure, so the caller knows where to resume.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPSendStream(uint8_t linkID, const uint8_t *buf, size_t size,
+	size_t * pSent /*= nullptr*/, SendProgressFunction progress /*= nullptr*/)
+{
+	size_t offset = 0;
+	return TCPSendStream(linkID,
+		[&](uint8_t * segment, size_t maxLen) -> size_t
+		{
+			size_t len = std::min(size - offset, maxLen);
+			memcpy(segment, buf + offset, len);
+			offset += len;
+			return len;
+		},
+		pSent,
+		(progress == nullptr) ? progress :
+			[&](size_t sent, size_t) { progress(sent, size); });
+}
+
+int16_t ESP8266Device::TCPSendStream(uint8_t linkID, SendProducerFunction producer,
+	size_t * pSent /*= nullptr*/, SendProgressFunction progress /*= nullptr*/)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM or producer == nullptr)
+		return WIFI_CMD_BAD;
+	if (pSent)
+		*pSent = 0;
+
+	// Anything coalesced earlier has to go first.
+	int16_t rsp = TCPFlush(linkID);
+	if (rsp < 0)
+		return rsp;
+
+	WiFiBuffer segment(WIFI_MAX_TCP_LEN);
+	size_t sent = 0;
+	for (;;)
+	{
+		// Fill a whole segment unless the producer runs dry.
+		size_t len = 0, produced;
+		do {
+			produced = producer(&segment[len], WIFI_MAX_TCP_LEN - len);
+			len += produced;
+		} while (produced > 0 and len < WIFI_MAX_TCP_LEN);
+		if (len == 0)
+			break;
+
+		rsp = sendSegment(linkID, segment.GetData(), len);
+		if (rsp < 0)
+			return rsp;
+		sent += len;
+		if (pSent)
+			*pSent = sent;
+		if (progress)
+			progress(sent, 0);
+		if (produced == 0)
+			break;
+	}
+
+	return waitForSegments(linkID, 0);
+}
+
+////////////////////
+// Send Scheduler //
+////////////////////
+
+// TCPSetLinkClass()
+// [weight] scales the link's share against the other links of its class.
+void ESP8266Device::TCPSetLinkClass(uint8_t linkID, wifi_send_class sendClass, uint8_t weight /*= 1*/)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM or sendClass >= WIFI_CLASSES)
+		return;
+	LinkQueue& queue = m_Queue[linkID];
+	queue.Class = sendClass;
+	queue.Weight = (weight > 0) ? weight : 1;
+	queue.Deficit = 0;
+	queue.InTurn = false;
+}
+
+// TCPQueue()
+// Queues data for TCPSchedule() without touching the UART.
+// Output:
+//    - Success: >0
+//    - Fail: <0 (wifi_cmd_rsp); WIFI_RSP_MEMORY_ERR while the link has
+//      WIFI_SCHED_QUEUE_LIMIT bytes waiting
+int16_t ESP8266Device::TCPQueue(uint8_t linkID, const uint8_t *buf, size_t size)
+{
+	if (linkID >= WIFI_MAX_SOCK_NUM or size == 0)
+		return WIFI_CMD_BAD;
+	LinkQueue& queue = m_Queue[linkID];
+	if (queue.Data.Size() + size > WIFI_SCHED_QUEUE_LIMIT)
+		return WIFI_RSP_MEMORY_ERR;
+
+	queue.Data.AppendBuffer(buf, size);
+	queue.Queued += size;
+	queue.Stats.bytesQueued += size;
+
+	// With every mark taken the newest one absorbs the write, which can
+	// only overstate its latency.
+	if (queue.MarkCount == WIFI_SCHED_MARKS)
+		queue.Marks[(queue.MarkHead + WIFI_SCHED_MARKS - 1) % WIFI_SCHED_MARKS].End = queue.Queued;
+	else
+	{
+		uint8_t mark = (queue.MarkHead + queue.MarkCount++) % WIFI_SCHED_MARKS;
+		queue.Marks[mark].End = queue.Queued;
+		queue.Marks[mark].Tick = HAL_GetTick();
+	}
+	return 1;
+}
+
+// TCPSchedule()
+// Sends queued data until every queue is empty or [timeSliceInMS] is used
+// up. Each segment goes to the highest class with data waiting, so an
+// interactive link waits for at most one segment of a bulk transfer; that
+// is why non-interactive segments are capped at WIFI_SCHED_SEGMENT. A link
+// that fails to send loses its queue and the others carry on.
+// Output:
+//    - >0: all queues drained
+//    - 0: time slice used up, data left
+//    - <0: a send failed (wifi_cmd_rsp)
+int16_t ESP8266Device::TCPSchedule(uint32_t timeSliceInMS /*= 0*/)
+{
+	if (m_Passthrough)
+		return WIFI_CMD_BAD;
+
+	uint32_t start = HAL_GetTick();
+	int16_t rsp = 1;
+	size_t len;
+	int8_t linkID;
+	while ((linkID = scheduleNext(len)) >= 0)
+	{
+		int16_t linkRsp = sendQueued(linkID, len);
+		if (linkRsp < 0)
+		{
+			dropQueued(linkID);
+			rsp = linkRsp;
+		}
+		if (timeSliceInMS and HAL_GetTick() - start >= timeSliceInMS)
+			break;
+	}
+	if (rsp < 0)
+		return rsp;
+	for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+		if (m_Queue[i].Data.Size() > 0)
+			return 0;
+	return 1;
+}
+
+size_t ESP8266Device::TCPQueued(uint8_t linkID)
+{
+	return (linkID < WIFI_MAX_SOCK_NUM) ? m_Queue[linkID].Data.Size() : 0;
+}
+
+const wifi_link_stats& ESP8266Device::TCPLinkStats(uint8_t linkID)
+{
+	static const wifi_link_stats none;
+	return (linkID < WIFI_MAX_SOCK_NUM) ? m_Queue[linkID].Stats : none;
+}
+
+void ESP8266Device::TCPResetLinkStats(uint8_t linkID)
+{
+	if (linkID < WIFI_MAX_SOCK_NUM)
+		m_Queue[linkID].Stats = wifi_link_stats();
+}
+
+// scheduleNext()
+// Strict priority between classes, deficit round-robin within one: when its
+// turn comes a link is granted WIFI_SCHED_QUANTUM * weight bytes and keeps
+// the turn until they are used up or its queue runs empty.
+// Output:
+//    - Link to send next, [len] bytes from the head of its queue
+//    - -1: nothing queued
+int8_t ESP8266Device::scheduleNext(size_t& len)
+{
+	for (uint8_t cls = 0; cls < WIFI_CLASSES; cls++)
+	{
+		bool waiting = false;
+		for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+			waiting |= (m_Queue[i].Class == cls and m_Queue[i].Data.Size() > 0);
+		if (not waiting)
+			continue;
+
+		for (;;)
+		{
+			uint8_t linkID = m_SchedTurn[cls];
+			LinkQueue& queue = m_Queue[linkID];
+			if (queue.Class == cls)
+			{
+				if (queue.Data.Size() > 0)
+				{
+					if (not queue.InTurn)
+					{
+						queue.Deficit += (size_t)WIFI_SCHED_QUANTUM * queue.Weight;
+						queue.InTurn = true;
+					}
+					if (queue.Deficit > 0)
+					{
+						size_t limit = (cls == WIFI_CLASS_INTERACTIVE) ? WIFI_MAX_TCP_LEN : WIFI_SCHED_SEGMENT;
+						len = std::min(std::min(queue.Data.Size(), queue.Deficit), limit);
+						return linkID;
+					}
+				}
+				// Byte streams use up their grant exactly, so nothing carries over.
+				queue.Deficit = 0;
+				queue.InTurn = false;
+			}
+			m_SchedTurn[cls] = (linkID + 1) % WIFI_MAX_SOCK_NUM;
+		}
+	}
+	return -1;
+}
+
+// sendQueued()
+// Sends [len] bytes from the head of the link's queue and accounts for them.
+int16_t ESP8266Device::sendQueued(uint8_t linkID, size_t len)
+{
+	LinkQueue& queue = m_Queue[linkID];
+	int16_t rsp = TCPFlush(linkID);		// Coalesced writes came first
+	if (rsp > 0)
+		rsp = sendSegment(linkID, queue.Data.GetData(), len);
+	if (rsp < 0)
+		return rsp;
+
+	queue.Deficit -= std::min(queue.Deficit, len);
+	if (len == queue.Data.Size())
+		queue.Data.Clear();
+	else
+	{
+		queue.Data.SetReadPosition(len);
+		queue.Data.RemoveReadBytes();
+	}
+	queue.Sent += len;
+	queue.Stats.bytesSent += len;
+	queue.Stats.segments++;
+
+	// Writes whose last byte went out with this segment
+	uint32_t now = HAL_GetTick();
+	while (queue.MarkCount > 0 and (int32_t)(queue.Sent - queue.Marks[queue.MarkHead].End) >= 0)
+	{
+		uint32_t latency = now - queue.Marks[queue.MarkHead].Tick;
+		queue.Stats.latencyLast = latency;
+		queue.Stats.latencyMax = std::max(queue.Stats.latencyMax, latency);
+		queue.Stats.latencySum += latency;
+		queue.Stats.latencyCount++;
+		queue.MarkHead = (queue.MarkHead + 1) % WIFI_SCHED_MARKS;
+		queue.MarkCount--;
+	}
+	return rsp;
+}
+
+void ESP8266Device::dropQueued(uint8_t linkID)
+{
+	LinkQueue& queue = m_Queue[linkID];
+	queue.Stats.bytesDropped += queue.Data.Size();
+	queue.Data.Clear();
+	queue.Sent = queue.Queued;
+	queue.MarkCount = 0;
+	queue.Deficit = 0;
+	queue.InTurn = false;
+}
+
+//////////////////////////
+// Custom GPIO Commands //
+//////////////////////////
+int16_t ESP8266Device::pinMode(uint8_t pin, uint8_t mode)		// DO NOT USE THIS YET - DANGEROUS
+{
+//	char params[5];
+//
+//	char modeC = 'i'; // Default mode to input
+//	if (mode == GPIO_MODE_OUTPUT_PP)
+//		modeC = 'o'; // o = OUTPUT
+//	else if (mode == GPIO_PULLUP)
+//		modeC = 'p'; // p = INPUT_PULLUP
+//
+//	snprintf(params, sizeof params, "%d,%c", pin, modeC);
+//	sendCommand(ESP8266_PINMODE, WIFI_CMD_SETUP, params);
+//
+//	return readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
+	return -1;
+}
+
+int16_t ESP8266Device::digitalWrite(uint8_t pin, uint8_t state)	// DO NOT USE THIS YET - DANGEROUS
+{
+//	char params[5];
+//
+//	char stateC = 'l'; // Default state to LOW
+//	if (state == SET)
+//		stateC = 'h'; // h = HIGH
+//
+//	snprintf(params, sizeof params, "%d,%c", pin, stateC);
+//	sendCommand(ESP8266_PINWRITE, WIFI_CMD_SETUP, params);
+//
+//	return readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT);
+	return -1;
+}
+
+int8_t ESP8266Device::digitalRead(uint8_t pin)					// DO NOT USE THIS YET - DANGEROUS
+{
+//	char params[3];
+//
+//	snprintf(params, sizeof params, "%d", pin);
 //	sendCommand(ESP8266_PINREAD, WIFI_CMD_SETUP, params); // Send AT+PINREAD=n\r\n
 //	// Example response: 1\r\n\r\nOK\r\n
 //	if (readForResponses(RESPONSE_OK, RESPONSE_ERROR, COMMAND_RESPONSE_TIMEOUT) > 0)
@@ -693,10 +1998,8 @@ inline size_t ESP8266Device::Write(const char * buffer, size_t length /*= 0*/)	/
 
 inline size_t ESP8266Device::Write(WiFiBuffer Data)							// for sending {data}
 {
-#ifdef DEBUG
-		if(WIFI_DEBUG_LVL >= LVL_HIGH)
-			Base()->GetDebug()->TRACE_VECTOR("SW", wifiRxBuffer);
-#endif
+	if (LOG_ENABLED(LOG_AT, LOG_TRACE))
+		Base()->GetDebug()->TRACE_VECTOR("SW", Data);
 
 	if(m_Serial->STM32SerialSocket::Write(Data) == SUCCESSFUL)
 		return Data.Size();
@@ -706,15 +2009,9 @@ inline size_t ESP8266Device::Write(WiFiBuffer Data)							// for sending {data}
 inline int ESP8266Device::Read(unsigned int timeoutInMS /*= 1000*/, size_t readLen /*= WIFI_RX_BUFFER_LEN*/, bool asynchronous /*= false*/)
 {
 	size_t ActualBytes = 0;
-	ERROR_TYPE RetVal = not SUCCESSFUL;
-	if(not asynchronous)
-	{
-		RetVal = m_Serial->Read(&wifiRxBuffer, readLen, timeoutInMS, &ActualBytes);
-	}
-	else
-	{
-		throw std::runtime_error("Not yet implemented.\r\n");
-	}
+	if (asynchronous)
+		return 0;	// Not implemented: nothing read
+	ERROR_TYPE RetVal = m_Serial->Read(&wifiRxBuffer, readLen, timeoutInMS, &ActualBytes);
 	if(RetVal == SUCCESSFUL or RetVal == ERR_TIMEOUT)
 	{
 		return ActualBytes;
@@ -732,51 +2029,137 @@ void ESP8266Device::Flush()
 // Private, Low-Level, Ugly, Hardware Functions //
 //////////////////////////////////////////////////
 
-void ESP8266Device::sendCommand(const char * cmd, enum wifi_command_type type, WiFiBuffer params)		// const char * params // OK
+// sendCommand()
+// Transmits the command built into m_Tx by sendExecute/sendQuery/sendSetup.
+// In transparent mode the command is not sent and the read that follows
+// returns WIFI_CMD_BAD, as for one that overflowed m_Tx.
+void ESP8266Device::sendCommand()
 {
-	wifiTxBuffer.Clear();
+	if (m_Passthrough)
+	{
+		// Anything written now would be forwarded to the peer as data.
+		LOG_MSG(LOG_AT, LOG_ERROR, "\r\nCommand dropped (transparent mode) : %s\r\n", m_Tx.Data());
+		m_CommandBad = true;
+		return;
+	}
+
+	if (LOG_ENABLED(LOG_AT, LOG_TRACE))
+		Base()->GetDebug()->TRACE_BUFFER("SW", (const uint8_t *)m_Tx.Data(), m_Tx.Size());
+	LOG_MSG(LOG_AT, LOG_DEBUG, "\r\nCommand : %s\r\n", m_Tx.Data());
 
-	wifiTxBuffer.AppendBuffer("AT", 2U);
-	wifiTxBuffer.AppendBuffer(cmd, strlen(cmd));
-	if (type == WIFI_CMD_QUERY)
-		wifiTxBuffer.AppendBuffer("?", 1U);
-	else if (type == WIFI_CMD_SETUP)
+	TIMELINE_BEGIN(TL_AT_COMMAND, m_Tx.Size());	// Ends in retryCommand()
+	this->Write(m_Tx.Data(), m_Tx.Size());
+	m_CommandSent = true;
+}
+
+// sendBuilt()
+// Sends m_Tx if it was built. A command that overflowed it is logged and
+// not sent; the read that follows returns WIFI_CMD_BAD instead of waiting
+// out its timeout for an answer that won't come.
+// Output: true if the command was sent
+bool ESP8266Device::sendBuilt(bool built)
+{
+	if (not built)
 	{
-		wifiTxBuffer.AppendBuffer("=", 1U);
-		wifiTxBuffer.Append(&params);
+		LOG_MSG(LOG_AT, LOG_ERROR, "\r\nCommand longer than WIFI_TX_BUFFER_LEN (%u), not sent\r\n", (unsigned)WIFI_TX_BUFFER_LEN);
+		m_CommandBad = true;
+		return false;
 	}
-	wifiTxBuffer.AppendBuffer("\r\n\0", 3);
+	m_CommandBad = false;
+	sendCommand();
+	return not m_CommandBad;
+}
 
-#ifdef DEBUG
-		if(WIFI_DEBUG_LVL >= LVL_HIGH)
-			Base()->GetDebug()->TRACE_VECTOR("SW", wifiRxBuffer);
-#endif
+// commandBad()
+// Output: true once after sendBuilt() dropped a command, see above
+bool ESP8266Device::commandBad()
+{
+	bool bad = m_CommandBad;
+	m_CommandBad = false;
+	return bad;
+}
 
-	if(WIFI_DEBUG_LVL >= LVL_LOW)
-		printf("\r\nCommand : %s\r\n", (const char *)wifiTxBuffer.GetData());
+// responseBusy()
+// The last response says the module dropped its input, see retryCommand().
+bool ESP8266Device::responseBusy()
+{
+	return searchBuffer(RESPONSE_BUSY_P) or searchBuffer(RESPONSE_BUSY_S);
+}
 
-	this->Write((const char *)wifiTxBuffer.GetData(), wifiTxBuffer.Size() - 1);
+// busyBackoff()
+// Waits before the next attempt after a busy answer: WIFI_BUSY_BACKOFF_MIN
+// first, then doubling up to WIFI_BUSY_BACKOFF_MAX. [waited] carries the
+// time already spent on this command or send.
+// Output: false once WIFI_BUSY_RETRY_TIME is used up
+bool ESP8266Device::busyBackoff(uint32_t& waited)
+{
+	if (waited >= WIFI_BUSY_RETRY_TIME)
+	{
+		m_Busy.failures++;
+		return false;
+	}
+	uint32_t delay = std::min(std::max(waited, (uint32_t)WIFI_BUSY_BACKOFF_MIN), (uint32_t)WIFI_BUSY_BACKOFF_MAX);
+	osDelay(delay);
+	waited += delay;
+	m_Busy.retries++;
+	m_Busy.busyTime += delay;
+	m_Busy.longest = std::max(m_Busy.longest, waited);
+	return true;
+}
+
+// retryCommand()
+// "busy p..." (still processing) and "busy s..." (still sending) mean the
+// module dropped what it was just sent. A command is still in m_Tx and goes
+// out again after busyBackoff(); data written after a prompt is not, so the
+// caller gets WIFI_RSP_BUSY and sends it again itself.
+// Output: true if the command was sent again and its answer must be read
+bool ESP8266Device::retryCommand(bool busy, uint32_t& waited)
+{
+	bool command = m_CommandSent;
+	m_CommandSent = false;
+	if (command)
+		TIMELINE_END(TL_AT_COMMAND, busy);
+	if (not busy)
+		return false;
+	m_Busy.events++;
+	if (not command or not busyBackoff(waited))
+		return false;
+	TIMELINE_INSTANT(TL_AT_BUSY, waited);
+	LOG_MSG(LOG_AT, LOG_DEBUG, "Module busy, resending after %u ms\r\n", (unsigned)waited);
+	sendCommand();
+	return true;
 }
 
 int16_t ESP8266Device::readForResponse(const char * rsp, unsigned int timeoutInMS, size_t readLen /*= WIFI_RX_BUFFER_LEN*/)	// Not to be used in transparent communications
 {
-	clearBuffer();
-	size_t ActualBytes = 0, TotalBytes = 0;
+	uint32_t waited = 0;
+	return readForResponse(rsp, timeoutInMS, readLen, waited);
+}
+
+// readForResponse()
+// [waited] is the busy time already spent on the operation, see
+// busyBackoff(). A send that retries both its command and its data passes
+// the same one to every read, so busy retries of the whole send stay
+// within WIFI_BUSY_RETRY_TIME.
+int16_t ESP8266Device::readForResponse(const char * rsp, unsigned int timeoutInMS, size_t readLen, uint32_t& waited)
+{
+	if (commandBad())
+		return WIFI_CMD_BAD;
+	size_t TotalBytes;
 	do {
-		ActualBytes = this->Read(timeoutInMS, readLen, false);
-		TotalBytes += ActualBytes;
-	} while(readLen == WIFI_RX_BUFFER_LEN and ActualBytes != 0 and ActualBytes == WIFI_RX_BUFFER_LEN);
+		TotalBytes = readResponse(rsp, NULL, timeoutInMS, readLen);
+		processNotifications();
+	} while (retryCommand(responseBusy(), waited));
 
 	if(TotalBytes > 0)
 	{
-#ifdef DEBUG
-		if(WIFI_DEBUG_LVL >= LVL_HIGH)
+		if (LOG_ENABLED(LOG_AT, LOG_TRACE))
 			Base()->GetDebug()->TRACE_VECTOR("SR", wifiRxBuffer);
-#endif
-		if(WIFI_DEBUG_LVL >= LVL_LOW)
-			printf("Response : %s\r\n===\r\n\r\n", (const char *)wifiRxBuffer.GetData());
+		LOG_MSG(LOG_AT, LOG_DEBUG, "Response : %s\r\n===\r\n\r\n", (const char *)wifiRxBuffer.GetData());
 	}
 
+	if (responseBusy())
+		return WIFI_RSP_BUSY;	// Ahead of [rsp]: a late OK belongs to the previous command
 	if (searchBuffer(rsp))
 		return TotalBytes;
 	
@@ -788,23 +2171,31 @@ int16_t ESP8266Device::readForResponse(const char * rsp, unsigned int timeoutInM
 
 int16_t ESP8266Device::readForResponses(const char * pass, const char * fail, unsigned int timeoutInMS, size_t readLen /*= WIFI_RX_BUFFER_LEN*/)
 {
-	clearBuffer();
-	size_t ActualBytes = 0, TotalBytes = 0;
+	uint32_t waited = 0;
+	return readForResponses(pass, fail, timeoutInMS, readLen, waited);
+}
+
+// readForResponses()
+// [waited]: see readForResponse()
+int16_t ESP8266Device::readForResponses(const char * pass, const char * fail, unsigned int timeoutInMS, size_t readLen, uint32_t& waited)
+{
+	if (commandBad())
+		return WIFI_CMD_BAD;
+	size_t TotalBytes;
 	do {
-		ActualBytes = this->Read(timeoutInMS, readLen, false);
-		TotalBytes += ActualBytes;
-	} while(ActualBytes != 0 and ActualBytes == readLen);
+		TotalBytes = readResponse(pass, fail, timeoutInMS, readLen);
+		processNotifications();
+	} while (retryCommand(responseBusy(), waited));
 
 	if(TotalBytes > 0)
 	{
-#ifdef DEBUG
-		if(WIFI_DEBUG_LVL >= LVL_HIGH)
+		if (LOG_ENABLED(LOG_AT, LOG_TRACE))
 			Base()->GetDebug()->TRACE_VECTOR("SR", wifiRxBuffer);
-#endif
-		if(WIFI_DEBUG_LVL >= LVL_LOW)
-			printf("Response : %s\r\n===\r\n\r\n", (const char *)wifiRxBuffer.GetData());
+		LOG_MSG(LOG_AT, LOG_DEBUG, "Response : %s\r\n===\r\n\r\n", (const char *)wifiRxBuffer.GetData());
 	}
 
+	if (responseBusy())
+		return WIFI_RSP_BUSY;
 	if (searchBuffer(pass))	// Search the buffer for goodRsp
 		return TotalBytes;	// Return how number of chars read
 	if (searchBuffer(fail))
@@ -816,6 +2207,243 @@ int16_t ESP8266Device::readForResponses(const char * pass, const char * fail, un
 		return WIFI_RSP_TIMEOUT;
 }
 
+// readResponse()
+// Reads in WIFI_RESPONSE_SLICE slices of at most [readLen] bytes and stops
+// as soon as [pass], [fail], a final ERROR or a busy answer has been received,
+// instead of waiting out the whole timeout. The result is still judged by
+// the caller.
+// Output: bytes received
+size_t ESP8266Device::readResponse(const char * pass, const char * fail, unsigned int timeoutInMS, size_t readLen)
+{
+	clearBuffer();
+	const char * patterns[] = { pass, fail, RESPONSE_ERROR, RESPONSE_BUSY_P, RESPONSE_BUSY_S };
+	size_t overlap = 0;	// A pattern may straddle two slices
+	for (const char * pattern : patterns)
+		if (pattern != NULL)
+			overlap = std::max(overlap, strlen(pattern) - 1);
+
+	uint32_t start = HAL_GetTick();
+	size_t received = 0;
+	for (;;)
+	{
+		uint32_t elapsed = HAL_GetTick() - start;
+		if (elapsed >= timeoutInMS)
+			break;
+		size_t n = this->Read(std::min<uint32_t>(WIFI_RESPONSE_SLICE, timeoutInMS - elapsed), readLen, false);
+		wifiRxBuffer.Truncate(received + n);	// Drop the unfilled part of the slice
+		if (n == 0)
+			continue;
+
+		ESP8266AT::Span tail((const char *)wifiRxBuffer.GetData() + ((received > overlap) ? received - overlap : 0),
+			(const char *)wifiRxBuffer.GetData() + received + n);
+		received += n;
+		bool final = false;
+		for (const char * pattern : patterns)
+			if (pattern != NULL and tail.Find(pattern) != NULL)
+				final = true;
+		if (final)
+			break;
+	}
+	wifiRxBuffer.AppendExtra(1); // Keep the buffer NUL terminated for searchBuffer()
+	return received;
+}
+
+// queryInt()
+// Sends AT<cmd>? and returns the number in its +<cmd>:<n> line.
+// Output:
+//    - Success: >=0
+//    - Fail: <0 (wifi_cmd_rsp)
+template <typename Command>
+int16_t ESP8266Device::queryInt()
+{
+	sendQuery<Command>();
+
+	int16_t rsp = readForResponse(RESPONSE_OK, COMMAND_RESPONSE_TIMEOUT);
+	if (rsp > 0)
+	{
+		ESP8266AT::ResponseScanner scanner = scanResponse();
+		ESP8266AT::Line line;
+		while (scanner.Next(line))
+		{
+			int16_t value;
+			if (line.Is(Command::Text()) and line.Fields.Int(value) and value >= 0)
+				return value;
+		}
+		return WIFI_RSP_UNKNOWN;
+	}
+	return rsp;
+}
+
+// readUntil()
+// Reads byte by byte and returns as soon as the received data ends with
+// [pass] or [fail], instead of waiting out the whole timeout. Used for
+// responses without a trailing line, such as the ">" prompt.
+int16_t ESP8266Device::readUntil(const char * pass, const char * fail, unsigned int timeoutInMS)
+{
+	uint32_t waited = 0;
+	return readUntil(pass, fail, timeoutInMS, waited);
+}
+
+// readUntil()
+// [waited]: see readForResponse()
+int16_t ESP8266Device::readUntil(const char * pass, const char * fail, unsigned int timeoutInMS, uint32_t& waited)
+{
+	if (commandBad())
+		return WIFI_CMD_BAD;
+	size_t passLen = strlen(pass);
+	size_t failLen = (fail != NULL) ? strlen(fail) : 0;
+	size_t busyLen = strlen(RESPONSE_BUSY_P);	// Same length as RESPONSE_BUSY_S
+	int16_t rsp;
+
+	do {
+		clearBuffer();
+		uint32_t start = HAL_GetTick();
+		size_t received = 0;
+		rsp = WIFI_RSP_TIMEOUT;
+
+		for (;;)
+		{
+			uint32_t elapsed = HAL_GetTick() - start;
+			if (elapsed >= timeoutInMS or this->Read(timeoutInMS - elapsed, 1, false) == 0)
+			{
+				if (received > 0)
+					rsp = WIFI_RSP_UNKNOWN;
+				break;
+			}
+
+			const uint8_t * data = wifiRxBuffer.GetData();
+			received++;
+			if (received >= passLen and memcmp(data + received - passLen, pass, passLen) == 0)
+			{
+				rsp = received;
+				break;
+			}
+			if (failLen and received >= failLen and memcmp(data + received - failLen, fail, failLen) == 0)
+			{
+				rsp = WIFI_RSP_FAIL;
+				break;
+			}
+			if (received >= busyLen and (memcmp(data + received - busyLen, RESPONSE_BUSY_P, busyLen) == 0
+				or memcmp(data + received - busyLen, RESPONSE_BUSY_S, busyLen) == 0))
+			{
+				rsp = WIFI_RSP_BUSY;
+				break;
+			}
+		}
+		wifiRxBuffer.AppendExtra(1); // Keep the buffer NUL terminated for searchBuffer()
+		processNotifications();
+
+		if (received > 0)
+			LOG_MSG(LOG_AT, LOG_DEBUG, "Response : %s\r\n===\r\n\r\n", (const char *)wifiRxBuffer.GetData());
+	} while (retryCommand(rsp == WIFI_RSP_BUSY, waited));
+
+	return rsp;
+}
+
+// processNotifications()
+// Picks asynchronous notifications out of the last response. Called after
+// every read, so nothing is lost when they arrive in the middle of another
+// command's response:
+//    - [<link ID>,]CONNECT / CLOSED / CONNECT FAIL: link state cache
+//    - [<link ID>,]<segment ID>,SEND OK / SEND FAIL: CIPSENDBUF completion
+//    - WIFI GOT IP / WIFI DISCONNECT: AP association
+void ESP8266Device::processNotifications()
+{
+	const char * end = (const char *)wifiRxBuffer.GetData() + wifiRxBuffer.Size();
+	ESP8266AT::ResponseScanner scanner = scanResponse();
+	ESP8266AT::Line line;
+	while (scanner.Next(line))
+	{
+		if (line.Tag.StartsWith("+IPD,") and line.Text.End == line.Tag.End)
+		{
+			// Passive mode: +IPD,[<link ID>,]<len>[,<remote IP>,<remote port>]
+			// announces data kept in the module for AT+CIPRECVDATA. AT 1.x
+			// reports each arrival, later firmware the total held; adding
+			// them up can only overestimate, and TCPReceive() corrects that.
+			ESP8266AT::FieldReader header(ESP8266AT::Span(line.Tag.Begin + 5, line.Tag.End));
+			uint8_t linkID = 0;
+			uint16_t len;
+			if (m_PassiveRecv and (not m_Mux or header.Int(linkID)) and header.Int(len)
+				and linkID < WIFI_MAX_SOCK_NUM)
+				m_RecvPending[linkID] += len;
+			continue;
+		}
+		if (line.Tag.StartsWith("+IPD,"))
+		{
+			// +IPD,[<link ID>,]<len>[,<remote IP>,<remote port>]:<data> - step
+			// over the data so a payload that looks like an event isn't taken
+			// for one, and hand UDP datagrams to the receive handler.
+			ESP8266AT::FieldReader header(ESP8266AT::Span(line.Tag.Begin + 5, line.Tag.End));
+			uint8_t linkID = 0;
+			uint16_t len;
+			if ((m_Mux and not header.Int(linkID)) or not header.Int(len))
+				continue;
+			const char * payload = line.Fields.Rest().Begin;
+			scanner.SkipTo(payload + len);
+
+			wifi_datagram datagram;
+			datagram.remotePort = 0;
+			if (not header.AtEnd() and not (header.IP(datagram.remoteIP) and header.Int(datagram.remotePort)))
+				continue;
+			if (m_DatagramHandler and linkID < WIFI_MAX_SOCK_NUM
+				and m_Status.ipstatus[linkID].linkID == linkID and m_Status.ipstatus[linkID].type == WIFI_UDP
+				and payload + len <= end)
+			{
+				datagram.data = (const uint8_t *)payload;
+				datagram.size = len;
+				m_DatagramHandler(linkID, datagram);
+			}
+			continue;
+		}
+
+		ESP8266AT::FieldReader fields(line.Text);
+		unsigned long first = 0, segment = 0;	// Segment IDs count up for as long as the module runs
+		ESP8266AT::Span event;
+		bool haveFirst = fields.Int(first);
+		bool haveSegment = haveFirst and fields.Int(segment);
+		if (not fields.Word(event) or not fields.AtEnd())
+			continue;
+		bool sendResult = event.Equals("SEND OK") or event.Equals("SEND FAIL");
+		if (haveFirst and not haveSegment and not m_Mux and sendResult)
+		{
+			// Single connection: "<segment ID>,SEND OK", for the one link sending
+			haveSegment = true;
+			segment = first;
+			first = 0;
+			for (uint8_t i = 0; i < WIFI_MAX_SOCK_NUM; i++)
+				if (m_Send[i].InFlight > 0)
+				{
+					first = i;
+					break;
+				}
+		}
+		if (first >= WIFI_MAX_SOCK_NUM)
+			continue;
+		uint8_t linkID = (uint8_t)first;
+		bool haveLink = haveFirst;
+
+		if (haveSegment)
+		{
+			if (not sendResult)
+				continue;
+			if (m_Send[linkID].InFlight > 0)
+				m_Send[linkID].InFlight--;
+			if (not event.Equals("SEND OK"))
+				m_Send[linkID].Failed = true;
+		}
+		else if (event.Equals("CONNECT"))
+			linkOpened(linkID);
+		else if (event.Equals("CLOSED") or event.Equals("CONNECT FAIL"))
+			linkClosed(linkID);
+		else if (haveLink)
+			continue;
+		else if (event.Equals("WIFI GOT IP"))
+			m_Status.stat = WIFI_STATUS_GOTIP;
+		else if (event.Equals("WIFI DISCONNECT"))
+			wifiDisconnected();
+	}
+}
+
 //////////////////
 // Buffer Stuff //
 //////////////////
@@ -827,5 +2455,13 @@ void ESP8266Device::clearBuffer()
 
 char * ESP8266Device::searchBuffer(const char * test)
 {
-	return strstr((const char *)wifiRxBuffer.GetData(), test);
+	return strstr((char *)wifiRxBuffer.GetData(), test);
+}
+
+// scanResponse()
+// Tokenizer over the last response. The whole buffer is scanned so binary
+// +IPD data can be stepped over; NUL pad bytes end a line like "\r\n".
+ESP8266AT::ResponseScanner ESP8266Device::scanResponse()
+{
+	return ESP8266AT::ResponseScanner((const char *)wifiRxBuffer.GetData(), wifiRxBuffer.Size());
 }
@@ -70,12 +70,16 @@
 // DEALINGS IN THE SOFTWARE.
 // 
 #include <cmsis_os.h>
+#include <new>
 #include "main.h"
 #include "string.h"
 
 #include "WiFiBuffer.h"
+#include "HeapStats.h"
 #include "STM32-Server.h"
 #include "STM32Debug.h"
+#include "STM32Log.h"
+#include "STM32Timeline.h"
 #include "STM32TCP.h"
 #include "ESP8266_WiFi.h"
 
@@ -91,33 +95,61 @@ STM32TCPSocket *pSocket;
 STM32Base * g_pBase;		// must be defined for STM32Debug to work
 
 void Socket_Read_Handler(ERROR_TYPE Error, size_t BytesReceived);
+void Socket_Pull_Data();
 
 void RunServer()
 {
+#ifdef STM32_STATIC_ALLOCATION
+	// Constructed here, in this order, on the one call, and never destroyed.
+	// Placed in static storage rather than being function-local statics,
+	// which would register their destructors with atexit().
+	alignas(STM32Base) static uint8_t BaseStorage[sizeof(STM32Base)];
+	alignas(ESP8266Device) static uint8_t DeviceStorage[sizeof(ESP8266Device)];
+	alignas(STM32TCPSocket) static uint8_t SocketStorage[sizeof(STM32TCPSocket)];
+
+	g_pBase = new (BaseStorage) STM32Base();
+	TIMELINE_START();
+
+	wifi = new (DeviceStorage) ESP8266Device(WiFi_GPIO_Pin(WIFI_RST_GPIO_Port, WIFI_RST_Pin));
+
+	pSocket = new (SocketStorage) STM32TCPSocket(
+			STM32Serial::Options(STM32Serial::Options::BaudRate::BAUD_115200),
+			STM32TCP::Options(STM32TCP::Options::MODE_SERVER, STM32TCP::Options::VERSION4,
+				STM32TCP::Options::TCP, true, true),
+			wifi
+		);
+#else
 	g_pBase = new STM32Base();
+	TIMELINE_START();
 
 	wifi = new ESP8266Device(WiFi_GPIO_Pin(WIFI_RST_GPIO_Port, WIFI_RST_Pin));
-	wifi->WIFI_DEBUG_LVL = WiFiDevice::LVL_LOW;
 
 	pSocket = new STM32TCPSocket(
 			STM32Serial::Options(STM32Serial::Options::BaudRate::BAUD_115200),
-			STM32TCP::Options(STM32TCP::Options::MODE_SERVER),
+			STM32TCP::Options(STM32TCP::Options::MODE_SERVER, STM32TCP::Options::VERSION4,
+				STM32TCP::Options::TCP, true, true),
 			wifi
 		);
+#endif
 
 	pSocket->RegisterReadHandler(Socket_Read_Handler);
 
 	if(SUCCESSFUL != pSocket->Open(nullptr, STM32SerialSocket::DEFAULT_WiFi_PORT, "Xeon", "Himanshu"))
-		printf("Socket opening unsuccessful.\r\n");
+		LOG_MSG(LOG_APP, LOG_ERROR, "Socket opening unsuccessful.\r\n");
 	else
 	{
 		wifiRxBuffer.Clear();
-		pSocket->Read(nullptr, 1U);
+		pSocket->Read(nullptr, 1U);		// Also drives pSocket->Poll(), see STM32TCPSocket::OnRead()
 	}
-	printf("OKAY\r\n");
+	LOG_MSG(LOG_APP, LOG_INFO, "OKAY\r\n");
 	for(;;)
 	{
 		HAL_GPIO_TogglePin(LD1_GPIO_Port, LD1_Pin);
+		if (HAL_GPIO_ReadPin(B1_GPIO_Port, B1_Pin) == GPIO_PIN_SET)	// Hold the user button for heap statistics and the timeline
+		{
+			DumpHeapStats();
+			TIMELINE_DUMP();
+		}
 		osDelay(2000);
 	}
 }
@@ -126,15 +158,37 @@ void Socket_Read_Handler(ERROR_TYPE Error, size_t BytesReceived)
 {
 	if (SUCCESSFUL == Error || BytesReceived)
 	{
+		TIMELINE_SPAN(TL_SOCKET_READ, BytesReceived);
 		pSocket->AppendAsyncReadResult(&wifiRxBuffer, BytesReceived);
 		size_t ActualBytes = 0, TotalBytes = 0;
 		do {
 			ActualBytes = wifi->Read(1000, WIFI_RX_BUFFER_LEN, false);
 			TotalBytes += ActualBytes;
 		} while(ActualBytes != 0 and ActualBytes == WIFI_RX_BUFFER_LEN);
-		Base()->GetDebug()->TRACE_VECTOR("SR", wifiRxBuffer);
-		printf("Received : %s\r\n===\r\n", (const char *)wifiRxBuffer.GetData());
+		if (LOG_ENABLED(LOG_APP, LOG_TRACE))
+			Base()->GetDebug()->TRACE_VECTOR("SR", wifiRxBuffer);
+		LOG_MSG(LOG_APP, LOG_INFO, "Received : %s\r\n===\r\n", (const char *)wifiRxBuffer.GetData());
+		wifi->TCPProcessEvents();
 		wifiRxBuffer.Clear();
+		Socket_Pull_Data();
 		pSocket->Read(nullptr, 1U);
 	}
 }
+
+// Passive receive: the module holds the data announced by +IPD until it is
+// pulled, one buffer's worth at a time, so a burst is throttled by TCP
+// instead of overrunning the serial ring.
+void Socket_Pull_Data()
+{
+	static uint8_t Data[WIFI_RX_BUFFER_LEN * 2];
+	for (uint8_t linkID = 0; linkID < WIFI_MAX_SOCK_NUM; linkID++)
+	{
+		int16_t Received;
+		while (wifi->TCPPending(linkID) > 0 and
+			(Received = wifi->TCPReceive(linkID, Data, sizeof(Data))) > 0)
+		{
+			if (LOG_ENABLED(LOG_APP, LOG_INFO))		// printf: "%.*s" can't be deferred
+				printf("Link %u : %.*s\r\n", linkID, Received, (const char *)Data);
+		}
+	}
+}
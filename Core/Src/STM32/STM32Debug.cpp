@@ -72,56 +72,304 @@
 
 #include <cstdio>
 #include <cstdarg>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
 
 #include "cmsis_os.h"
 #include "STM32Debug.h"
+#include "STM32Log.h"
 #include "main.h"
 
+static_assert((STM32_LOG_RING_SIZE & (STM32_LOG_RING_SIZE - 1)) == 0, "STM32_LOG_RING_SIZE must be a power of two");
+static_assert((uint8_t)EPRI::STM32Debug::TRACE_OFFSET == (uint8_t)EPRI::Log::BUFFER_OFFSET and
+	(uint8_t)EPRI::STM32Debug::TRACE_ASCII == (uint8_t)EPRI::Log::BUFFER_ASCII,
+	"TRACE_BUFFER() columns are recorded as they are");
+
+#define LOG_SIGNAL_DATA		0x01	// Notification bits of the PRINTF thread
+#define LOG_SIGNAL_SENT		0x02
+#define LOG_TX_TIMEOUT		1000	// ms; a full ring takes ~360 ms at 115200 baud
+#define TRACE_MARKER_MAX	32		// Marker characters shown on TRACE_BUFFER() lines
+#define PRINTF_STACK_DEPTH	128		// Words
+
 extern UART_HandleTypeDef huart3;
 static osThreadId PRINTFThreadHandle;
+#ifdef STM32_STATIC_ALLOCATION
+static uint32_t PRINTFThreadBuffer[PRINTF_STACK_DEPTH];
+static osStaticThreadDef_t PRINTFThreadControlBlock;
+#endif
 static EPRI::STM32Base * g_pBL;
 uint8_t EPRI::STM32Debug::instantiations = 0U;	// static member
 
+// printf output waiting for USART3. The counters run freely and are reduced
+// modulo the ring size on use. A writer claims space by moving reserved
+// with a compare-and-swap, copies its bytes and publishes them by adding to
+// committed, so tasks and ISRs can log at the same time without a lock or an
+// allocation. The PRINTF thread only sends what lies before committed while
+// no claim is outstanding (committed == reserved); sent moves on when the
+// DMA transfer completes. Output that doesn't fit is counted and dropped.
 static struct {
-	struct {
-		char * ptr = nullptr;
-		int len = 0;
-	} queue[UINT8_MAX + 1];
-	uint8_t head = 0U;
-	uint8_t tail = 0U;
-} TxQueue;
+	uint8_t data[STM32_LOG_RING_SIZE];
+	std::atomic<uint32_t> reserved{0};
+	std::atomic<uint32_t> committed{0};
+	std::atomic<uint32_t> sent{0};
+	std::atomic<uint32_t> dropped{0};	// Bytes
+	volatile uint32_t inFlight = 0;		// Length of the running DMA transfer
+} LogRing;
+
+static void LogWake(uint32_t Signal)
+{
+	if (PRINTFThreadHandle == NULL or osKernelRunning() != 1)
+		return;		// Before the scheduler starts; sent once it does
+	if (__get_IPSR() != 0U)
+	{
+		BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+		xTaskNotifyFromISR(PRINTFThreadHandle, Signal, eSetBits, &xHigherPriorityTaskWoken);
+		portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+	}
+	else
+		xTaskNotify(PRINTFThreadHandle, Signal, eSetBits);
+}
+
+static bool LogReserve(size_t len, uint32_t& start)
+{
+	start = LogRing.reserved.load(std::memory_order_relaxed);
+	do {
+		if (len > STM32_LOG_RING_SIZE - (start - LogRing.sent.load(std::memory_order_acquire)))
+		{
+			LogRing.dropped.fetch_add(len, std::memory_order_relaxed);
+			return false;
+		}
+	} while (not LogRing.reserved.compare_exchange_weak(start, start + len, std::memory_order_acquire));
+	return true;
+}
+
+static void LogCopy(uint32_t position, const void * ptr, size_t len)
+{
+	size_t offset = position & (STM32_LOG_RING_SIZE - 1);
+	size_t first = std::min(len, STM32_LOG_RING_SIZE - offset);
+	memcpy(&LogRing.data[offset], ptr, first);
+	memcpy(&LogRing.data[0], (const uint8_t *)ptr + first, len - first);
+}
+
+static void LogPublish(size_t len)
+{
+	LogRing.committed.fetch_add(len, std::memory_order_release);
+	LogWake(LOG_SIGNAL_DATA);
+}
+
+static size_t LogPut(const char * ptr, size_t len)
+{
+	uint32_t start;
+	if (not LogReserve(len, start))
+		return 0;
+	LogCopy(start, ptr, len);
+	LogPublish(len);
+	return len;
+}
+
+namespace EPRI
+{
+	namespace Log
+	{
+		static constexpr uint32_t LevelBits(Level Verbosity)
+		{
+			return ((1U << (Verbosity + 1)) - 1) & ~1U;
+		}
+
+		volatile uint32_t Mask = LevelBits(STM32_LOG_RUNTIME_LEVEL) * 0x01010101U;
+
+		void SetLevel(Subsystem Which, Level Verbosity)
+		{
+			taskENTER_CRITICAL();
+			Mask = (Mask & ~(0xFFU << (8 * Which))) | (LevelBits(Verbosity) << (8 * Which));
+			taskEXIT_CRITICAL();
+		}
+
+		Level GetLevel(Subsystem Which)
+		{
+			uint8_t Bits = Mask >> (8 * Which);
+			uint8_t Verbosity = LOG_NONE;
+			while (Bits & (2U << Verbosity))
+				Verbosity++;
+			return (Level)Verbosity;
+		}
+
+		bool Frame::Begin(FrameType Type, size_t PayloadLength)
+		{
+			m_Active = false;
+			uint16_t Length = 1 + 4 + PayloadLength;		// type, tick, payload
+			if (1 + 4 + PayloadLength > UINT16_MAX)
+				return false;
+			m_Size = 1 + 2 + Length + 1;
+			if (not LogReserve(m_Size, m_Start))
+				return false;
+			m_Active = true;
+			m_Position = m_Start;
+			m_Check = 0;
+
+			uint8_t Sync = FRAME_SYNC;
+			LogCopy(m_Position++, &Sync, 1);
+			uint32_t Tick = HAL_GetTick();
+			Put(&Length, 2);
+			Put(&Type, 1);
+			Put(&Tick, 4);
+			return true;
+		}
+
+		void Frame::Put(const void * Data, size_t Length)
+		{
+			if (not m_Active)
+				return;
+			for (size_t i = 0; i < Length; i++)
+				m_Check ^= ((const uint8_t *)Data)[i];
+			LogCopy(m_Position, Data, Length);
+			m_Position += Length;
+		}
+
+		void Frame::End()
+		{
+			if (not m_Active)
+				return;
+			LogCopy(m_Position, &m_Check, 1);
+			m_Active = false;
+			LogPublish(m_Size);
+		}
+
+		size_t Room()
+		{
+			return STM32_LOG_RING_SIZE - (LogRing.reserved.load(std::memory_order_relaxed) -
+				LogRing.sent.load(std::memory_order_acquire));
+		}
+
+		void Text(const char * Data, size_t Length)
+		{
+#ifdef LOG_DEFERRED
+			Frame Out;
+			if (Out.Begin(FRAME_TEXT, Length))
+			{
+				Out.Put(Data, Length);
+				Out.End();
+			}
+#else
+			LogPut(Data, Length);
+#endif
+		}
+
+		// Buffer()
+		// TRACE_BUFFER() for the decoder: the dump is cut into frames of whole
+		// lines so a large buffer doesn't need one large reservation.
+		void Buffer(const char * Marker, const uint8_t * Data, size_t Size, uint8_t BytesPerLine, uint8_t Columns)
+		{
+			if (BytesPerLine == 0 or BytesPerLine > STM32_TRACE_LINE_MAX)
+				BytesPerLine = STM32_TRACE_LINE_MAX;
+			uint8_t MarkerLength = strnlen(Marker, TRACE_MARKER_MAX);
+			size_t Chunk = std::max((size_t)BytesPerLine, (size_t)(STM32_LOG_BUFFER_CHUNK / BytesPerLine) * BytesPerLine);
+			size_t Offset = 0;
+			do {
+				size_t Length = std::min(Size - Offset, Chunk);
+				uint8_t Flags = ((Offset == 0) ? BUFFER_FIRST : 0) | ((Offset + Length == Size) ? BUFFER_LAST : 0) |
+					(Columns & (BUFFER_OFFSET | BUFFER_ASCII));
+				Frame Out;
+				if (Out.Begin(FRAME_BUFFER, 3 + MarkerLength + Length))
+				{
+					Out.Put(&Flags, 1);
+					Out.Put(&BytesPerLine, 1);
+					Out.Put(&MarkerLength, 1);
+					Out.Put(Marker, MarkerLength);
+					Out.Put(Data + Offset, Length);
+					Out.End();
+				}
+				Offset += Length;
+			} while (Offset < Size);
+		}
+	}
+}
+
+// Tells how much was lost, without printf: this runs on the PRINTF
+// thread's small stack.
+static void LogReportDropped(uint32_t Bytes)
+{
+	char Note[40] = "\r\n[log: ";
+	char Digits[10];
+	size_t len = strlen(Note), n = 0;
+	do {
+		Digits[n++] = '0' + (Bytes % 10);
+		Bytes /= 10;
+	} while (Bytes);
+	while (n)
+		Note[len++] = Digits[--n];
+	strcpy(&Note[len], " bytes dropped]\r\n");
+	EPRI::Log::Text(Note, strlen(Note));
+}
 
 extern "C"
 {
 	int _write(int file, char *ptr, int len)	// for printf
 	{
 		HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
-		TxQueue.queue[TxQueue.head].len = len;
-		TxQueue.queue[TxQueue.head].ptr = (char *)realloc(TxQueue.queue[TxQueue.head].ptr, len);
-		if(TxQueue.queue[TxQueue.head].ptr == NULL)
-			TxQueue.queue[TxQueue.head].ptr = (char *)malloc(len);
-		for(int i=0; i<len; i++)
-			TxQueue.queue[TxQueue.head].ptr[i] = ptr[i];
-
-		TxQueue.head++;
-		return len;
+		if (len > 0)
+			EPRI::Log::Text(ptr, len);
+		return len;		// Dropped output is counted, never reported as a write error
+	}
+
+	void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+	{
+		if (huart != &huart3)
+			return;
+		LogRing.sent.fetch_add(LogRing.inFlight, std::memory_order_release);
+		LogRing.inFlight = 0;
+		LogWake(LOG_SIGNAL_SENT);
 	}
 
 	static void PRINTFThread_fun(void const * argument)
 	{
-	  for(;;)
-	  {
-		  if(TxQueue.tail != TxQueue.head)
-		  {
-			  HAL_UART_Transmit(&huart3, (uint8_t *)TxQueue.queue[TxQueue.tail].ptr, TxQueue.queue[TxQueue.tail].len, 1000);
-			  TxQueue.tail++;
-		  }
-		  else
-		  {
-			  HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
-			  osDelay(1000);
-		  }
-	  }
+		uint32_t Reported = 0;	// dropped count already noted in the output
+		for(;;)
+		{
+			uint32_t Sent = LogRing.sent.load(std::memory_order_acquire);
+			uint32_t Committed = LogRing.committed.load(std::memory_order_acquire);
+			if (Committed == Sent or Committed != LogRing.reserved.load(std::memory_order_acquire))
+			{
+				// Nothing complete to send: sleep until the next write.
+				HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
+				xTaskNotifyWait(0, LOG_SIGNAL_DATA, NULL, portMAX_DELAY);
+				continue;
+			}
+
+			// One contiguous run per transfer; a wrapped ring takes two.
+			size_t Offset = Sent & (STM32_LOG_RING_SIZE - 1);
+			size_t Length = std::min((size_t)(Committed - Sent), STM32_LOG_RING_SIZE - Offset);
+			LogRing.inFlight = Length;
+			if (HAL_UART_Transmit_DMA(&huart3, &LogRing.data[Offset], Length) != HAL_OK)
+			{
+				HAL_UART_Transmit(&huart3, &LogRing.data[Offset], Length, LOG_TX_TIMEOUT);
+				LogRing.inFlight = 0;
+				LogRing.sent.fetch_add(Length, std::memory_order_release);
+			}
+			else
+			{
+				uint32_t Signals = 0;
+				while (not (Signals & LOG_SIGNAL_SENT))
+				{
+					if (xTaskNotifyWait(0, LOG_SIGNAL_SENT, &Signals, pdMS_TO_TICKS(LOG_TX_TIMEOUT)) != pdTRUE)
+					{
+						// Stuck transfer: give up on this run rather than the log.
+						HAL_UART_AbortTransmit(&huart3);
+						LogRing.inFlight = 0;
+						LogRing.sent.fetch_add(Length, std::memory_order_release);
+						break;
+					}
+				}
+			}
+
+			uint32_t Dropped = LogRing.dropped.load(std::memory_order_relaxed);
+			if (Dropped != Reported)
+			{
+				LogReportDropped(Dropped - Reported);
+				Reported = Dropped;
+			}
+		}
 	}
 }
 
@@ -155,7 +403,12 @@ namespace EPRI
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-    		osThreadDef(PRINTFThread, PRINTFThread_fun, osPriorityLow, 0, 128);
+#ifdef STM32_STATIC_ALLOCATION
+    		osThreadStaticDef(PRINTFThread, PRINTFThread_fun, osPriorityLow, 0, PRINTF_STACK_DEPTH,
+    			PRINTFThreadBuffer, &PRINTFThreadControlBlock);
+#else
+    		osThreadDef(PRINTFThread, PRINTFThread_fun, osPriorityLow, 0, PRINTF_STACK_DEPTH);
+#endif
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif
@@ -179,24 +432,80 @@ namespace EPRI
         va_end(Args);
     }
     
-    void STM32Debug::TRACE_BUFFER(const char * Marker, const uint8_t * Buffer, size_t BufferSize, uint8_t BytesPerLine /*= 16*/)
+    // TRACE_BUFFER()
+    // Each line is encoded into a stack buffer with the nibble table and
+    // handed to the log ring in one piece, instead of a vprintf() per byte.
+    // Input:
+    //    - Marker: starts every line (at most TRACE_MARKER_MAX characters shown)
+    //    - BytesPerLine: 1 to STM32_TRACE_LINE_MAX
+    //    - Columns: TRACE_OFFSET and/or TRACE_ASCII
+    void STM32Debug::TRACE_BUFFER(const char * Marker, const uint8_t * Buffer, size_t BufferSize, uint8_t BytesPerLine /*= 16*/,
+        uint8_t Columns /*= 0*/)
     {
-		TRACE("\r\n%s: ", Marker);
-		const uint8_t * p = Buffer;
-		while (p != (Buffer + BufferSize))
-		{
-			TRACE("%02X ", uint16_t(*p++));
-			if (0 == (size_t(p - Buffer) % BytesPerLine))
+#ifdef LOG_DEFERRED
+		Log::Buffer(Marker, Buffer, BufferSize, BytesPerLine, Columns);
+		return;
+#endif
+		static const char Hex[] = "0123456789ABCDEF";
+		char Line[2 + TRACE_MARKER_MAX + 2 + 10 + (3 * STM32_TRACE_LINE_MAX) + 2 + STM32_TRACE_LINE_MAX];
+
+		if (BytesPerLine == 0 or BytesPerLine > STM32_TRACE_LINE_MAX)
+			BytesPerLine = STM32_TRACE_LINE_MAX;
+		size_t MarkerLength = strnlen(Marker, TRACE_MARKER_MAX);
+		fflush(stdout);		// Keep the dump behind any printf output still buffered
+		size_t Offset = 0;
+		do {
+			size_t Count = std::min(BufferSize - Offset, (size_t)BytesPerLine);
+			const uint8_t * Data = Buffer + Offset;
+			char * p = Line;
+			*p++ = '\r';
+			*p++ = '\n';
+			memcpy(p, Marker, MarkerLength);
+			p += MarkerLength;
+			*p++ = ':';
+			*p++ = ' ';
+			if (Columns & TRACE_OFFSET)
 			{
-				TRACE("\r\n%s: ", Marker);
+				int Digits = (Offset > 0xFFFF) ? 8 : 4;
+				for (int Shift = (Digits - 1) * 4; Shift >= 0; Shift -= 4)
+					*p++ = Hex[(Offset >> Shift) & 0x0F];
+				*p++ = ':';
+				*p++ = ' ';
 			}
-		}
-		TRACE("\r\n");
+			for (size_t Index = 0; Index < Count; ++Index)
+			{
+				*p++ = Hex[Data[Index] >> 4];
+				*p++ = Hex[Data[Index] & 0x0F];
+				*p++ = ' ';
+			}
+			if (Columns & TRACE_ASCII)
+			{
+				for (size_t Index = Count; Index < BytesPerLine; ++Index)
+				{
+					*p++ = ' ';
+					*p++ = ' ';
+					*p++ = ' ';
+				}
+				*p++ = '|';
+				for (size_t Index = 0; Index < Count; ++Index)
+					*p++ = (Data[Index] >= 0x20 and Data[Index] < 0x7F) ? (char)Data[Index] : '.';
+				*p++ = '|';
+			}
+			Log::Text(Line, p - Line);
+			Offset += Count;
+		} while (Offset < BufferSize);
+		Log::Text("\r\n", 2);
 	}
     
-    void STM32Debug::TRACE_VECTOR(const char * Marker, const WiFiBuffer& Data, uint8_t BytesPerLine /*= 16*/)
+    void STM32Debug::TRACE_VECTOR(const char * Marker, const WiFiBuffer& Data, uint8_t BytesPerLine /*= 16*/,
+        uint8_t Columns /*= 0*/)
+    {
+        TRACE_BUFFER(Marker, Data.GetData(), Data.Size(), BytesPerLine, Columns);
+    }
+
+    uint32_t STM32Debug::LogDropped() const
     {
-        TRACE_BUFFER(Marker, Data.GetData(), Data.Size(), BytesPerLine);
+        return LogRing.dropped.load(std::memory_order_relaxed);
     }
     
 }
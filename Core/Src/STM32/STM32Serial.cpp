@@ -76,15 +76,20 @@
 #include <../CMSIS_RTOS/cmsis_os.h>
 #include <cstring>
 #include <timers.h>
+#include <semphr.h>
 #include <climits>
 
 #include "STM32Debug.h"
+#include "STM32Log.h"
+#include "STM32Timeline.h"
 #include "STM32Serial.h"
 #include "CircularBuffer.h"
 
 #include "main.h"
 extern UART_HandleTypeDef huart6;
 
+#define CALLBACK_STACK_DEPTH	(20 * configMINIMAL_STACK_SIZE)		// Words
+
 extern "C"
 {
 	static UART_HandleTypeDef		&g_Handle = huart6;
@@ -95,6 +100,14 @@ extern "C"
 	static EPRI::ERROR_TYPE			g_LastError = EPRI::SUCCESSFUL;
 	static size_t					g_BytesRead = 0;
 	static osThreadId				g_CallbackThread = 0;
+#ifdef STM32_STATIC_ALLOCATION
+	static EPRI::STM32SerialSocket* volatile g_pCallbackSocket = nullptr;	// Latest socket, read by CallbackThread
+	static SemaphoreHandle_t		g_CallbackLock = nullptr;	// Held while CallbackThread uses g_pCallbackSocket
+	static StaticSemaphore_t		g_CallbackLockBuffer;
+	static StaticTimer_t			g_RXTimerBuffer;
+	static uint32_t					g_CallbackThreadBuffer[CALLBACK_STACK_DEPTH];
+	static osStaticThreadDef_t		g_CallbackThreadControlBlock;
+#endif
 
 	// Himanshu
 	UART_HandleTypeDef*				pg_Handle = &g_Handle;
@@ -230,6 +243,7 @@ extern "C"
 	{
 		g_LastError = (huart->RxXferCount == 0 ? EPRI::SUCCESSFUL : !EPRI::SUCCESSFUL);
 		g_BytesRead = huart->RxXferSize - huart->RxXferCount;	// Himanshu - added third {+} expression (+ not g_ClearInterrupt)
+		TIMELINE_INSTANT(TL_UART_RX, g_BytesRead);
 		BaseType_t xHigherPriorityTaskWoken = pdFALSE;
 		xTaskNotifyFromISR(g_CallbackThread,
 			0x00000001,
@@ -261,6 +275,7 @@ extern "C"
 		{
 			g_LastError = EPRI::ERR_TIMEOUT;
 			g_BytesRead = huart->RxXferSize - huart->RxXferCount;
+			TIMELINE_INSTANT(TL_RX_TIMEOUT, g_BytesRead);
 			BaseType_t xHigherPriorityTaskWoken = pdFALSE;
 			xTaskNotify(g_CallbackThread,
 				0x00000001,
@@ -284,10 +299,21 @@ extern "C"
 				ULONG_MAX,
 				&NotifiedValue,
 				portMAX_DELAY);
-			if (NotifiedValue & 0x00000001 && pSocket->m_Read)
+#ifdef STM32_STATIC_ALLOCATION
+			// The thread outlives the socket it was created for. Its
+			// destructor takes the lock too, so it waits for a callback
+			// that is already running.
+			xSemaphoreTakeRecursive(g_CallbackLock, portMAX_DELAY);
+			pSocket = g_pCallbackSocket;
+#endif
+			if (pSocket && NotifiedValue & 0x00000001 && pSocket->m_Read)
 			{
+				TIMELINE_SPAN(TL_CALLBACK, g_BytesRead);
 				pSocket->m_Read(g_LastError, g_BytesRead);
 			}
+#ifdef STM32_STATIC_ALLOCATION
+			xSemaphoreGiveRecursive(g_CallbackLock);
+#endif
 
 			HAL_GPIO_TogglePin(LD3_GPIO_Port, LD3_Pin);
 		}
@@ -313,31 +339,68 @@ namespace EPRI
 	STM32SerialSocket::STM32SerialSocket(const STM32Serial::Options& Opt)
 		: m_Options(Opt)
 	{
+#ifdef STM32_STATIC_ALLOCATION
+		// The timer and thread have one set of buffers: they are created by
+		// the first socket and kept, and deliver to the latest socket.
+		if (g_CallbackLock == nullptr)
+			g_CallbackLock = xSemaphoreCreateRecursiveMutexStatic(&g_CallbackLockBuffer);
+		xSemaphoreTakeRecursive(g_CallbackLock, portMAX_DELAY);
+		g_pCallbackSocket = this;
+		xSemaphoreGiveRecursive(g_CallbackLock);
+		if (g_hRXTimer == nullptr)
+			g_hRXTimer = xTimerCreateStatic("RXTimer", pdMS_TO_TICKS(1000), pdFALSE, nullptr, vTimerCallback, &g_RXTimerBuffer);
+		if (g_CallbackThread != 0)
+			return;
+#else
 		if (g_hRXTimer)
 		{
 			xTimerDelete(g_hRXTimer, pdMS_TO_TICKS(100));
 		}
 		g_hRXTimer = xTimerCreate("RXTimer", pdMS_TO_TICKS(1000), pdFALSE, nullptr, vTimerCallback);
+#endif
 
 #ifdef __GNUC__
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
 #endif
-		osThreadDef(Callback, CallbackThread, osPriorityNormal, 0, 20 * configMINIMAL_STACK_SIZE);
+#ifdef STM32_STATIC_ALLOCATION
+		osThreadStaticDef(Callback, CallbackThread, osPriorityNormal, 0, CALLBACK_STACK_DEPTH,
+			g_CallbackThreadBuffer, &g_CallbackThreadControlBlock);
+#else
+		osThreadDef(Callback, CallbackThread, osPriorityNormal, 0, CALLBACK_STACK_DEPTH);
+#endif
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif
+#ifdef STM32_STATIC_ALLOCATION
+		g_CallbackThread = osThreadCreate(osThread(Callback), nullptr);
+#else
 		g_CallbackThread = osThreadCreate(osThread(Callback), this);
+#endif
 
 	}
 
 	STM32SerialSocket::~STM32SerialSocket()
 	{
+		if (g_pSocket == this)
+			g_pSocket = nullptr;
+#ifdef STM32_STATIC_ALLOCATION
+		// Recursive: the socket may be destroyed from its own callback.
+		xSemaphoreTakeRecursive(g_CallbackLock, portMAX_DELAY);
+		if (g_pCallbackSocket == this)
+			g_pCallbackSocket = nullptr;
+		xSemaphoreGiveRecursive(g_CallbackLock);
+		if (g_hRXTimer)
+		{
+			xTimerStop(g_hRXTimer, pdMS_TO_TICKS(100));
+		}
+#else
 		if (g_hRXTimer)
 		{
 			xTimerDelete(g_hRXTimer, pdMS_TO_TICKS(100));
 		}
 		g_hRXTimer = nullptr;
+#endif
 	}
 
 	ERROR_TYPE STM32SerialSocket::Open(const char * DestinationAddress /*= nullptr*/, int Port /*= DEFAULT_WiFi_PORT*/)
@@ -494,10 +557,10 @@ namespace EPRI
 		// TODO - verify this operation (not working - see SerialWrapper::Serial_Close() )
 		if(this->Open(DestinationAddress, Port) != SUCCESSFUL)
 		{
-			printf("Connection failed.\r\n");
+			LOG_MSG(LOG_SERIAL, LOG_ERROR, "Connection failed.\r\n");
 			return !SUCCESSFUL;
 		}
-		printf("Connected.\r\n");
+		LOG_MSG(LOG_SERIAL, LOG_INFO, "Connected.\r\n");
 		return SUCCESSFUL;
 	}
 
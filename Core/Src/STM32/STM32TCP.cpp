@@ -7,6 +7,7 @@
 #include <climits>
 
 #include "STM32Debug.h"
+#include "STM32Log.h"
 #include "CircularBuffer.h"
 
 // Himanshu
@@ -18,6 +19,8 @@ static WiFiBuffer TxVector;
 static char MAC[18]{0};
 static IPAddress IP;
 
+extern RNG_HandleTypeDef hrng;
+
 namespace EPRI
 {
 	//
@@ -39,28 +42,29 @@ namespace EPRI
 		, m_WiFi(wifi)
 		, m_IPOptions(IPOpt)
 	{
+		this->STM32SerialSocket::RegisterReadHandler(ReadCallbackFunction::Bind<STM32TCPSocket, &STM32TCPSocket::OnRead>(this));
 		this->SetPortOptions();
 		if (this->STM32SerialSocket::Open("") != SUCCESSFUL)		// m_Socket should not get called in STM32SerialSocket::Open. Hence, passed "" instead of nullptr.
 		{
-			printf("ERROR : Failed to open Serial Socket.\r\n");
-			throw std::runtime_error("error");
+			LOG_MSG(LOG_TCP, LOG_ERROR, "ERROR : Failed to open Serial Socket.\r\n");
+			return;		// m_SerialOpen stays false: Open() fails
 		}
 		else
 		{
+			m_SerialOpen = true;
 			*pg_pSocket = this;
 RETRY_BEGIN:
 			if(m_WiFi->Begin(this))
 			{
-				printf("Init\r\n");
+				LOG_MSG(LOG_TCP, LOG_INFO, "Init\r\n");
 				if(m_WiFi->WiFiLocalMAC(MAC) > 0)
-					printf("MAC Address : %s\r\n", MAC);
+					LOG_MSG(LOG_TCP, LOG_INFO, "MAC Address : %s\r\n", MAC);
 			}
 			else
 			{
-				printf("ERROR : Failed to communicate to WiFi Device.\r\n");
+				LOG_MSG(LOG_TCP, LOG_ERROR, "ERROR : Failed to communicate to WiFi Device.\r\n");
 				osDelay(1000);
 				goto RETRY_BEGIN;
-				throw std::runtime_error("error");
 			}
 		}
 	}
@@ -73,53 +77,261 @@ RETRY_BEGIN:
 	ERROR_TYPE STM32TCPSocket::Open(const char * DestinationAddress /*= nullptr*/, int Port /*= DEFAULT_WiFi_PORT*/,
 			const char* AccessPoint /*= DEFAULT_ACCESSPOINT*/, const char* PassPhrase /*= DEFAULT_PASSPHRASE*/)
 	{
-RETRY_CONNECT:
-		if (m_WiFi->Test() and
-			m_WiFi->WiFiConnect(AccessPoint, PassPhrase) > 0)
+		return PollUntilSettled(OpenAsync(DestinationAddress, Port, AccessPoint, PassPhrase));
+	}
+
+	// PollUntilSettled()
+	// Keeps polling while [RetVal] is join progress: returns once the
+	// socket is online or has failed.
+	ERROR_TYPE STM32TCPSocket::PollUntilSettled(ERROR_TYPE RetVal)
+	{
+		while (RetVal != SUCCESSFUL and GetErrorSource(RetVal) == SRC_SOCKET and
+			GetErrorLevel(RetVal) == LVL_INFORMATIONAL)
+		{
+			if (m_JoinState == STATE_BACKOFF)
+				osDelay(WIFI_JOIN_POLL_SLICE);
+			RetVal = Poll();
+		}
+		return RetVal;
+	}
+
+	ERROR_TYPE STM32TCPSocket::JoinProgress(JoinEvent Event)
+	{
+		return MakeError(SRC_SOCKET, LVL_INFORMATIONAL, Event);
+	}
+
+	ERROR_TYPE STM32TCPSocket::OpenAsync(const char * DestinationAddress /*= nullptr*/, int Port /*= DEFAULT_WiFi_PORT*/,
+			const char* AccessPoint /*= DEFAULT_ACCESSPOINT*/, const char* PassPhrase /*= DEFAULT_PASSPHRASE*/)
+	{
+		if (AccessPoint == nullptr or not m_SerialOpen)
+			return not SUCCESSFUL;
+		m_Destination = DestinationAddress;
+		m_Port = Port;
+		m_AccessPoint = AccessPoint;
+		m_PassPhrase = PassPhrase;
+		m_Backoff = WIFI_JOIN_BACKOFF_MIN;
+		m_JoinState = STATE_JOIN;
+
+		// The module may have come up already on this AP (auto-join)
+		char SSID[WIFI_SSID_LEN];
+		if (m_WiFi->WiFiIsAssociated() and m_WiFi->WiFiGetAP(SSID) > 0 and strcmp(SSID, AccessPoint) == 0)
 		{
-			printf("Connected to %s.\r\n", AccessPoint);
-			if(std::string(IP = m_WiFi->WiFiLocalIP()) != "")
-				printf("IP Address : %s\r\n", std::string(IP).c_str());
-			if (m_IPOptions.m_Mode == STM32TCP::Options::MODE_SERVER)
+			m_WiFi->m_Boot.Step(WIFI_BOOT_JOIN, true);
+			return Joined();
+		}
+		return Poll(0);
+	}
+
+	ERROR_TYPE STM32TCPSocket::Poll(uint32_t TimeSliceInMS /*= WIFI_JOIN_POLL_SLICE*/)
+	{
+		switch (m_JoinState)
+		{
+		case STATE_IDLE:
+			return not SUCCESSFUL;
+
+		case STATE_ONLINE:
+			if (m_WiFi->WiFiIsAssociated())
 			{
-				if (m_WiFi->TCPSetMux(0) > 0 and
-					m_WiFi->TCPSetTransferMode(m_IPOptions.m_Mode) > 0 and
-					m_WiFi->TCPSetMux(1) > 0 and
-					m_WiFi->TCPConfigureServer(Port, 1) > 0)			// TODO - keepAlive
+				if (not m_WiFi->TCPIsPassthrough())		// No commands in transparent mode
 				{
-					printf("Server started on %s:%d\r\n", std::string(IP).c_str(), Port);
-
-					if (m_Connect)
-					{
-						m_Connect(SUCCESSFUL);
-					}
+					m_WiFi->TCPFlushExpired();			// Coalesced writes past their deadline
+					m_WiFi->TCPPoolExpire();			// Idle pooled client links
+					m_WiFi->TCPSchedule(TimeSliceInMS);	// Queued sends, see TCPQueue()
+				}
+				return SUCCESSFUL;
+			}
+			LOG_MSG(LOG_TCP, LOG_INFO, "Lost %s, rejoining.\r\n", m_AccessPoint);
+			m_Connected = false;
+			m_Backoff = WIFI_JOIN_BACKOFF_MIN;
+			m_JoinState = STATE_JOIN;
+			if (m_Connect)
+				m_Connect(JoinProgress(JOIN_LOST));
+			return JoinProgress(JOIN_LOST);
+
+		case STATE_BACKOFF:
+			if ((int32_t)(HAL_GetTick() - m_RetryAt) < 0)
+				return JoinProgress(JOIN_RETRY);
+			m_JoinState = STATE_JOIN;
+			// fall through
+
+		case STATE_JOIN:
+		{
+			// Rejoining the access point we were last on: pin the BSSID so the
+			// module skips picking the strongest AP among the ones it scanned.
+			m_HintedJoin = (m_LastAP.Valid and strcmp(m_LastAP.SSID, m_AccessPoint) == 0);
+			if (not m_WiFi->Test() or
+				m_WiFi->WiFiJoinStart(m_AccessPoint, m_PassPhrase, m_HintedJoin ? m_LastAP.BSSID : nullptr) <= 0)
+			{
+				ScheduleRetry();
+				return JoinProgress(JOIN_RETRY);
+			}
+			m_JoinState = STATE_JOINING;
+			if (m_Connect)
+				m_Connect(JoinProgress(JOIN_ATTEMPT));
+			return JoinProgress(JOIN_ATTEMPT);
+		}
 
-					m_Connected = true;
-					return SUCCESSFUL;
+		case STATE_JOINING:
+		{
+			int16_t joined = m_WiFi->WiFiJoinPoll(TimeSliceInMS);
+			if (joined == 0)
+				return JoinProgress(JOIN_ATTEMPT);
+			if (joined < 0)
+			{
+				if (m_HintedJoin)
+				{
+					// The AP may have moved or been replaced: forget it and
+					// try a normal join straight away.
+					m_LastAP.Valid = false;
+					m_JoinState = STATE_JOIN;
+					return JoinProgress(JOIN_ATTEMPT);
 				}
+				ScheduleRetry();
+				return JoinProgress(JOIN_RETRY);
 			}
-			else if (m_IPOptions.m_Mode == STM32TCP::Options::MODE_CLIENT)
+
+			m_WiFi->m_Boot.Step(WIFI_BOOT_JOIN);
+			return Joined();
+		}
+		}
+		return not SUCCESSFUL;
+	}
+
+	ERROR_TYPE STM32TCPSocket::Joined()
+	{
+		LOG_MSG(LOG_TCP, LOG_INFO, "Connected to %s.\r\n", m_AccessPoint);
+		m_Backoff = WIFI_JOIN_BACKOFF_MIN;
+		m_LastAP.Valid = (m_WiFi->WiFiGetAP(m_LastAP.SSID, m_LastAP.BSSID, &m_LastAP.Channel) > 0);
+		if (m_Connect)
+			m_Connect(JoinProgress(JOIN_ASSOCIATED));
+
+		ERROR_TYPE RetVal = StartService();
+		m_JoinState = (RetVal == SUCCESSFUL) ? STATE_ONLINE : STATE_IDLE;
+		if (RetVal == SUCCESSFUL and not m_WiFi->m_Boot.complete)
+		{
+			m_WiFi->m_Boot.Step(WIFI_BOOT_SERVICE);
+			PrintBootTiming();
+		}
+		return RetVal;
+	}
+
+	void STM32TCPSocket::PrintBootTiming()
+	{
+		static const char * const Names[WIFI_BOOT_STEPS] = { "reset", "probe", "mode", "join", "service" };
+		const wifi_boot_timing& Boot = m_WiFi->m_Boot;
+		if (not LOG_ENABLED(LOG_TCP, LOG_INFO))
+			return;
+
+		printf("Boot timing (ms):");
+		for (int Step = 0; Step < WIFI_BOOT_STEPS; Step++)
+			printf(" %s %u%s", Names[Step], (unsigned)Boot.elapsed[Step],
+				Boot.Skipped((wifi_boot_step)Step) ? " (skipped)" : "");
+		printf(", total %u\r\n", (unsigned)Boot.Total());
+	}
+
+	// Exponential backoff with jitter, so meters that lost the same AP do
+	// not all come back in lockstep: the wait is drawn from [m_Backoff/2, m_Backoff].
+	void STM32TCPSocket::ScheduleRetry()
+	{
+		uint32_t Random;
+		if (HAL_RNG_GenerateRandomNumber(&hrng, &Random) != HAL_OK)
+			Random = HAL_GetTick();
+		uint32_t Wait = m_Backoff / 2 + Random % (m_Backoff / 2 + 1);
+
+		LOG_MSG(LOG_TCP, LOG_ERROR, "Failed to connect to %s.\r\nRetrying after %ums...\r\n", m_AccessPoint, (unsigned)Wait);
+		m_RetryAt = HAL_GetTick() + Wait;
+		m_Backoff = std::min<uint32_t>(m_Backoff * 2, WIFI_JOIN_BACKOFF_MAX);
+		m_JoinState = STATE_BACKOFF;
+		if (m_Connect)
+			m_Connect(JoinProgress(JOIN_RETRY));
+	}
+
+	ERROR_TYPE STM32TCPSocket::StartService()
+	{
+		const char * DestinationAddress = m_Destination;
+		int Port = m_Port;
+
+		if(std::string(IP = m_WiFi->WiFiLocalIP()) != "")
+			LOG_MSG(LOG_TCP, LOG_INFO, "IP Address : %s\r\n", std::string(IP).c_str());
+		if (m_IPOptions.m_Protocol == STM32TCP::Options::TCP and m_IPOptions.m_PassiveReceive and
+			m_WiFi->TCPSetReceiveMode(true) <= 0)
+			LOG_MSG(LOG_TCP, LOG_INFO, "Passive receive not supported, data will be pushed.\r\n");
+		if (m_IPOptions.m_Protocol == STM32TCP::Options::UDP)
+		{
+			// A server takes datagrams from anyone and answers the last
+			// sender; a client talks to one fixed peer.
+			bool server = (m_IPOptions.m_Mode == STM32TCP::Options::MODE_SERVER);
+			if ((server or DestinationAddress != nullptr) and
+				m_WiFi->TCPSetMux(1) > 0 and
+				m_WiFi->UDPOpen(m_SocketID, server ? "0.0.0.0" : DestinationAddress, Port,
+					server ? Port : 0, server ? WIFI_UDP_PEER_ANY : WIFI_UDP_PEER_FIXED) > 0)
 			{
-				//! TODO
+				LOG_MSG(LOG_TCP, LOG_INFO, "UDP socket open on port %d\r\n", Port);
+
+				if (m_Connect)
+				{
+					m_Connect(SUCCESSFUL);
+				}
+
+				m_Connected = true;
+				return SUCCESSFUL;
 			}
 
-			printf("Failed to create server.\r\n");
+			LOG_MSG(LOG_TCP, LOG_ERROR, "Failed to open UDP socket.\r\n");
+			return not SUCCESSFUL;
 		}
-		else
+		else if (m_IPOptions.m_Mode == STM32TCP::Options::MODE_SERVER)
 		{
-			printf("Failed to connect to %s.\r\nRetrying after 5s...\r\n", AccessPoint);
-			osDelay(5000);
-			goto RETRY_CONNECT;
+			// CIPMODE=0 is accepted in either mux mode; both are skipped when
+			// the module is already there.
+			if (m_WiFi->TCPSetTransferMode(0) > 0 and
+				m_WiFi->TCPSetMux(1) > 0 and
+				m_WiFi->TCPConfigureServer(Port, 1) > 0)			// TODO - keepAlive
+			{
+				LOG_MSG(LOG_TCP, LOG_INFO, "Server started on %s:%d\r\n", std::string(IP).c_str(), Port);
+
+				if (m_Connect)
+				{
+					m_Connect(SUCCESSFUL);
+				}
+
+				m_Connected = true;
+				return SUCCESSFUL;
+			}
 		}
+		else if (m_IPOptions.m_Mode == STM32TCP::Options::MODE_CLIENT)
+		{
+			int16_t linkID = WIFI_CMD_BAD;
+			if (DestinationAddress != nullptr and
+				m_WiFi->TCPSetMux(1) > 0 and
+				(linkID = m_WiFi->TCPAcquire(DestinationAddress, Port)) >= 0)
+			{
+				m_SocketID = linkID;
+				LOG_MSG(LOG_TCP, LOG_INFO, "Connected to %s:%d on link %d\r\n", DestinationAddress, Port, linkID);
+
+				if (m_Connect)
+				{
+					m_Connect(SUCCESSFUL);
+				}
+
+				m_Connected = true;
+				return SUCCESSFUL;
+			}
+
+			LOG_MSG(LOG_TCP, LOG_ERROR, "Failed to connect to %s:%d.\r\n", DestinationAddress ? DestinationAddress : "", Port);
+			return not SUCCESSFUL;
+		}
+
+		LOG_MSG(LOG_TCP, LOG_ERROR, "Failed to create server.\r\n");
 		return not SUCCESSFUL;
 	}
 
-//	STM32TCPSocket::ConnectCallbackFunction STM32TCPSocket::RegisterConnectHandler(ConnectCallbackFunction Callback)
-//	{
-//		ConnectCallbackFunction RetVal = m_Connect;
-//		m_Connect = Callback;
-//		return RetVal;
-//	}
+	STM32TCPSocket::ConnectCallbackFunction STM32TCPSocket::RegisterConnectHandler(ConnectCallbackFunction Callback)
+	{
+		ConnectCallbackFunction RetVal = m_Connect;
+		m_Connect = Callback;
+		return RetVal;
+	}
 
 	STM32Serial::Options STM32TCPSocket::GetSerialOptions()
 	{
@@ -146,11 +358,24 @@ RETRY_CONNECT:
 
 	ERROR_TYPE STM32TCPSocket::Write(const WiFiBuffer& Data, bool Asynchronous /*= false*/)						// {planned} for sending data over TCP.
 	{
+		int16_t rsp;
+		if (m_WiFi->TCPIsPassthrough())
+			rsp = m_WiFi->TCPPassthroughWrite(Data.GetData(), Data.Size());
+		else if (m_IPOptions.m_Protocol == STM32TCP::Options::UDP)
+			rsp = m_WiFi->UDPSend(m_SocketID, Data.GetData(), Data.Size());	// One write, one datagram
+		else
+			rsp = m_WiFi->TCPWrite(m_SocketID, Data.GetData(), Data.Size());
+
+		// A failed send is reported, not dropped: the code is the wifi_cmd_rsp
+		// (e.g. WIFI_RSP_BUSY) and nothing counts as written.
 		ERROR_TYPE RetVal = SUCCESSFUL;
-		m_WiFi->TCPSend(m_SocketID, Data);
+		if (rsp == WIFI_RSP_TIMEOUT)
+			RetVal = ERR_TIMEOUT;
+		else if (rsp < 0)
+			RetVal = MakeError(SRC_SOCKET, LVL_ERROR, (uint16_t)-rsp);
 
 		if(m_Write)
-			m_Write(RetVal, Data.Size());
+			m_Write(RetVal, (RetVal == SUCCESSFUL) ? Data.Size() : 0);
 		return RetVal;
 	}
 
@@ -165,14 +390,54 @@ RETRY_CONNECT:
 	 * @param pData : (WiFiBuffer *)
 	 * @param ReadAtLeast : (size_t) The assumed number of bytes that must've been read after the function call finishes or the read handler interrupt completes, unless a timeout occurs. Keep below a max value specified by WiFi device library or 0xffff (UINT16_MAX) otherwise.
 	 */
-//	ERROR_TYPE STM32TCPSocket::Read(WiFiBuffer * pData,
-//		size_t ReadAtLeast /*= 0*/,
-//		uint32_t TimeOutPeriodInMS /*= 0*/,
-//		size_t * pActualBytes /*= nullptr*/)
-//	{
-////		if(ReadAtLeast <= (size_t)std::min(UINT16_MAX, WIFI_MAX_TCP_LEN));
-//			return this->STM32SerialSocket::Read(pData, ReadAtLeast, TimeOutPeriodInMS, pActualBytes);
-//	}
+	ERROR_TYPE STM32TCPSocket::Read(WiFiBuffer * pData,
+		size_t ReadAtLeast /*= 0*/,
+		uint32_t TimeOutInMS /*= 0*/,
+		size_t * pActualBytes /*= nullptr*/)
+	{
+		if (pData != nullptr)
+			return this->STM32SerialSocket::Read(pData, ReadAtLeast, TimeOutInMS, pActualBytes);
+
+		m_ReadAtLeast = ReadAtLeast;
+		m_ReadTimeout = TimeOutInMS;
+		if (m_InReadHandler)
+		{
+			m_ReadRequested = true;		// Armed by OnRead() once Poll() is done with the UART
+			return SUCCESSFUL;
+		}
+		return ArmRead();
+	}
+
+	// ArmRead()
+	// A read without a timeout of its own wakes the callback thread every
+	// WIFI_SOCKET_POLL_PERIOD, so Poll() also runs while nothing arrives.
+	ERROR_TYPE STM32TCPSocket::ArmRead()
+	{
+		return this->STM32SerialSocket::Read(nullptr, m_ReadAtLeast,
+			m_ReadTimeout ? m_ReadTimeout : WIFI_SOCKET_POLL_PERIOD);
+	}
+
+	// OnRead()
+	// Runs on the callback thread for every asynchronous read. The
+	// application's handler gets the data; then, with no read armed so AT
+	// commands own the UART, Poll() sends what TCPQueue() and coalescing
+	// hold, expires pooled links and rejoins a lost AP; then the read is
+	// armed again. A wake-up of ArmRead() alone doesn't reach the handler.
+	void STM32TCPSocket::OnRead(ERROR_TYPE Error, size_t BytesReceived)
+	{
+		bool Idle = (Error == ERR_TIMEOUT and BytesReceived == 0 and m_ReadTimeout == 0);
+		m_ReadRequested = Idle;
+		if (not Idle and m_Handler)
+		{
+			m_InReadHandler = true;
+			m_Handler(Error, BytesReceived);
+			m_InReadHandler = false;
+		}
+
+		PollUntilSettled(Poll());
+		if (m_ReadRequested)
+			ArmRead();
+	}
 
 //	bool STM32TCPSocket::AppendAsyncReadResult(WiFiBuffer * pData, size_t ReadAtLeast /*= 0*/)
 //	{
@@ -182,16 +447,21 @@ RETRY_CONNECT:
 //		return true;
 //	}
 
-//	STM32TCPSocket::ReadCallbackFunction STM32TCPSocket::RegisterReadHandler(ReadCallbackFunction Callback)
-//	{
-//		ReadCallbackFunction RetVal = m_Read;
-//		m_Read = Callback;
-//		return RetVal;
-//	}
+	STM32TCPSocket::ReadCallbackFunction STM32TCPSocket::RegisterReadHandler(ReadCallbackFunction Callback)
+	{
+		ReadCallbackFunction RetVal = m_Handler;
+		m_Handler = Callback;
+		return RetVal;
+	}
 
 	ERROR_TYPE STM32TCPSocket::Close()
 	{
 		m_Connected = false;
+		if (m_IPOptions.m_Mode == STM32TCP::Options::MODE_CLIENT and m_IPOptions.m_Protocol == STM32TCP::Options::TCP)
+		{
+			// Keep the connection for the next Open() to the same endpoint
+			return (m_WiFi->TCPRelease(m_SocketID) > 0) ? SUCCESSFUL : not SUCCESSFUL;
+		}
 		if(m_WiFi->TCPClose(m_SocketID))
 		{
 			return SUCCESSFUL;
@@ -232,7 +502,8 @@ RETRY_CONNECT:
 		WiFiBuffer vec;
 		this->AppendAsyncReadResult(&vec, 0);
 		this->Read(&vec, WIFI_RX_BUFFER_LEN, 1000);
-		Base()->GetDebug()->TRACE_VECTOR("FLUSH", vec);
+		if (LOG_ENABLED(LOG_TCP, LOG_TRACE))
+			Base()->GetDebug()->TRACE_VECTOR("FLUSH", vec);
 		this->STM32SerialSocket::Flush(Direction);
 		return SUCCESSFUL;
 	}
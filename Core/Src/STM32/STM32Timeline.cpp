@@ -0,0 +1,144 @@
+#include <cstdio>
+#include <cstdarg>
+#include <atomic>
+#include <algorithm>
+
+#include "cmsis_os.h"
+#include "main.h"
+#include "STM32Log.h"
+#include "STM32Timeline.h"
+
+#ifdef STM32_TIMELINE
+
+static_assert((STM32_TIMELINE_EVENTS & (STM32_TIMELINE_EVENTS - 1)) == 0, "STM32_TIMELINE_EVENTS must be a power of two");
+
+#define TIMELINE_LINE_MAX		48		// Longest "@TL" line
+#define TIMELINE_TASK_ISR		0		// Task number recorded for interrupts
+#define TIMELINE_TASKS			8		// Task names listed, STM32_STATIC_ALLOCATION
+
+namespace EPRI
+{
+	namespace Timeline
+	{
+		struct Event
+		{
+			uint32_t Cycles;
+			uint32_t Arg;
+			Id Which;
+			Kind What;
+			uint8_t Task;
+		};
+
+		// Writers claim a slot by bumping s_Next and fill it in; the ring is
+		// only read by Dump() while recording is off.
+		static Event s_Ring[STM32_TIMELINE_EVENTS];
+		static std::atomic<uint32_t> s_Next{0};
+		static volatile bool s_Recording = false;
+		static volatile uint8_t s_Task = TIMELINE_TASK_ISR;	// Running task, see TimelineTaskSwitchedIn()
+
+		static const char * const s_Names[TL_IDS] =
+		{
+#define STM32_TIMELINE_NAME(NAME) #NAME,
+			STM32_TIMELINE_IDS(STM32_TIMELINE_NAME)
+#undef STM32_TIMELINE_NAME
+		};
+
+		void Start()
+		{
+			CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+			DWT->CYCCNT = 0;
+			DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+			s_Next.store(0, std::memory_order_relaxed);
+			s_Recording = true;
+		}
+
+		void Record(Kind What, Id Which, uint32_t Arg)
+		{
+			if (not s_Recording)
+				return;
+			Event& Slot = s_Ring[s_Next.fetch_add(1, std::memory_order_relaxed) & (STM32_TIMELINE_EVENTS - 1)];
+			Slot.Cycles = DWT->CYCCNT;
+			Slot.Arg = Arg;
+			Slot.Which = Which;
+			Slot.What = What;
+			Slot.Task = (__get_IPSR() != 0U) ? TIMELINE_TASK_ISR : s_Task;
+		}
+
+		// Line()
+		// Waits for room in the log ring rather than have the dump dropped.
+		static void Line(const char * Format, ...) __attribute__((format(printf, 1, 2)));
+		static void Line(const char * Format, ...)
+		{
+			char Text[TIMELINE_LINE_MAX];
+			va_list Args;
+			va_start(Args, Format);
+			int Length = vsnprintf(Text, sizeof(Text), Format, Args);
+			va_end(Args);
+			if (Length <= 0)
+				return;
+			Length = std::min<int>(Length, sizeof(Text) - 1);
+			while (Log::Room() < (size_t)Length + 32)
+				osDelay(5);
+			Log::Text(Text, Length);
+		}
+
+		// Dump()
+		// Call from a task: it waits for the log UART to keep up. Prints the
+		// clock, task and event names, then the events oldest first:
+		//    @TL ev <cycles> <kind> <task> <id> <arg>
+		// cycles and arg in hex; task 0 is interrupt context.
+		void Dump()
+		{
+			s_Recording = false;
+			osDelay(1);		// Let writers that already claimed a slot finish
+
+			uint32_t End = s_Next.load(std::memory_order_relaxed);
+			uint32_t Count = std::min<uint32_t>(End, STM32_TIMELINE_EVENTS);
+
+			fflush(stdout);
+			Line("\r\n@TL begin %lu\r\n", (unsigned long)SystemCoreClock);
+			for (uint16_t Which = 0; Which < TL_IDS; Which++)
+				Line("@TL id %u %s\r\n", Which, s_Names[Which]);
+
+#ifdef STM32_STATIC_ALLOCATION
+			static TaskStatus_t Status[TIMELINE_TASKS];
+			UBaseType_t Tasks = uxTaskGetSystemState(Status, TIMELINE_TASKS, nullptr);	// 0 if there are more
+			for (UBaseType_t Index = 0; Index < Tasks; Index++)
+				Line("@TL task %lu %s\r\n", (unsigned long)Status[Index].xTaskNumber, Status[Index].pcTaskName);
+#else
+			UBaseType_t Tasks = uxTaskGetNumberOfTasks();
+			TaskStatus_t * Status = (TaskStatus_t *)pvPortMalloc(Tasks * sizeof(TaskStatus_t));
+			if (Status != nullptr)
+			{
+				Tasks = uxTaskGetSystemState(Status, Tasks, nullptr);
+				for (UBaseType_t Index = 0; Index < Tasks; Index++)
+					Line("@TL task %lu %s\r\n", (unsigned long)Status[Index].xTaskNumber, Status[Index].pcTaskName);
+				vPortFree(Status);
+			}
+#endif
+
+			for (uint32_t Index = End - Count; Index != End; Index++)
+			{
+				const Event& Slot = s_Ring[Index & (STM32_TIMELINE_EVENTS - 1)];
+				Line("@TL ev %08lx %c %u %u %lx\r\n", (unsigned long)Slot.Cycles, Slot.What, Slot.Task, Slot.Which,
+					(unsigned long)Slot.Arg);
+			}
+			Line("@TL end %lu\r\n", (unsigned long)(End - Count));		// Events overwritten
+
+			s_Next.store(0, std::memory_order_relaxed);
+			s_Recording = true;
+		}
+	}
+}
+
+extern "C"
+{
+	// Called by the scheduler with the new task's number (uxTCBNumber).
+	void TimelineTaskSwitchedIn(uint32_t TaskNumber)
+	{
+		EPRI::Timeline::s_Task = TaskNumber;
+		EPRI::Timeline::Record(EPRI::Timeline::TL_SWITCH, EPRI::Timeline::TL_IDS, TaskNumber);
+	}
+}
+
+#endif
@@ -72,19 +72,55 @@
 
 
 #include <new>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
 #include <FreeRTOS.h>
 #include <../CMSIS_RTOS/cmsis_os.h>
 
 #include "FreeRTOSConfig.h"
+#include "HeapStats.h"
 
-static uint32_t totalForNew = 0;
-static uint32_t totalMallocFailures = 0;
-static uint32_t totalStackOverflowFailures = 0;
+// In front of every block from operator new, pooled or not. Two words, so
+// the data keeps heap_4's 8 byte alignment.
+struct HeapHeader
+{
+    uint32_t size;
+    uint32_t caller;
+};
+static_assert(sizeof(HeapHeader) == portBYTE_ALIGNMENT, "HeapHeader must keep the block aligned");
+
+// Counters are atomic so the pool path never takes a lock; the totals are
+// read one counter at a time, not as a snapshot.
+static struct
+{
+    std::atomic<uint32_t> liveBytes{0};
+    std::atomic<uint32_t> peakBytes{0};
+    std::atomic<uint32_t> liveBlocks{0};
+    std::atomic<uint32_t> allocations{0};
+    std::atomic<uint32_t> frees{0};
+    std::atomic<uint32_t> failures{0};
+    std::atomic<uint32_t> bucketAllocations[EPRI::HeapStats::BUCKETS];
+    std::atomic<uint32_t> bucketLive[EPRI::HeapStats::BUCKETS];
+} totals;
+static uint32_t mallocFailures = 0;
+static uint32_t stackOverflows = 0;
+
+#if HEAP_STATS_SITES > 0
+static struct
+{
+    std::atomic<uintptr_t> caller;
+    std::atomic<uint32_t> liveBytes;
+    std::atomic<uint32_t> liveBlocks;
+    std::atomic<uint32_t> allocations;
+} sites[HEAP_STATS_SITES];
+#endif
 
 #if( configUSE_MALLOC_FAILED_HOOK == 1 )
 extern "C" void vApplicationMallocFailedHook(void)
 {
-    totalMallocFailures++;
+    mallocFailures++;
 }
 #endif
 
@@ -92,43 +128,400 @@ extern "C" void vApplicationMallocFailedHook(void)
 extern "C" void vApplicationStackOverflowHook(TaskHandle_t xTask,
                                               signed char *pcTaskName)
 {
-    totalStackOverflowFailures++;
+    stackOverflows++;
 }
 #endif
 
+///////////////////////
+// Small Block Pools //
+///////////////////////
+
+// One size class: a single arena taken from heap_4 on first use (a static
+// one with STM32_STATIC_ALLOCATION), cut into
+// equal blocks (header + payload) and kept on a free list. The list head
+// packs the index of the first free block with a tag that changes on every
+// update, so the compare-and-swap of a task that was preempted between
+// reading the head and swapping it fails instead of linking a block that
+// was taken and given back meanwhile (ABA). A free block holds the index
+// of the next one in its first bytes.
+class Pool
+{
+public:
+    static const uint16_t END = 0xFFFF;
+
+    // Init()
+    // Input: [Arena] of Blocks * (header + Payload) bytes, nullptr to take it from heap_4
+    void Init(size_t Payload, uint16_t Blocks, uint8_t * Arena)
+    {
+        m_Payload = Payload;
+        m_BlockSize = sizeof(HeapHeader) + Payload;
+        if (Blocks == 0)
+            m_Arena = nullptr;
+        else
+            m_Arena = (Arena != nullptr) ? Arena : (uint8_t *)pvPortMalloc(m_BlockSize * Blocks);
+        if (m_Arena == nullptr)
+            return;		// Everything of this size goes to heap_4
+        m_Blocks = Blocks;
+        for (uint16_t Index = 0; Index < Blocks; Index++)
+            next(Index) = (Index + 1 < Blocks) ? Index + 1 : END;
+        m_Free.store(Blocks, std::memory_order_relaxed);
+        m_MinimumFree.store(Blocks, std::memory_order_relaxed);
+        m_Head.store(0, std::memory_order_release);
+    }
+
+    void * Take()
+    {
+        uint32_t Head = m_Head.load(std::memory_order_acquire);
+        uint16_t Index;
+        do {
+            Index = Head & 0xFFFF;
+            if (Index == END)
+            {
+                m_Exhausted.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        } while (not m_Head.compare_exchange_weak(Head, retag(Head, next(Index)),
+            std::memory_order_acquire, std::memory_order_acquire));
+
+        uint32_t Free = m_Free.fetch_sub(1, std::memory_order_relaxed) - 1;
+        uint32_t Minimum = m_MinimumFree.load(std::memory_order_relaxed);
+        while (Free < Minimum and not m_MinimumFree.compare_exchange_weak(Minimum, Free, std::memory_order_relaxed))
+            ;
+        m_Allocations.fetch_add(1, std::memory_order_relaxed);
+        return block(Index);
+    }
+
+    void Give(void * Block)
+    {
+        uint16_t Index = ((uint8_t *)Block - m_Arena) / m_BlockSize;
+        uint32_t Head = m_Head.load(std::memory_order_relaxed);
+        do {
+            next(Index) = Head & 0xFFFF;
+        } while (not m_Head.compare_exchange_weak(Head, retag(Head, Index),
+            std::memory_order_release, std::memory_order_relaxed));
+        m_Free.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool Owns(const void * Block) const
+    {
+        return m_Arena != nullptr and (const uint8_t *)Block >= m_Arena and
+            (const uint8_t *)Block < m_Arena + m_BlockSize * m_Blocks;
+    }
+
+    size_t Payload() const { return m_Payload; }
+
+    void GetStats(EPRI::HeapPoolStats& Stats) const
+    {
+        Stats.blockSize = m_Payload;
+        Stats.blocks = m_Blocks;
+        Stats.free = m_Free.load(std::memory_order_relaxed);
+        Stats.minimumFree = m_MinimumFree.load(std::memory_order_relaxed);
+        Stats.allocations = m_Allocations.load(std::memory_order_relaxed);
+        Stats.exhausted = m_Exhausted.load(std::memory_order_relaxed);
+    }
+
+private:
+    static uint32_t retag(uint32_t Head, uint16_t Index)
+    {
+        return ((Head + 0x10000) & 0xFFFF0000) | Index;
+    }
+
+    uint8_t * block(uint16_t Index) const { return m_Arena + (size_t)Index * m_BlockSize; }
+    // May be read from a block another task just took; its CAS then fails.
+    uint16_t& next(uint16_t Index) const { return *(uint16_t *)block(Index); }
+
+    uint8_t * m_Arena = nullptr;
+    size_t m_Payload = 0;
+    size_t m_BlockSize = 0;
+    uint16_t m_Blocks = 0;
+    std::atomic<uint32_t> m_Head{END};
+    std::atomic<uint32_t> m_Free{0};
+    std::atomic<uint32_t> m_MinimumFree{0};
+    std::atomic<uint32_t> m_Allocations{0};
+    std::atomic<uint32_t> m_Exhausted{0};
+};
+
+static const struct { size_t payload; uint16_t blocks; } poolSizes[HEAP_POOLS] =
+{
+    { 16, HEAP_POOL_16 },
+    { 32, HEAP_POOL_32 },
+    { 64, HEAP_POOL_64 },
+    { 128, HEAP_POOL_128 },
+};
+static Pool pools[HEAP_POOLS];
+static std::atomic<bool> poolsReady{false};
+
+#ifdef STM32_STATIC_ALLOCATION
+static const size_t poolArenaSize =
+    (sizeof(HeapHeader) + 16) * HEAP_POOL_16 + (sizeof(HeapHeader) + 32) * HEAP_POOL_32 +
+    (sizeof(HeapHeader) + 64) * HEAP_POOL_64 + (sizeof(HeapHeader) + 128) * HEAP_POOL_128;
+alignas(portBYTE_ALIGNMENT) static uint8_t poolArena[poolArenaSize ? poolArenaSize : 1];
+#endif
+
+// initPools()
+// On the first new: usually a static constructor, before the scheduler
+// runs. The arenas are the first heap_4 blocks, so they never fragment it.
+static void initPools()
+{
+    vTaskSuspendAll();
+    if (not poolsReady.load(std::memory_order_acquire))
+    {
+#ifdef STM32_STATIC_ALLOCATION
+        uint8_t * arena = poolArena;
+        for (size_t Class = 0; Class < HEAP_POOLS; Class++)
+        {
+            pools[Class].Init(poolSizes[Class].payload, poolSizes[Class].blocks, arena);
+            arena += (sizeof(HeapHeader) + poolSizes[Class].payload) * poolSizes[Class].blocks;
+        }
+#else
+        for (size_t Class = 0; Class < HEAP_POOLS; Class++)
+            pools[Class].Init(poolSizes[Class].payload, poolSizes[Class].blocks, nullptr);
+#endif
+        poolsReady.store(true, std::memory_order_release);
+    }
+    (void)xTaskResumeAll();
+}
+
+static size_t bucketOf(size_t size)
+{
+    if (size <= 16)
+        return 0;
+    size_t bucket = 32 - __builtin_clz(size - 1) - 4;
+    return (bucket < EPRI::HeapStats::BUCKETS) ? bucket : EPRI::HeapStats::BUCKETS - 1;
+}
+
+#if HEAP_STATS_SITES > 0
+// findSite()
+// Output: the entry of [caller], a new one if there is room, else -1
+static int findSite(uintptr_t caller, bool add)
+{
+    for (int index = 0; index < HEAP_STATS_SITES; index++)
+    {
+        uintptr_t current = sites[index].caller.load(std::memory_order_acquire);
+        if (current == 0 and add and sites[index].caller.compare_exchange_strong(current, caller))
+            return index;
+        if (current == caller)
+            return index;
+        if (current == 0)
+            return -1;
+    }
+    return -1;
+}
+#endif
+
+static void account(const HeapHeader * header, bool allocated)
+{
+    size_t bucket = bucketOf(header->size);
+    if (allocated)
+    {
+        uint32_t live = totals.liveBytes.fetch_add(header->size, std::memory_order_relaxed) + header->size;
+        uint32_t peak = totals.peakBytes.load(std::memory_order_relaxed);
+        while (live > peak and not totals.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            ;
+        totals.liveBlocks.fetch_add(1, std::memory_order_relaxed);
+        totals.allocations.fetch_add(1, std::memory_order_relaxed);
+        totals.bucketAllocations[bucket].fetch_add(1, std::memory_order_relaxed);
+        totals.bucketLive[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        totals.liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+        totals.liveBlocks.fetch_sub(1, std::memory_order_relaxed);
+        totals.frees.fetch_add(1, std::memory_order_relaxed);
+        totals.bucketLive[bucket].fetch_sub(1, std::memory_order_relaxed);
+    }
+#if HEAP_STATS_SITES > 0
+    int site = findSite(header->caller, allocated);
+    if (site >= 0)
+    {
+        if (allocated)
+        {
+            sites[site].liveBytes.fetch_add(header->size, std::memory_order_relaxed);
+            sites[site].liveBlocks.fetch_add(1, std::memory_order_relaxed);
+            sites[site].allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            sites[site].liveBytes.fetch_sub(header->size, std::memory_order_relaxed);
+            sites[site].liveBlocks.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+#endif
+}
+
+// allocate()/release()
+// Sizes up to the largest pool come from the smallest pool that fits,
+// without a lock and in constant time; a size whose pool has run out, and
+// anything larger, goes to heap_4. Not for use from interrupts, same as
+// pvPortMalloc().
+static void * allocate(std::size_t size, uintptr_t caller)
+{
+    if (not poolsReady.load(std::memory_order_acquire))
+        initPools();
+
+    HeapHeader * header = nullptr;
+    for (Pool& pool : pools)
+    {
+        if (size <= pool.Payload())
+        {
+            header = (HeapHeader *)pool.Take();
+            break;
+        }
+    }
+    if (header == nullptr)
+        header = (HeapHeader *)pvPortMalloc(sizeof(HeapHeader) + size);
+    if (header == nullptr)
+    {
+        totals.failures.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    header->size = size;
+    header->caller = caller;
+    account(header, true);
+    return header + 1;
+}
+
+static void release(void * ptr)
+{
+    if (ptr == nullptr)
+        return;
+    HeapHeader * header = (HeapHeader *)ptr - 1;
+    account(header, false);
+    for (Pool& pool : pools)
+    {
+        if (pool.Owns(header))
+        {
+            pool.Give(header);
+            return;
+        }
+    }
+    vPortFree(header);
+}
+
+#define CALLER() ((HEAP_STATS_SITES > 0) ? (uintptr_t)__builtin_return_address(0) : 0)
+
 #undef new
 
 void * operator new(std::size_t size) throw (std::bad_alloc) {
-    void *p = pvPortMalloc(size);
-    totalForNew += size;
-    return p;
+    return allocate(size, CALLER());
 }
 
 void * operator new(std::size_t size, const std::nothrow_t& nothrow_constant) throw() {
-    return pvPortMalloc(size);
+    return allocate(size, CALLER());
 }
 
 void * operator new[](std::size_t size) throw (std::bad_alloc) {
-    void *p = pvPortMalloc(size);
-    return p;
+    return allocate(size, CALLER());
 }
 
 void * operator new[](std::size_t size, const std::nothrow_t& nothrow_constant) throw() {
-    return pvPortMalloc(size);
+    return allocate(size, CALLER());
 }
 
 void operator delete(void* ptr) throw () {
-    vPortFree(ptr);
+    release(ptr);
 }
 
 void operator delete(void* ptr, const std::nothrow_t& nothrow_constant) throw() {
-    vPortFree(ptr);
+    release(ptr);
 }
 
 void operator delete[](void* ptr) throw () {
-    vPortFree(ptr);
+    release(ptr);
 }
 
 void operator delete[](void* ptr, const std::nothrow_t& nothrow_constant) throw() {
-    vPortFree(ptr);
+    release(ptr);
+}
+
+namespace EPRI
+{
+    void GetHeapStats(HeapStats& Stats)
+    {
+        HeapStats_t Heap;
+        vPortGetHeapStats(&Heap);
+
+        Stats.liveBytes = totals.liveBytes.load(std::memory_order_relaxed);
+        Stats.peakBytes = totals.peakBytes.load(std::memory_order_relaxed);
+        Stats.liveBlocks = totals.liveBlocks.load(std::memory_order_relaxed);
+        Stats.allocations = totals.allocations.load(std::memory_order_relaxed);
+        Stats.frees = totals.frees.load(std::memory_order_relaxed);
+        Stats.failures = totals.failures.load(std::memory_order_relaxed);
+        for (size_t Bucket = 0; Bucket < HeapStats::BUCKETS; Bucket++)
+        {
+            Stats.bucketAllocations[Bucket] = totals.bucketAllocations[Bucket].load(std::memory_order_relaxed);
+            Stats.bucketLive[Bucket] = totals.bucketLive[Bucket].load(std::memory_order_relaxed);
+        }
+        Stats.mallocFailures = mallocFailures;
+        Stats.stackOverflows = stackOverflows;
+        Stats.heapFree = Heap.xAvailableHeapSpaceInBytes;
+        Stats.heapMinimumEverFree = Heap.xMinimumEverFreeBytesRemaining;
+        Stats.largestFreeBlock = Heap.xSizeOfLargestFreeBlockInBytes;
+        Stats.freeBlocks = Heap.xNumberOfFreeBlocks;
+    }
+
+    size_t GetHeapSites(HeapSite * Sites, size_t Count)
+    {
+        size_t Copied = 0;
+#if HEAP_STATS_SITES > 0
+        for (size_t Index = 0; Index < HEAP_STATS_SITES and Copied < Count; Index++)
+        {
+            HeapSite& Site = Sites[Copied];
+            Site.caller = sites[Index].caller.load(std::memory_order_acquire);
+            if (Site.caller == 0)
+                break;
+            Site.liveBytes = sites[Index].liveBytes.load(std::memory_order_relaxed);
+            Site.liveBlocks = sites[Index].liveBlocks.load(std::memory_order_relaxed);
+            Site.allocations = sites[Index].allocations.load(std::memory_order_relaxed);
+            Copied++;
+        }
+#endif
+        return Copied;
+    }
+
+    size_t GetHeapPools(HeapPoolStats * Stats, size_t Count)
+    {
+        size_t Copied = std::min(Count, (size_t)HEAP_POOLS);
+        for (size_t Class = 0; Class < Copied; Class++)
+            pools[Class].GetStats(Stats[Class]);
+        return Copied;
+    }
+
+    void DumpHeapStats()
+    {
+        static const char * const Buckets[HeapStats::BUCKETS] = { "16", "32", "64", "128", "256", "512", "1K", "more" };
+        HeapStats Stats;
+        GetHeapStats(Stats);
+
+        printf("Heap: %lu bytes live in %lu blocks, peak %lu; %lu new, %lu delete, %lu failed\r\n",
+            (unsigned long)Stats.liveBytes, (unsigned long)Stats.liveBlocks, (unsigned long)Stats.peakBytes,
+            (unsigned long)Stats.allocations, (unsigned long)Stats.frees, (unsigned long)Stats.failures);
+        printf("Heap: %u free (minimum %u), largest block %u of %u free blocks, %u%% fragmented\r\n",
+            (unsigned)Stats.heapFree, (unsigned)Stats.heapMinimumEverFree, (unsigned)Stats.largestFreeBlock,
+            (unsigned)Stats.freeBlocks, (unsigned)Stats.Fragmentation());
+        printf("Heap: malloc failures %lu, stack overflows %lu\r\nHeap sizes (live/total):",
+            (unsigned long)Stats.mallocFailures, (unsigned long)Stats.stackOverflows);
+        for (size_t Bucket = 0; Bucket < HeapStats::BUCKETS; Bucket++)
+            printf(" %s %lu/%lu", Buckets[Bucket], (unsigned long)Stats.bucketLive[Bucket],
+                (unsigned long)Stats.bucketAllocations[Bucket]);
+        printf("\r\n");
+
+        HeapPoolStats Pools[HEAP_POOLS];
+        size_t Classes = GetHeapPools(Pools, HEAP_POOLS);
+        for (size_t Class = 0; Class < Classes; Class++)
+            printf("Heap pool %u: %lu of %u free (minimum %lu), %lu new, %lu sent to heap_4\r\n",
+                (unsigned)Pools[Class].blockSize, (unsigned long)Pools[Class].free, (unsigned)Pools[Class].blocks,
+                (unsigned long)Pools[Class].minimumFree, (unsigned long)Pools[Class].allocations,
+                (unsigned long)Pools[Class].exhausted);
+
+#if HEAP_STATS_SITES > 0
+        HeapSite Sites[HEAP_STATS_SITES];
+        size_t Count = GetHeapSites(Sites, HEAP_STATS_SITES);
+        for (size_t Index = 0; Index < Count; Index++)
+            printf("Heap site 0x%08lx: %lu bytes live in %lu blocks, %lu new\r\n", (unsigned long)Sites[Index].caller,
+                (unsigned long)Sites[Index].liveBytes, (unsigned long)Sites[Index].liveBlocks,
+                (unsigned long)Sites[Index].allocations);
+#endif
+    }
 }
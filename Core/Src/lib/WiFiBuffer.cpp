@@ -182,6 +182,18 @@ size_t WiFiBuffer::AppendExtra(size_t Count)
 	return RetVal;
 }
 
+void WiFiBuffer::Truncate(size_t Size)
+{
+	if (Size < m_Data.size())
+	{
+		m_Data.resize(Size);
+	}
+	if (m_ReadPosition > Size)
+	{
+		m_ReadPosition = Size;
+	}
+}
+
 void WiFiBuffer::Clear()
 {
     m_Data.clear();
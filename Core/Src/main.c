@@ -51,6 +51,11 @@ UART_HandleTypeDef huart6;
 
 osThreadId DLMSThreadHandle;
 /* USER CODE BEGIN PV */
+DMA_HandleTypeDef hdma_usart3_tx;	/* Log output, see STM32Debug.cpp */
+#ifdef STM32_STATIC_ALLOCATION
+static uint32_t DLMSThreadBuffer[1280];
+static osStaticThreadDef_t DLMSThreadControlBlock;
+#endif
 
 /* USER CODE END PV */
 
@@ -124,7 +129,11 @@ int main(void)
 
   /* Create the thread(s) */
   /* definition and creation of DLMSThread */
+#ifdef STM32_STATIC_ALLOCATION
+  osThreadStaticDef(DLMSThread, DLMSThread_fun, osPriorityNormal, 0, 1280, DLMSThreadBuffer, &DLMSThreadControlBlock);
+#else
   osThreadDef(DLMSThread, DLMSThread_fun, osPriorityNormal, 0, 1280);
+#endif
   DLMSThreadHandle = osThreadCreate(osThread(DLMSThread), NULL);
 
   /* USER CODE BEGIN RTOS_THREADS */
@@ -61,6 +61,7 @@ extern TIM_HandleTypeDef htim1;
 
 /* USER CODE BEGIN EV */
 extern void __USART6_IRQHandler__();
+extern DMA_HandleTypeDef hdma_usart3_tx;
 /* USER CODE END EV */
 
 /******************************************************************************/
@@ -206,4 +207,12 @@ void USART6_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles DMA1 stream3 global interrupt (USART3_TX).
+  */
+void DMA1_Stream3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_usart3_tx);
+}
+
 /* USER CODE END 1 */
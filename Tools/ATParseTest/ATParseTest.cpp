@@ -0,0 +1,152 @@
+// AT response parser test
+//
+// Host-side checks for ESP8266AT::FieldReader and ResponseScanner
+// (Core/Src/ESP8266/ESP8266_ATParse.cpp): integer range checks, and the
+// +CIPSTATUS lines of old and new firmware read the way
+// ESP8266Device::TCPUpdateStatus() reads them.
+//
+// Usage:
+//    ATParseTest
+// Prints each failed check and exits non-zero if there was one.
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -I../../Core/Inc/ESP8266 -o at_parse_test
+//        ATParseTest.cpp ../../Core/Src/ESP8266/ESP8266_ATParse.cpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ESP8266_ATParse.h"
+
+using namespace ESP8266AT;
+
+static int g_Failed = 0;
+
+#define CHECK(x) \
+	do { if (not (x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); g_Failed++; } } while (0)
+
+static Span Text(const char * s)
+{
+	return Span(s, s + strlen(s));
+}
+
+template <typename T>
+static bool ReadInt(const char * s, T& value)
+{
+	FieldReader fields(Text(s));
+	return fields.Int(value);
+}
+
+static void TestInt()
+{
+	uint8_t u8;
+	uint16_t u16;
+	uint32_t u32;
+	int16_t i16;
+	long l;
+
+	CHECK(ReadInt("255", u8) and u8 == 255);
+	CHECK(not ReadInt("256", u8));
+	CHECK(not ReadInt("-1", u8));
+	CHECK(ReadInt("65535", u16) and u16 == 65535);
+	CHECK(not ReadInt("65536", u16));
+	CHECK(ReadInt("4294967295", u32) and u32 == 4294967295u);
+	CHECK(not ReadInt("4294967296", u32));
+	CHECK(ReadInt("-32768", i16) and i16 == -32768);
+	CHECK(not ReadInt("32768", i16));
+	CHECK(ReadInt("-5", l) and l == -5);
+	CHECK(not ReadInt("0x10", u8));
+
+	// A failed read leaves the field for the next one
+	FieldReader fields(Text("70000,3"));
+	CHECK(not fields.Int(u16));
+	CHECK(fields.Int(l) and l == 70000);
+	CHECK(fields.Int(u8) and u8 == 3);
+	CHECK(fields.AtEnd());
+}
+
+struct IPStatus
+{
+	uint8_t linkID;
+	bool udp;
+	IPAddress remoteIP;
+	uint16_t port;
+	uint8_t tetype;
+};
+
+// Same field order as TCPUpdateStatus(): the old format ends in tetype,
+// the new one has the local port before it.
+static bool ReadIPStatus(Line& line, IPStatus& status)
+{
+	FieldReader& fields = line.Fields;
+	Span type;
+	uint16_t next;
+	if (not (fields.Int(status.linkID) and fields.Quoted(type) and fields.IP(status.remoteIP)
+		and fields.Int(status.port) and fields.Int(next)))
+		return false;
+	if (fields.AtEnd())
+		status.tetype = (uint8_t)next;
+	else if (not fields.Int(status.tetype))
+		return false;
+	status.udp = type.Equals("UDP");
+	return true;
+}
+
+static int ScanStatus(const char * response, IPStatus (&links)[5], int& stat)
+{
+	int count = 0;
+	ResponseScanner scanner(response, strlen(response));
+	Line line;
+	while (scanner.Next(line))
+	{
+		if (line.Is("STATUS"))
+			CHECK(line.Fields.Int(stat));
+		else if (line.Is("+CIPSTATUS") and count < 5 and ReadIPStatus(line, links[count]))
+			count++;
+	}
+	return count;
+}
+
+static void TestCIPStatus()
+{
+	IPStatus links[5];
+	int stat = 0;
+
+	// AT 1.x
+	const char * oldFormat =
+		"STATUS:3\r\n"
+		"+CIPSTATUS:0,\"TCP\",\"192.168.0.100\",54723,1\r\n"
+		"+CIPSTATUS:1,\"UDP\",\"93.184.216.34\",80,0\r\n"
+		"\r\nOK\r\n";
+	CHECK(ScanStatus(oldFormat, links, stat) == 2);
+	CHECK(stat == 3);
+	CHECK(links[0].linkID == 0 and not links[0].udp and links[0].port == 54723 and links[0].tetype == 1);
+	CHECK(std::string(links[0].remoteIP) == "192.168.0.100");
+	CHECK(links[1].linkID == 1 and links[1].udp and links[1].port == 80 and links[1].tetype == 0);
+
+	// AT 2.x: local port before tetype, well above what a uint8_t holds
+	const char * newFormat =
+		"STATUS:3\r\n"
+		"+CIPSTATUS:0,\"TCP\",\"192.168.0.100\",54723,4567,1\r\n"
+		"+CIPSTATUS:4,\"TCP\",\"10.0.0.2\",80,49152,0\r\n"
+		"\r\nOK\r\n";
+	CHECK(ScanStatus(newFormat, links, stat) == 2);
+	CHECK(links[0].linkID == 0 and links[0].port == 54723 and links[0].tetype == 1);
+	CHECK(links[1].linkID == 4 and links[1].port == 80 and links[1].tetype == 0);
+	CHECK(std::string(links[1].remoteIP) == "10.0.0.2");
+
+	// A tetype out of range is rejected, not truncated
+	const char * bad = "STATUS:3\r\n+CIPSTATUS:0,\"TCP\",\"10.0.0.2\",80,4567,300\r\n\r\nOK\r\n";
+	CHECK(ScanStatus(bad, links, stat) == 0);
+}
+
+int main()
+{
+	TestInt();
+	TestCIPStatus();
+	if (g_Failed)
+		printf("%d check(s) failed\n", g_Failed);
+	else
+		printf("All checks passed\n");
+	return g_Failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+// Delegate test
+//
+// Host-side checks for EPRI::Delegate (Core/Inc/lib/Delegate.h), the
+// callback type of the serial and TCP sockets: free functions, captureless
+// and capturing lambdas, Bind() to a member function, copies, and the
+// storage contract.
+//
+// Usage:
+//    DelegateTest
+// Prints each failed check and exits non-zero if there was one.
+//
+// The storage contract is enforced at compile time. Each of
+//    -DREJECT=1   functor larger than the storage
+//    -DREJECT=2   functor that isn't trivially copyable
+//    -DREJECT=3   over-aligned functor
+// must make the build fail with the matching static_assert.
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -I../../Core/Inc/lib -o delegate_test DelegateTest.cpp
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include "Delegate.h"
+
+using namespace EPRI;
+
+typedef Delegate<void(int, size_t)> Handler;
+
+static int g_Failed = 0;
+static long g_Sum = 0;
+
+#define CHECK(x) \
+	do { if (not (x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); g_Failed++; } } while (0)
+
+// The sockets copy delegates around as plain bytes
+static_assert(std::is_trivially_copyable<Handler>::value, "Delegate must be trivially copyable");
+static_assert(sizeof(Handler) == 3 * sizeof(void *), "Delegate is the thunk plus two pointers of storage");
+
+static void Add(int Value, size_t Count)
+{
+	g_Sum += Value * (long)Count;
+}
+
+struct Counter
+{
+	long Total = 0;
+	void Add(int Value, size_t Count) { Total += Value + (long)Count; }
+};
+
+static void TestEmpty()
+{
+	Handler Empty;
+	CHECK(not Empty);
+	CHECK(Empty == nullptr);
+
+	Handler Null = nullptr;
+	CHECK(Null == nullptr);
+
+	Handler::Function None = nullptr;
+	Handler FromNull = None;
+	CHECK(FromNull == nullptr);
+}
+
+static void TestFunction()
+{
+	g_Sum = 0;
+	Handler Call = Add;
+	CHECK(Call != nullptr);
+	Call(3, 4);
+	CHECK(g_Sum == 12);
+
+	Handler Captureless = [](int Value, size_t) { g_Sum -= Value; };
+	Captureless(2, 0);
+	CHECK(g_Sum == 10);
+}
+
+static void TestCapture()
+{
+	long Local = 0;
+	long * pLocal = &Local;
+	int Scale = 5;
+	Handler Call = [pLocal, Scale](int Value, size_t Count) { *pLocal += Scale * Value + (long)Count; };
+	Call(2, 1);
+	CHECK(Local == 11);
+
+	// Two pointers fill the storage exactly
+	long Other = 0;
+	long * pOther = &Other;
+	Handler Both = [pLocal, pOther](int Value, size_t) { *pLocal += Value; *pOther -= Value; };
+	Both(4, 0);
+	CHECK(Local == 15 and Other == -4);
+}
+
+static void TestBind()
+{
+	Counter Object;
+	Handler Call = Handler::Bind<Counter, &Counter::Add>(&Object);
+	Call(10, 2);
+	CHECK(Object.Total == 12);
+}
+
+static void TestCopy()
+{
+	Counter Object;
+	Handler Original = Handler::Bind<Counter, &Counter::Add>(&Object);
+	Handler Copy = Original;
+	Handler Assigned;
+	Assigned = Copy;
+	Original = nullptr;
+	CHECK(Original == nullptr);
+	Copy(1, 1);
+	Assigned(1, 1);
+	CHECK(Object.Total == 4);
+
+	long Local = 0;
+	long * pLocal = &Local;
+	Handler Lambda = [pLocal](int Value, size_t) { *pLocal += Value; };
+	Handler LambdaCopy = Lambda;
+	Lambda = Add;
+	LambdaCopy(7, 0);
+	CHECK(Local == 7);
+}
+
+static void TestReturn()
+{
+	// Arguments are forwarded and results returned by value
+	Delegate<std::string(const std::string&)> Suffix = [](const std::string& Text) { return Text + "!"; };
+	CHECK(Suffix("ok") == "ok!");
+
+	Delegate<int(int)> Square = [](int Value) { return Value * Value; };
+	CHECK(Square(-3) == 9);
+}
+
+#if REJECT == 1
+static void Reject()
+{
+	long a = 0, b = 0, c = 0;
+	Handler TooBig = [a, b, c](int, size_t) { (void)(a + b + c); };
+}
+#elif REJECT == 2
+struct Counted
+{
+	int * pCount;
+	Counted(const Counted& Other) : pCount(Other.pCount) { ++*pCount; }
+	void operator()(int, size_t) const {}
+};
+static void Reject(const Counted& Functor)
+{
+	Handler NotTrivial = Functor;
+}
+#elif REJECT == 3
+struct alignas(4 * sizeof(void *)) OverAligned
+{
+	void operator()(int, size_t) const {}
+};
+static void Reject()
+{
+	Delegate<void(int, size_t), 8 * sizeof(void *)> Aligned = OverAligned();
+}
+#endif
+
+int main()
+{
+	TestEmpty();
+	TestFunction();
+	TestCapture();
+	TestBind();
+	TestCopy();
+	TestReturn();
+	if (g_Failed)
+		printf("%d check(s) failed\n", g_Failed);
+	else
+		printf("All checks passed\n");
+	return g_Failed ? 1 : 0;
+}
@@ -0,0 +1,1238 @@
+// ESP8266 AT firmware emulator
+//
+// Answers the part of the ESP8266 AT command set that ESP8266Device uses,
+// on a Linux host, so the library's command/response handling can be
+// exercised and benchmarked without a module:
+//
+//    AT, ATE0/1, AT+RST, AT+GMR, AT+UART, AT+CWMODE, AT+CWJAP, AT+CWQAP,
+//    AT+CIFSR, AT+CIPSTAMAC, AT+CIPMUX, AT+CIPMODE, AT+CIPSERVER,
+//    AT+CIPSTART (TCP/UDP), AT+CIPSEND, AT+CIPSENDBUF, AT+CIPCLOSE,
+//    AT+CIPSTATUS, AT+CIPDINFO, AT+CIPDOMAIN, AT+PING, AT+CIPRECVMODE,
+//    AT+CIPRECVDATA, AT+CIPRECVLEN, +IPD, "+++"
+//
+// Links are real sockets on the host: AT+CIPSERVER listens on the given
+// port, AT+CIPSTART connects wherever it is told to, and data arriving on
+// either comes back as +IPD. The station address is 127.0.0.1. In passive
+// receive mode (AT+CIPRECVMODE=1) TCP data is held as AT 1.x does, announced
+// with "+IPD,<id>,<len>" and pulled with AT+CIPRECVDATA; a link stops
+// reading its socket once it holds MAX_HELD_LEN bytes.
+//
+// Transport: a pseudo terminal (the default; the slave path is printed and
+// optionally linked to --link), or an inherited descriptor (--fd), e.g. one
+// end of a socketpair() held by an in-process test harness.
+//
+// Timing and faults, all optional:
+//    --baud <n>           Pace output at n baud (10 bits per byte); 0 disables
+//    --latency <ms>       Delay before each response
+//    --jitter <ms>        Random extra delay, 0..ms
+//    --join <ms>          Time AT+CWJAP takes; the module answers "busy p..." meanwhile
+//    --busy <p>           Probability a command is answered with "busy p..." only
+//    --drop <p>           Probability a response is lost
+//    --garble <p>         Probability one byte of a response is corrupted
+//    --wifi-drop <s>      Lose the association every s seconds
+//    --ap <ssid:pwd>      Only this AP exists (default: any join succeeds)
+//    --keep-echo          Ignore ATE0: echo every command, as after a reset
+//    --seed <n>           RNG seed for jitter and faults
+//    --verbose            Trace commands and responses on stderr
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -o esp8266_emulator ESP8266Emulator.cpp
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_LINKS 5
+#define MAX_SEND_LEN 2048
+#define MAX_IPD_LEN 1460
+#define MAX_HELD_LEN 5840			// Passive receive: bytes held per link before its window closes
+#define DEFAULT_SERVER_PORT 333
+#define GUARD_TIME_US 20000			// Idle time required around "+++"
+#define RESET_TIME_US 300000		// AT+RST to "ready"
+
+namespace
+{
+	volatile sig_atomic_t g_Stop = 0;
+
+	void OnSignal(int)
+	{
+		g_Stop = 1;
+	}
+
+	uint64_t NowUS()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	struct Options
+	{
+		const char * Link = nullptr;
+		int Fd = -1;
+		unsigned long Baud = 115200;
+		unsigned LatencyMS = 0;
+		unsigned JitterMS = 0;
+		unsigned JoinMS = 1500;
+		double Busy = 0;
+		double Drop = 0;
+		double Garble = 0;
+		unsigned WiFiDropS = 0;
+		std::string SSID;
+		std::string Password;
+		bool KeepEcho = false;
+		unsigned Seed = 1;
+		bool Verbose = false;
+	};
+
+	struct Link
+	{
+		int Fd = -1;
+		bool UDP = false;
+		bool Server = false;			// Accepted by AT+CIPSERVER
+		int UDPMode = 0;				// 0 fixed peer, 1 next sender once, 2 every sender
+		sockaddr_in Remote = {};
+		uint16_t LocalPort = 0;
+		std::string Held;				// Passive receive: data not pulled yet
+
+		bool Open() const { return Fd >= 0; }
+	};
+
+	struct Output
+	{
+		uint64_t Due;					// Not written before this time
+		std::string Data;
+	};
+
+	struct Args
+	{
+		std::vector<std::string> Values;
+		std::vector<bool> Quoted;
+
+		size_t Size() const { return Values.size(); }
+		long Int(size_t i) const { return strtol(Values[i].c_str(), nullptr, 10); }
+		bool IsInt(size_t i) const
+		{
+			if (i >= Values.size() or Quoted[i] or Values[i].empty())
+				return false;
+			char * end;
+			strtol(Values[i].c_str(), &end, 10);
+			return *end == '\0';
+		}
+	};
+}
+
+class Emulator
+{
+public:
+	Emulator(const Options& options, int fd)
+		: m_Options(options)
+		, m_Fd(fd)
+		, m_Random(options.Seed)
+	{
+		Reset();
+	}
+
+	int Run();
+
+private:
+	//////////////////
+	// Output Queue //
+	//////////////////
+	void Send(const std::string& data, bool faults = true);
+	void Reply(const std::string& data) { Send(data); }
+	void Ok(const std::string& body = "") { Reply(body + "\r\nOK\r\n"); }
+	void Error(const std::string& body = "") { Reply(body + "\r\nERROR\r\n"); }
+	void Event(const std::string& line) { Send(line + "\r\n", false); }
+	bool Flush(uint64_t now, int * timeoutMS);
+
+	///////////
+	// Input //
+	///////////
+	void OnInput(const uint8_t * data, size_t size);
+	void OnLine(const std::string& line);
+	void OnData();
+	void OnPassthrough(const uint8_t * data, size_t size);
+
+	//////////////
+	// Commands //
+	//////////////
+	void Execute(const std::string& name, char kind, const Args& args);
+	void CmdJoin(char kind, const Args& args);
+	void CmdStart(const Args& args);
+	void CmdSend(const Args& args, bool buffered);
+	void CmdClose(const Args& args);
+	void CmdStatus();
+	void CmdServer(const Args& args);
+	void CmdDomain(const Args& args);
+	void CmdReceive(const Args& args);
+	void CmdReceiveLength();
+
+	/////////////
+	// Network //
+	/////////////
+	void OnServerReadable();
+	void OnLinkReadable(int id);
+	void CloseLink(int id, bool notify);
+	void DropWiFi();
+	int FreeLink() const;
+	int OpenLinks() const;
+	bool Resolve(const std::string& host, uint16_t port, sockaddr_in& address);
+
+	void Reset();
+	bool Chance(double p) { return p > 0 and std::uniform_real_distribution<double>(0, 1)(m_Random) < p; }
+	void Trace(const char * direction, const std::string& data);
+
+	const Options& m_Options;
+	int m_Fd;
+	std::mt19937 m_Random;
+
+	std::deque<Output> m_Output;
+	uint64_t m_WireFree = 0;			// Output pacing: the line is busy until then
+	uint64_t m_LastDue = 0;				// Keeps responses in order despite jitter
+
+	enum { INPUT_LINE, INPUT_DATA, INPUT_PASSTHROUGH } m_Input = INPUT_LINE;
+	std::string m_Line;
+	std::string m_Data;					// CIPSEND payload being collected
+	size_t m_DataLen = 0;
+	int m_DataLink = 0;
+	bool m_DataBuffered = false;		// AT+CIPSENDBUF rather than AT+CIPSEND
+	sockaddr_in m_DataRemote = {};		// UDP destination given with AT+CIPSEND
+	bool m_DataHasRemote = false;
+	uint64_t m_LastInput = 0;
+
+	// Module state, see Reset()
+	bool m_Echo = true;
+	int m_Mode = 1;
+	bool m_Joined = false;
+	std::string m_JoinedSSID;
+	uint64_t m_BusyUntil = 0;
+	bool m_Mux = false;
+	bool m_Passthrough = false;			// AT+CIPMODE
+	bool m_IPDInfo = false;
+	bool m_PassiveRecv = false;			// AT+CIPRECVMODE
+	int m_Stat = 5;						// STATUS: of AT+CIPSTATUS
+	int m_ServerFd = -1;
+	uint16_t m_ServerPort = 0;
+	Link m_Links[MAX_LINKS];
+	unsigned m_Segment = 0;
+	uint64_t m_NextWiFiDrop = 0;
+
+	std::map<std::string, unsigned long> m_Counts;
+	unsigned long m_BytesIn = 0;
+	unsigned long m_BytesOut = 0;
+};
+
+//////////////////
+// Output Queue //
+//////////////////
+
+// Send()
+// Queues [data] after the configured latency and jitter. Responses to
+// commands are subject to the drop/garble faults, unsolicited events are not.
+void Emulator::Send(const std::string& data, bool faults /*= true*/)
+{
+	if (faults and Chance(m_Options.Drop))
+	{
+		Trace("drop", data);
+		return;
+	}
+	std::string out = data;
+	if (faults and not out.empty() and Chance(m_Options.Garble))
+		out[std::uniform_int_distribution<size_t>(0, out.size() - 1)(m_Random)] ^= 0x20;
+
+	uint64_t delay = m_Options.LatencyMS * 1000ULL;
+	if (m_Options.JitterMS)
+		delay += std::uniform_int_distribution<uint64_t>(0, m_Options.JitterMS * 1000ULL)(m_Random);
+	m_LastDue = std::max(m_LastDue, NowUS() + delay);
+	m_Output.push_back(Output{ m_LastDue, out });
+}
+
+// Flush()
+// Writes what is due, paced to the baud rate. Returns false if the
+// transport is gone; lowers [timeoutMS] to when more output is due.
+bool Emulator::Flush(uint64_t now, int * timeoutMS)
+{
+	const uint64_t byteUS = m_Options.Baud ? 10000000ULL / m_Options.Baud : 0;
+	while (not m_Output.empty())
+	{
+		Output& front = m_Output.front();
+		uint64_t ready = std::max(front.Due, m_WireFree);
+		if (ready > now)
+		{
+			*timeoutMS = std::min<int>(*timeoutMS, (int)((ready - now + 999) / 1000));
+			return true;
+		}
+
+		// A chunk of 1 ms worth of bytes at a time keeps the pacing smooth.
+		size_t chunk = byteUS ? std::max<size_t>(1, 1000 / byteUS) : front.Data.size();
+		chunk = std::min(chunk, front.Data.size());
+		ssize_t n = write(m_Fd, front.Data.data(), chunk);
+		if (n < 0)
+		{
+			if (errno == EAGAIN)
+			{
+				*timeoutMS = std::min(*timeoutMS, 1);
+				return true;
+			}
+			return errno == EIO;	// pty with no reader yet
+		}
+		Trace("out", front.Data.substr(0, n));
+		m_BytesOut += n;
+		m_WireFree = now + n * byteUS;
+		front.Data.erase(0, n);
+		if (front.Data.empty())
+			m_Output.pop_front();
+	}
+	return true;
+}
+
+///////////
+// Input //
+///////////
+void Emulator::OnInput(const uint8_t * data, size_t size)
+{
+	m_BytesIn += size;
+	while (size > 0)
+	{
+		if (m_Input == INPUT_PASSTHROUGH)
+		{
+			OnPassthrough(data, size);
+			return;
+		}
+		if (m_Input == INPUT_DATA)
+		{
+			size_t n = std::min(size, m_DataLen - m_Data.size());
+			m_Data.append((const char *)data, n);
+			data += n;
+			size -= n;
+			if (m_Data.size() == m_DataLen)
+				OnData();
+			continue;
+		}
+
+		char c = *data++;
+		size--;
+		m_Line += c;
+		if (c == '\n')
+		{
+			std::string line = m_Line;
+			m_Line.clear();
+			while (not line.empty() and (line.back() == '\r' or line.back() == '\n'))
+				line.pop_back();
+			if (not line.empty())
+				OnLine(line);
+		}
+	}
+}
+
+void Emulator::OnLine(const std::string& line)
+{
+	Trace("cmd", line);
+	if (m_Echo)
+		Send(line + "\r\r\n", false);
+
+	if (line.compare(0, 2, "AT") != 0)
+	{
+		Error();
+		return;
+	}
+
+	uint64_t now = NowUS();
+	if (now < m_BusyUntil or Chance(m_Options.Busy))
+	{
+		Send("busy p...\r\n", false);
+		m_Counts["busy"]++;
+		return;
+	}
+
+	// AT<name>[?|=<args>]; AT 1.x _CUR/_DEF variants behave alike here.
+	std::string rest = line.substr(2);
+	size_t end = rest.find_first_of("?=");
+	std::string name = rest.substr(0, end);
+	char kind = (end == std::string::npos) ? 'x' : rest[end];
+	for (const char * suffix : { "_CUR", "_DEF" })
+		if (name.size() > 4 and name.compare(name.size() - 4, 4, suffix) == 0)
+			name.erase(name.size() - 4);
+
+	Args args;
+	if (kind == '=')
+	{
+		std::string value;
+		bool quoted = false, inQuotes = false;
+		for (size_t i = end + 1; i <= rest.size(); i++)
+		{
+			char c = (i < rest.size()) ? rest[i] : ',';
+			if (inQuotes and c == '\\' and i + 1 < rest.size())
+				value += rest[++i];
+			else if (c == '"')
+				inQuotes = not inQuotes, quoted = true;
+			else if (c == ',' and not inQuotes)
+			{
+				args.Values.push_back(value);
+				args.Quoted.push_back(quoted);
+				value.clear();
+				quoted = false;
+			}
+			else
+				value += c;
+		}
+	}
+
+	m_Counts[name.empty() ? "AT" : name]++;
+	Execute(name, kind, args);
+}
+
+// OnData()
+// The payload announced by AT+CIPSEND/AT+CIPSENDBUF is complete.
+void Emulator::OnData()
+{
+	m_Input = INPUT_LINE;
+	Link& link = m_Links[m_DataLink];
+	bool sent = false;
+	if (link.Open())
+	{
+		if (link.UDP)
+		{
+			const sockaddr_in& to = m_DataHasRemote ? m_DataRemote : link.Remote;
+			sent = sendto(link.Fd, m_Data.data(), m_Data.size(), 0, (const sockaddr *)&to, sizeof to) == (ssize_t)m_Data.size();
+		}
+		else
+			sent = send(link.Fd, m_Data.data(), m_Data.size(), MSG_NOSIGNAL) == (ssize_t)m_Data.size();
+	}
+
+	std::string recv = "\r\nRecv " + std::to_string(m_Data.size()) + " bytes\r\n";
+	if (m_DataBuffered)
+	{
+		Reply(recv);
+		std::string id = m_Mux ? std::to_string(m_DataLink) + "," : "";
+		Event(id + std::to_string(m_Segment) + (sent ? ",SEND OK" : ",SEND FAIL"));
+	}
+	else
+		Reply(recv + (sent ? "\r\nSEND OK\r\n" : "\r\nSEND FAIL\r\n"));
+	m_Data.clear();
+}
+
+void Emulator::OnPassthrough(const uint8_t * data, size_t size)
+{
+	uint64_t now = NowUS();
+	bool escape = (size == 3 and memcmp(data, "+++", 3) == 0 and now - m_LastInput >= GUARD_TIME_US);
+	m_LastInput = now;
+	if (escape)
+	{
+		Trace("cmd", "+++");
+		m_Input = INPUT_LINE;
+		return;
+	}
+	if (m_Links[0].Open())
+		send(m_Links[0].Fd, data, size, MSG_NOSIGNAL);
+}
+
+//////////////
+// Commands //
+//////////////
+void Emulator::Execute(const std::string& name, char kind, const Args& args)
+{
+	if (name.empty())
+		Ok();
+	else if (name == "E0" or name == "E1")
+	{
+		m_Echo = (name == "E1") or m_Options.KeepEcho;
+		Ok();
+	}
+	else if (name == "+RST")
+	{
+		Ok();
+		Reset();
+		m_LastDue += RESET_TIME_US;
+		Send("\r\n ets Jan  8 2013,rst cause:2, boot mode:(3,6)\r\n\r\nready\r\n", false);
+	}
+	else if (name == "+GMR")
+		Ok("AT version:1.7.4.0(emulated)\r\nSDK version:3.0.4\r\ncompile time:" __DATE__ " " __TIME__ "\r\n");
+	else if (name == "+UART")
+		(kind == '=' and args.Size() == 5) ? Ok() : Error();
+	else if (name == "+CWMODE")
+	{
+		if (kind == '?')
+			Ok("+CWMODE:" + std::to_string(m_Mode) + "\r\n");
+		else if (kind == '=' and args.IsInt(0) and args.Int(0) >= 1 and args.Int(0) <= 3)
+		{
+			m_Mode = args.Int(0);
+			Ok();
+		}
+		else
+			Error();
+	}
+	else if (name == "+CWJAP")
+		CmdJoin(kind, args);
+	else if (name == "+CWQAP")
+	{
+		Ok();
+		if (m_Joined)
+			DropWiFi();
+	}
+	else if (name == "+CIFSR")
+		m_Joined ? Ok("+CIFSR:STAIP,\"127.0.0.1\"\r\n+CIFSR:STAMAC,\"18:fe:34:00:00:01\"\r\n")
+			: Ok("+CIFSR:STAIP,\"0.0.0.0\"\r\n+CIFSR:STAMAC,\"18:fe:34:00:00:01\"\r\n");
+	else if (name == "+CIPSTAMAC" and kind == '?')
+		Ok("+CIPSTAMAC:\"18:fe:34:00:00:01\"\r\n");
+	else if (name == "+CIPMUX")
+	{
+		if (kind == '?')
+			Ok("+CIPMUX:" + std::to_string(m_Mux) + "\r\n");
+		else if (kind == '=' and args.IsInt(0) and args.Int(0) <= 1)
+		{
+			if (OpenLinks() > 0 and (args.Int(0) == 1) != m_Mux)
+				Error("link is builded\r\n");
+			else if (args.Int(0) == 1 and m_Passthrough)
+				Error();
+			else
+			{
+				m_Mux = args.Int(0);
+				Ok();
+			}
+		}
+		else
+			Error();
+	}
+	else if (name == "+CIPMODE")
+	{
+		if (kind == '?')
+			Ok("+CIPMODE:" + std::to_string(m_Passthrough) + "\r\n");
+		else if (kind == '=' and args.IsInt(0) and args.Int(0) <= 1 and not (m_Mux and args.Int(0) == 1))
+		{
+			m_Passthrough = args.Int(0);
+			Ok();
+		}
+		else
+			Error();
+	}
+	else if (name == "+CIPDINFO" and kind == '=' and args.IsInt(0))
+	{
+		m_IPDInfo = args.Int(0);
+		Ok();
+	}
+	else if (name == "+CIPRECVMODE")
+	{
+		if (kind == '?')
+			Ok("+CIPRECVMODE:" + std::to_string(m_PassiveRecv) + "\r\n");
+		else if (kind == '=' and args.IsInt(0) and args.Int(0) <= 1 and not m_Passthrough)
+		{
+			m_PassiveRecv = args.Int(0);
+			Ok();
+		}
+		else
+			Error();
+	}
+	else if (name == "+CIPRECVDATA" and kind == '=')
+		CmdReceive(args);
+	else if (name == "+CIPRECVLEN" and kind == '?')
+		CmdReceiveLength();
+	else if (name == "+CIPSERVER" and kind == '=')
+		CmdServer(args);
+	else if (name == "+CIPSTART" and kind == '=')
+		CmdStart(args);
+	else if (name == "+CIPSEND")
+		CmdSend(args, false);
+	else if (name == "+CIPSENDBUF" and kind == '=')
+		CmdSend(args, true);
+	else if (name == "+CIPCLOSE")
+		CmdClose(args);
+	else if (name == "+CIPSTATUS")
+		CmdStatus();
+	else if (name == "+CIPDOMAIN" and kind == '=')
+		CmdDomain(args);
+	else if (name == "+PING" and kind == '=')
+	{
+		sockaddr_in address;
+		m_Joined and args.Size() == 1 and Resolve(args.Values[0], 0, address) ? Ok("+1\r\n") : Error("+timeout\r\n");
+	}
+	else
+		Error();
+}
+
+void Emulator::CmdJoin(char kind, const Args& args)
+{
+	if (kind == '?')
+	{
+		if (m_Joined)
+			Ok("+CWJAP:\"" + m_JoinedSSID + "\",\"02:00:00:00:00:01\",6,-50\r\n");
+		else
+			Ok("No AP\r\n");
+		return;
+	}
+	if (kind != '=' or args.Size() < 1 or args.Size() > 3 or m_Mode == 2)
+	{
+		Error();
+		return;
+	}
+
+	if (m_Joined)
+		DropWiFi();
+	const std::string& ssid = args.Values[0];
+	std::string password = (args.Size() > 1) ? args.Values[1] : "";
+	uint64_t joinUS = m_Options.JoinMS * 1000ULL;
+	m_LastDue = std::max(m_LastDue, NowUS()) + joinUS;
+	m_BusyUntil = NowUS() + joinUS;
+
+	// Reasons: 1 timeout, 2 wrong password, 3 AP not found
+	if (not m_Options.SSID.empty() and ssid != m_Options.SSID)
+	{
+		Reply("+CWJAP:3\r\n\r\nFAIL\r\n");
+		return;
+	}
+	if (not m_Options.SSID.empty() and password != m_Options.Password)
+	{
+		Reply("+CWJAP:2\r\n\r\nFAIL\r\n");
+		return;
+	}
+	m_Joined = true;
+	m_JoinedSSID = ssid;
+	m_Stat = 2;
+	if (m_Options.WiFiDropS)
+		m_NextWiFiDrop = NowUS() + m_Options.WiFiDropS * 1000000ULL;
+	Ok("WIFI CONNECTED\r\nWIFI GOT IP\r\n");
+}
+
+// AT+CIPSTART=[<id>,]<type>,<remote>,<port>[,<keepalive> | ,<local port>,<mode>]
+void Emulator::CmdStart(const Args& args)
+{
+	size_t i = 0;
+	int id = 0;
+	if (m_Mux)
+	{
+		if (not args.IsInt(0) or args.Int(0) < 0 or args.Int(0) >= MAX_LINKS)
+		{
+			Error();
+			return;
+		}
+		id = args.Int(i++);
+	}
+	if (args.Size() < i + 3 or not args.IsInt(i + 2) or not m_Joined)
+	{
+		Error();
+		return;
+	}
+	const std::string& type = args.Values[i];
+	Link& link = m_Links[id];
+	if (link.Open())
+	{
+		Error("ALREADY CONNECTED\r\n");
+		return;
+	}
+
+	sockaddr_in remote;
+	if (not Resolve(args.Values[i + 1], args.Int(i + 2), remote))
+	{
+		Error("DNS Fail\r\n");
+		return;
+	}
+
+	std::string prefix = m_Mux ? std::to_string(id) + "," : "";
+	if (type == "TCP")
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 or connect(fd, (const sockaddr *)&remote, sizeof remote) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			Error();
+			Event(prefix + "CLOSED");
+			return;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		link = Link();
+		link.Fd = fd;
+		link.Remote = remote;
+	}
+	else if (type == "UDP")
+	{
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		sockaddr_in local = {};
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = htons((args.Size() > i + 3 and args.IsInt(i + 3)) ? args.Int(i + 3) : 0);
+		if (fd < 0 or bind(fd, (const sockaddr *)&local, sizeof local) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			Error();
+			return;
+		}
+		socklen_t len = sizeof local;
+		getsockname(fd, (sockaddr *)&local, &len);
+		link = Link();
+		link.Fd = fd;
+		link.UDP = true;
+		link.Remote = remote;
+		link.LocalPort = ntohs(local.sin_port);
+		link.UDPMode = (args.Size() > i + 4 and args.IsInt(i + 4)) ? args.Int(i + 4) : 0;
+	}
+	else
+	{
+		Error();
+		return;
+	}
+
+	m_Stat = 3;
+	Ok(prefix + "CONNECT\r\n");
+}
+
+// AT+CIPSEND=[<id>,]<len>[,<remote>,<port>], AT+CIPSENDBUF=[<id>,]<len>
+// and AT+CIPSEND alone to enter transparent transmission.
+void Emulator::CmdSend(const Args& args, bool buffered)
+{
+	if (args.Size() == 0)
+	{
+		if (buffered or m_Mux or not m_Passthrough or not m_Links[0].Open())
+		{
+			Error();
+			return;
+		}
+		Reply("\r\nOK\r\n\r\n>");
+		m_Input = INPUT_PASSTHROUGH;
+		m_LastInput = NowUS();
+		return;
+	}
+
+	size_t i = 0;
+	int id = 0;
+	if (m_Mux)
+	{
+		if (not args.IsInt(0) or args.Int(0) < 0 or args.Int(0) >= MAX_LINKS)
+		{
+			Error();
+			return;
+		}
+		id = args.Int(i++);
+	}
+	if (not args.IsInt(i) or args.Int(i) <= 0 or args.Int(i) > MAX_SEND_LEN or not m_Links[id].Open())
+	{
+		Error("link is not valid\r\n");
+		return;
+	}
+
+	m_DataHasRemote = false;
+	if (args.Size() == i + 3)
+	{
+		if (buffered or not m_Links[id].UDP or not args.IsInt(i + 2)
+			or not Resolve(args.Values[i + 1], args.Int(i + 2), m_DataRemote))
+		{
+			Error();
+			return;
+		}
+		m_DataHasRemote = true;
+	}
+
+	m_DataLink = id;
+	m_DataLen = args.Int(i);
+	m_DataBuffered = buffered;
+	m_Data.clear();
+	m_Input = INPUT_DATA;
+	if (buffered)
+		Reply(std::to_string(++m_Segment) + "," + std::to_string(m_DataLen) + "\r\n\r\nOK\r\n> ");
+	else
+		Reply("\r\nOK\r\n> ");
+}
+
+void Emulator::CmdClose(const Args& args)
+{
+	int id = 0;
+	if (m_Mux)
+	{
+		if (not args.IsInt(0) or args.Int(0) < 0 or args.Int(0) >= MAX_LINKS)
+		{
+			Error();
+			return;
+		}
+		id = args.Int(0);
+	}
+	if (not m_Links[id].Open())
+	{
+		Error("UNLINK\r\n");
+		return;
+	}
+	CloseLink(id, false);
+	Ok((m_Mux ? std::to_string(id) + "," : "") + "CLOSED\r\n");
+}
+
+void Emulator::CmdStatus()
+{
+	std::string body = "STATUS:" + std::to_string(m_Stat) + "\r\n";
+	for (int id = 0; id < MAX_LINKS; id++)
+	{
+		const Link& link = m_Links[id];
+		if (not link.Open())
+			continue;
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &link.Remote.sin_addr, ip, sizeof ip);
+		body += "+CIPSTATUS:" + std::to_string(id) + ",\"" + (link.UDP ? "UDP" : "TCP") + "\",\"" + ip + "\","
+			+ std::to_string(ntohs(link.Remote.sin_port)) + "," + std::to_string(link.LocalPort) + ","
+			+ (link.Server ? "1" : "0") + "\r\n";
+	}
+	Ok(body);
+}
+
+// AT+CIPSERVER=<mode>[,<port>]
+void Emulator::CmdServer(const Args& args)
+{
+	if (not args.IsInt(0) or not m_Mux)
+	{
+		Error();
+		return;
+	}
+	if (args.Int(0) == 0)
+	{
+		if (m_ServerFd >= 0)
+			close(m_ServerFd);
+		m_ServerFd = -1;
+		Ok();
+		return;
+	}
+
+	uint16_t port = args.IsInt(1) ? args.Int(1) : DEFAULT_SERVER_PORT;
+	if (m_ServerFd >= 0)
+	{
+		port == m_ServerPort ? Ok("no change\r\n") : Error();
+		return;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(port);
+	if (fd < 0 or bind(fd, (const sockaddr *)&local, sizeof local) != 0 or listen(fd, MAX_LINKS) != 0)
+	{
+		fprintf(stderr, "esp8266: cannot listen on %u: %s\n", port, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		Error();
+		return;
+	}
+	m_ServerFd = fd;
+	m_ServerPort = port;
+	Ok();
+}
+
+void Emulator::CmdDomain(const Args& args)
+{
+	sockaddr_in address;
+	if (not m_Joined or args.Size() != 1 or not Resolve(args.Values[0], 0, address))
+	{
+		Error("DNS Fail\r\n");
+		return;
+	}
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &address.sin_addr, ip, sizeof ip);
+	Ok(std::string("+CIPDOMAIN:") + ip + "\r\n");
+}
+
+// AT+CIPRECVDATA=[<id>,]<len>, answered in the AT 1.x format
+// "+CIPRECVDATA,<len>:<data>"; ERROR when nothing is held.
+void Emulator::CmdReceive(const Args& args)
+{
+	size_t i = 0;
+	int id = 0;
+	if (m_Mux)
+	{
+		if (not args.IsInt(0) or args.Int(0) < 0 or args.Int(0) >= MAX_LINKS)
+		{
+			Error();
+			return;
+		}
+		id = args.Int(i++);
+	}
+	Link& link = m_Links[id];
+	if (not m_PassiveRecv or not args.IsInt(i) or args.Int(i) <= 0 or link.Held.empty())
+	{
+		Error();
+		return;
+	}
+	size_t n = std::min<size_t>(args.Int(i), link.Held.size());
+	std::string data = link.Held.substr(0, n);
+	link.Held.erase(0, n);
+	Ok("+CIPRECVDATA," + std::to_string(n) + ":" + data + "\r\n");
+}
+
+// AT+CIPRECVLEN?: bytes held, one field per link with CIPMUX=1.
+void Emulator::CmdReceiveLength()
+{
+	if (not m_PassiveRecv)
+	{
+		Error();
+		return;
+	}
+	std::string body = "+CIPRECVLEN:";
+	for (int id = 0; id < (m_Mux ? MAX_LINKS : 1); id++)
+		body += (id ? "," : "") + std::to_string(m_Links[id].Held.size());
+	Ok(body + "\r\n");
+}
+
+/////////////
+// Network //
+/////////////
+void Emulator::OnServerReadable()
+{
+	sockaddr_in remote;
+	socklen_t len = sizeof remote;
+	int fd = accept(m_ServerFd, (sockaddr *)&remote, &len);
+	if (fd < 0)
+		return;
+	int id = FreeLink();
+	if (id < 0)
+	{
+		close(fd);	// The module refuses connections beyond its links
+		return;
+	}
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	Link& link = m_Links[id];
+	link = Link();
+	link.Fd = fd;
+	link.Server = true;
+	link.Remote = remote;
+	link.LocalPort = m_ServerPort;
+	m_Stat = 3;
+	Event(std::to_string(id) + ",CONNECT");
+}
+
+void Emulator::OnLinkReadable(int id)
+{
+	Link& link = m_Links[id];
+	char data[MAX_IPD_LEN];
+	sockaddr_in from;
+	socklen_t len = sizeof from;
+	ssize_t n = link.UDP ? recvfrom(link.Fd, data, sizeof data, 0, (sockaddr *)&from, &len)
+		: recv(link.Fd, data, sizeof data, 0);
+	if (n <= 0)
+	{
+		if (not link.UDP)
+			CloseLink(id, true);
+		return;
+	}
+	if (link.UDP)
+	{
+		if (link.UDPMode == 2 or link.UDPMode == 1)
+			link.Remote = from;
+		if (link.UDPMode == 1)
+			link.UDPMode = 0;
+	}
+	else
+		from = link.Remote;
+
+	if (m_Input == INPUT_PASSTHROUGH and id == 0)
+	{
+		Send(std::string(data, n), false);
+		return;
+	}
+	std::string header = "\r\n+IPD," + (m_Mux ? std::to_string(id) + "," : "") + std::to_string(n);
+	if (m_IPDInfo)
+	{
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &from.sin_addr, ip, sizeof ip);
+		header += std::string(",") + ip + "," + std::to_string(ntohs(from.sin_port));
+	}
+	if (m_PassiveRecv and not link.UDP)
+	{
+		link.Held.append(data, n);
+		Send(header + "\r\n", false);
+		return;
+	}
+	Send(header + ":" + std::string(data, n), false);
+}
+
+void Emulator::CloseLink(int id, bool notify)
+{
+	Link& link = m_Links[id];
+	if (not link.Open())
+		return;
+	close(link.Fd);
+	link = Link();
+	if (id == 0 and m_Input == INPUT_PASSTHROUGH)
+		m_Input = INPUT_LINE;
+	if (OpenLinks() == 0 and m_Joined)
+		m_Stat = 4;
+	if (notify)
+		Event((m_Mux ? std::to_string(id) + "," : "") + "CLOSED");
+}
+
+void Emulator::DropWiFi()
+{
+	for (int id = 0; id < MAX_LINKS; id++)
+		CloseLink(id, true);
+	m_Joined = false;
+	m_Stat = 5;
+	m_NextWiFiDrop = 0;
+	Event("WIFI DISCONNECT");
+}
+
+int Emulator::FreeLink() const
+{
+	for (int id = 0; id < MAX_LINKS; id++)
+		if (not m_Links[id].Open())
+			return id;
+	return -1;
+}
+
+int Emulator::OpenLinks() const
+{
+	int count = 0;
+	for (const Link& link : m_Links)
+		count += link.Open();
+	return count;
+}
+
+bool Emulator::Resolve(const std::string& host, uint16_t port, sockaddr_in& address)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_INET;
+	addrinfo * result = nullptr;
+	if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 or result == nullptr)
+		return false;
+	address = *(const sockaddr_in *)result->ai_addr;
+	address.sin_port = htons(port);
+	freeaddrinfo(result);
+	return true;
+}
+
+void Emulator::Reset()
+{
+	for (int id = 0; id < MAX_LINKS; id++)
+		CloseLink(id, false);
+	if (m_ServerFd >= 0)
+		close(m_ServerFd);
+	m_ServerFd = -1;
+	m_ServerPort = 0;
+	m_Input = INPUT_LINE;
+	m_Line.clear();
+	m_Echo = true;
+	m_Mode = 1;
+	m_Joined = false;
+	m_BusyUntil = 0;
+	m_Mux = false;
+	m_Passthrough = false;
+	m_IPDInfo = false;
+	m_PassiveRecv = false;
+	m_Stat = 5;
+	m_Segment = 0;
+	m_NextWiFiDrop = 0;
+}
+
+void Emulator::Trace(const char * direction, const std::string& data)
+{
+	if (not m_Options.Verbose)
+		return;
+	fprintf(stderr, "%10.3f %-4s ", NowUS() / 1000.0, direction);
+	for (unsigned char c : data)
+	{
+		if (c == '\r')
+			fputs("\\r", stderr);
+		else if (c == '\n')
+			fputs("\\n", stderr);
+		else if (c < 0x20 or c >= 0x7f)
+			fprintf(stderr, "\\x%02x", c);
+		else
+			fputc(c, stderr);
+	}
+	fputc('\n', stderr);
+}
+
+int Emulator::Run()
+{
+	while (not g_Stop)
+	{
+		uint64_t now = NowUS();
+		if (m_NextWiFiDrop and now >= m_NextWiFiDrop and m_Joined)
+			DropWiFi();
+
+		int timeoutMS = 100;
+		if (not Flush(now, &timeoutMS))
+			break;
+
+		std::vector<pollfd> fds;
+		fds.push_back(pollfd{ m_Fd, POLLIN, 0 });
+		if (m_ServerFd >= 0)
+			fds.push_back(pollfd{ m_ServerFd, POLLIN, 0 });
+		for (const Link& link : m_Links)
+			if (link.Open() and link.Held.size() < MAX_HELD_LEN)
+				fds.push_back(pollfd{ link.Fd, POLLIN, 0 });
+
+		if (poll(fds.data(), fds.size(), timeoutMS) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		for (const pollfd& p : fds)
+		{
+			if (not (p.revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (p.fd == m_Fd)
+			{
+				uint8_t data[512];
+				ssize_t n = read(m_Fd, data, sizeof data);
+				if (n > 0)
+					OnInput(data, n);
+				else if (n == 0 or (errno != EAGAIN and errno != EIO))
+					g_Stop = 1;
+				else if (errno == EIO)
+					usleep(10000);	// pty slave not opened yet
+			}
+			else if (p.fd == m_ServerFd)
+				OnServerReadable();
+			else
+			{
+				for (int id = 0; id < MAX_LINKS; id++)
+					if (m_Links[id].Fd == p.fd)
+						OnLinkReadable(id);
+			}
+		}
+	}
+
+	fprintf(stderr, "esp8266: %lu bytes in, %lu bytes out\n", m_BytesIn, m_BytesOut);
+	for (const auto& count : m_Counts)
+		fprintf(stderr, "esp8266: %-12s %lu\n", count.first.c_str(), count.second);
+	return 0;
+}
+
+//////////////////
+// Entry Point  //
+//////////////////
+static int OpenPty(const char * link, int * slave)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 or grantpt(master) != 0 or unlockpt(master) != 0)
+	{
+		perror("posix_openpt");
+		return -1;
+	}
+	const char * name = ptsname(master);
+
+	// Keep the slave open and raw, so the master never sees EIO between
+	// clients and no line discipline rewrites the data.
+	*slave = open(name, O_RDWR | O_NOCTTY);
+	termios tio;
+	if (*slave < 0 or tcgetattr(*slave, &tio) != 0)
+	{
+		perror(name);
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tcsetattr(*slave, TCSANOW, &tio);
+
+	if (link)
+	{
+		unlink(link);
+		if (symlink(name, link) != 0)
+			perror(link);
+	}
+	printf("%s\n", link ? link : name);
+	fflush(stdout);
+	return master;
+}
+
+static void Usage(const char * program)
+{
+	fprintf(stderr, "usage: %s [--link path | --fd n] [--baud n] [--latency ms] [--jitter ms] [--join ms]\n"
+		"       [--busy p] [--drop p] [--garble p] [--wifi-drop s] [--ap ssid:pwd] [--keep-echo] [--seed n]\n"
+		"       [--verbose]\n", program);
+}
+
+int main(int argc, char * argv[])
+{
+	static const option longOptions[] =
+	{
+		{ "link", required_argument, nullptr, 'l' },
+		{ "fd", required_argument, nullptr, 'f' },
+		{ "baud", required_argument, nullptr, 'b' },
+		{ "latency", required_argument, nullptr, 'L' },
+		{ "jitter", required_argument, nullptr, 'j' },
+		{ "join", required_argument, nullptr, 'J' },
+		{ "busy", required_argument, nullptr, 'B' },
+		{ "drop", required_argument, nullptr, 'd' },
+		{ "garble", required_argument, nullptr, 'g' },
+		{ "wifi-drop", required_argument, nullptr, 'w' },
+		{ "ap", required_argument, nullptr, 'a' },
+		{ "keep-echo", no_argument, nullptr, 'e' },
+		{ "seed", required_argument, nullptr, 's' },
+		{ "verbose", no_argument, nullptr, 'v' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	Options options;
+	int c;
+	while ((c = getopt_long(argc, argv, "", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'l': options.Link = optarg; break;
+		case 'f': options.Fd = atoi(optarg); break;
+		case 'b': options.Baud = strtoul(optarg, nullptr, 10); break;
+		case 'L': options.LatencyMS = atoi(optarg); break;
+		case 'j': options.JitterMS = atoi(optarg); break;
+		case 'J': options.JoinMS = atoi(optarg); break;
+		case 'B': options.Busy = atof(optarg); break;
+		case 'd': options.Drop = atof(optarg); break;
+		case 'g': options.Garble = atof(optarg); break;
+		case 'w': options.WiFiDropS = atoi(optarg); break;
+		case 'a':
+		{
+			std::string ap = optarg;
+			size_t colon = ap.find(':');
+			options.SSID = ap.substr(0, colon);
+			options.Password = (colon == std::string::npos) ? "" : ap.substr(colon + 1);
+			break;
+		}
+		case 'e': options.KeepEcho = true; break;
+		case 's': options.Seed = strtoul(optarg, nullptr, 10); break;
+		case 'v': options.Verbose = true; break;
+		default:
+			Usage(argv[0]);
+			return 2;
+		}
+	}
+
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	int slave = -1;
+	int fd = (options.Fd >= 0) ? options.Fd : OpenPty(options.Link, &slave);
+	if (fd < 0)
+		return 1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	Emulator emulator(options, fd);
+	int rc = emulator.Run();
+
+	if (slave >= 0)
+		close(slave);
+	if (options.Link)
+		unlink(options.Link);
+	return rc;
+}
@@ -0,0 +1,640 @@
+// ESP8266 host test
+//
+// Runs ESP8266Device and STM32TCPSocket against Tools/ESP8266Emulator on a
+// Linux host. The serial socket below stands in for STM32Serial.cpp: a
+// socketpair() to the emulator's --fd instead of USART6, and one thread
+// for the RX interrupt, RX timer and CallbackThread. As on the target, a
+// synchronous read fails while an asynchronous one is armed. Stubs/ stands
+// in for the HAL and CMSIS-RTOS. Checks:
+//    - passive receive while the module echoes every command
+//    - data queued with TCPQueue() or held by coalescing is sent by the
+//      Poll() that STM32TCPSocket runs from its read callbacks
+//    - the same polling rejoins when the module loses the AP, and the
+//      server takes connections again
+//
+// Usage:
+//    ESP8266HostTest <esp8266_emulator> [--verbose]
+// Prints each failed check and exits non-zero if there was one.
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -pthread -IStubs/Inc -I../../Core/Inc/ESP8266
+//        -I../../Core/Inc/STM32 -I../../Core/Inc/lib -o esp8266_host_test ESP8266HostTest.cpp
+//        ../../Core/Src/ESP8266/ESP8266_WiFi.cpp ../../Core/Src/ESP8266/ESP8266_ATParse.cpp
+//        ../../Core/Src/STM32/STM32TCP.cpp ../../Core/Src/lib/WiFiBuffer.cpp
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cmsis_os.h"
+#include "STM32Debug.h"
+#include "STM32Log.h"
+#include "STM32TCP.h"
+#include "ESP8266_WiFi.h"
+
+using namespace EPRI;
+
+extern WiFiBuffer wifiRxBuffer;
+
+static int g_Failed = 0;
+
+#define CHECK(x) \
+	do { if (not (x)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #x); g_Failed++; } } while (0)
+
+/////////////////////
+// HAL, CMSIS-RTOS //
+/////////////////////
+static const std::chrono::steady_clock::time_point g_Boot = std::chrono::steady_clock::now();
+
+RNG_HandleTypeDef hrng;
+
+extern "C" uint32_t HAL_GetTick(void)
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - g_Boot).count();
+}
+
+extern "C" void HAL_GPIO_WritePin(GPIO_TypeDef *, uint16_t, GPIO_PinState)
+{
+}
+
+extern "C" HAL_StatusTypeDef HAL_RNG_GenerateRandomNumber(RNG_HandleTypeDef *, uint32_t * random32bit)
+{
+	*random32bit = (uint32_t)rand();
+	return HAL_OK;
+}
+
+extern "C" osStatus osDelay(uint32_t millisec)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(millisec));
+	return osOK;
+}
+
+///////////////////
+// Debug and Log //
+///////////////////
+namespace EPRI
+{
+	namespace Log
+	{
+		volatile uint32_t Mask = 0;		// Quiet unless --verbose
+	}
+
+	uint8_t STM32Debug::instantiations = 0;
+	STM32Debug::STM32Debug() {}
+	STM32Debug::~STM32Debug() {}
+	void STM32Debug::TRACE(const char *, ...) {}
+	void STM32Debug::TRACE_BUFFER(const char *, const uint8_t *, size_t, uint8_t, uint8_t) {}
+	void STM32Debug::TRACE_VECTOR(const char *, const WiFiBuffer&, uint8_t, uint8_t) {}
+	uint32_t STM32Debug::LogDropped() const { return 0; }
+
+	STM32Base::STM32Base() {}
+	STM32Base::~STM32Base() {}
+	STM32Debug * STM32Base::GetDebug() { return &m_Debug; }
+
+	STM32Base * Base()
+	{
+		static STM32Base Instance;
+		return &Instance;
+	}
+}
+
+///////////////////
+// Serial Socket //
+///////////////////
+namespace
+{
+	int g_Fd = -1;						// Our end of the socketpair, USART6
+	std::mutex g_Lock;					// Guards the rest
+	std::condition_variable g_Wake;
+	struct
+	{
+		bool Armed = false;				// HAL_UART_Receive_IT() pending
+		size_t Bytes = 0;
+		uint32_t TimeOutInMS = 0;
+	} g_Rx;
+	std::string g_Ring;					// Asynchronous read results
+	std::atomic<bool> g_Stop(false);
+	std::thread g_CallbackThread;
+	EPRI::STM32SerialSocket * g_pSocket = nullptr;
+
+	// Reads up to [size] bytes within [timeoutInMS] (HAL_MAX_DELAY: no
+	// limit) or until the socket is being destroyed.
+	size_t ReadFd(uint8_t * data, size_t size, uint32_t timeoutInMS)
+	{
+		size_t received = 0;
+		uint32_t start = HAL_GetTick();
+		while (received < size and not g_Stop)
+		{
+			uint32_t elapsed = HAL_GetTick() - start;
+			if (timeoutInMS != HAL_MAX_DELAY and elapsed >= timeoutInMS)
+				break;
+			int slice = (timeoutInMS == HAL_MAX_DELAY) ? 20 : std::min<int>(20, timeoutInMS - elapsed);
+			pollfd p = { g_Fd, POLLIN, 0 };
+			if (poll(&p, 1, slice) <= 0)
+				continue;
+			ssize_t n = read(g_Fd, data + received, size - received);
+			if (n <= 0)
+				break;
+			received += n;
+		}
+		return received;
+	}
+
+	// Ends CallbackThread, e.g. before ~STM32TCPSocket() deletes the
+	// device a running read handler uses.
+	void StopCallbacks()
+	{
+		{
+			std::lock_guard<std::mutex> lock(g_Lock);
+			g_Stop = true;
+		}
+		g_Wake.notify_all();
+		if (g_CallbackThread.joinable())
+			g_CallbackThread.join();
+	}
+}
+
+extern "C"
+{
+	EPRI::STM32SerialSocket ** pg_pSocket = &g_pSocket;
+
+	// The RX interrupt and timer, then CallbackThread: waits for an armed
+	// read to complete or time out and runs the read handler.
+	void CallbackThread(void const *)
+	{
+		std::unique_lock<std::mutex> lock(g_Lock);
+		for (;;)
+		{
+			g_Wake.wait(lock, [] { return g_Stop or g_Rx.Armed; });
+			if (g_Stop)
+				return;
+			size_t bytes = g_Rx.Bytes;
+			uint32_t timeout = g_Rx.TimeOutInMS;
+			lock.unlock();
+
+			std::vector<uint8_t> data(bytes);
+			size_t received = ReadFd(data.data(), bytes, timeout);
+
+			lock.lock();
+			g_Ring.append((const char *)data.data(), received);
+			g_Rx.Armed = false;
+			EPRI::STM32SerialSocket * pSocket = g_pSocket;
+			if (g_Stop)
+				return;
+			lock.unlock();
+			if (pSocket and pSocket->m_Read)
+				pSocket->m_Read(received == bytes ? SUCCESSFUL : ERR_TIMEOUT, received);
+			lock.lock();
+		}
+	}
+}
+
+namespace EPRI
+{
+	STM32Serial::STM32Serial() {}
+	STM32Serial::~STM32Serial() {}
+
+	STM32SerialSocket::STM32SerialSocket(const STM32Serial::Options& Opt)
+		: m_Options(Opt)
+	{
+		g_Stop = false;
+		g_CallbackThread = std::thread(CallbackThread, nullptr);
+	}
+
+	STM32SerialSocket::~STM32SerialSocket()
+	{
+		StopCallbacks();
+		if (g_pSocket == this)
+			g_pSocket = nullptr;
+		g_Rx.Armed = false;
+		g_Ring.clear();
+	}
+
+	ERROR_TYPE STM32SerialSocket::Open(const char *, int)
+	{
+		std::lock_guard<std::mutex> lock(g_Lock);
+		g_pSocket = this;
+		return SUCCESSFUL;
+	}
+
+	STM32Serial::Options STM32SerialSocket::GetOptions()
+	{
+		return m_Options;
+	}
+
+	ERROR_TYPE STM32SerialSocket::Write(const WiFiBuffer& Data, bool)
+	{
+		size_t sent = 0;
+		while (sent < Data.Size())
+		{
+			ssize_t n = write(g_Fd, Data.GetData() + sent, Data.Size() - sent);
+			if (n <= 0)
+				return not SUCCESSFUL;
+			sent += n;
+		}
+		return SUCCESSFUL;
+	}
+
+	ERROR_TYPE STM32SerialSocket::Read(WiFiBuffer * pData, size_t ReadAtLeast, uint32_t TimeOutPeriodInMS,
+		size_t * pActualBytes)
+	{
+		if (0 == ReadAtLeast)
+			ReadAtLeast = 1;
+		if (0 == TimeOutPeriodInMS)
+			TimeOutPeriodInMS = HAL_MAX_DELAY;
+		if (pData == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(g_Lock);
+			if (g_Rx.Armed)
+				return not SUCCESSFUL;
+			g_Rx.Armed = true;
+			g_Rx.Bytes = ReadAtLeast;
+			g_Rx.TimeOutInMS = TimeOutPeriodInMS;
+			g_Wake.notify_all();
+			return SUCCESSFUL;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(g_Lock);
+			if (g_Rx.Armed)						// HAL_BUSY: the receiver belongs to the async read
+			{
+				if (pActualBytes)
+					*pActualBytes = 0;
+				return not SUCCESSFUL;
+			}
+		}
+		size_t BufferIndex = pData->AppendExtra(ReadAtLeast);
+		size_t Received = ReadFd(&(*pData)[BufferIndex], ReadAtLeast, TimeOutPeriodInMS);
+		if (pActualBytes)
+			*pActualBytes = Received;
+		return (Received == ReadAtLeast) ? SUCCESSFUL : ERR_TIMEOUT;
+	}
+
+	bool STM32SerialSocket::AppendAsyncReadResult(WiFiBuffer * pData, size_t ReadAtLeast)
+	{
+		std::lock_guard<std::mutex> lock(g_Lock);
+		if (0 == ReadAtLeast)
+			ReadAtLeast = g_Ring.size();
+		if (ReadAtLeast > g_Ring.size())
+			return false;
+		pData->AppendBuffer(g_Ring.data(), ReadAtLeast);
+		g_Ring.erase(0, ReadAtLeast);
+		return true;
+	}
+
+	STM32SerialSocket::ReadCallbackFunction STM32SerialSocket::RegisterReadHandler(ReadCallbackFunction Callback)
+	{
+		ReadCallbackFunction RetVal = m_Read;
+		m_Read = Callback;
+		return RetVal;
+	}
+
+	ERROR_TYPE STM32SerialSocket::Close()
+	{
+		std::lock_guard<std::mutex> lock(g_Lock);
+		g_pSocket = nullptr;
+		return SUCCESSFUL;
+	}
+
+	bool STM32SerialSocket::IsConnected()
+	{
+		return g_pSocket;
+	}
+
+	ERROR_TYPE STM32SerialSocket::Accept(const char * DestinationAddress, int Port)
+	{
+		return Open(DestinationAddress, Port);
+	}
+
+	ERROR_TYPE STM32SerialSocket::Flush(FlushDirection)
+	{
+		std::lock_guard<std::mutex> lock(g_Lock);
+		g_Ring.clear();
+		return SUCCESSFUL;
+	}
+
+	ERROR_TYPE STM32SerialSocket::SetOptions(const STM32Serial::Options& Opt)
+	{
+		m_Options = Opt;
+		return SUCCESSFUL;
+	}
+
+	void STM32SerialSocket::SetPortOptions()
+	{
+	}
+}
+
+/////////////
+// Harness //
+/////////////
+namespace
+{
+	const char * g_Emulator = nullptr;
+	bool g_Verbose = false;
+	pid_t g_EmulatorPid = -1;
+
+	ESP8266Device * g_WiFi = nullptr;
+	STM32TCPSocket * g_Socket = nullptr;
+	std::mutex g_ReceivedLock;
+	std::string g_Received;				// Pulled by ReadHandler(), all links
+	enum Reply
+	{
+		REPLY_NONE,
+		REPLY_QUEUED,					// Echo with TCPQueue()
+		REPLY_COALESCED					// Echo with TCPWrite(), coalescing on
+	};
+	std::atomic<int> g_Reply(REPLY_NONE);
+	std::vector<ERROR_TYPE> g_Events;	// Connect handler calls, guarded by g_ReceivedLock
+
+	void ConnectHandler(ERROR_TYPE Error)
+	{
+		std::lock_guard<std::mutex> lock(g_ReceivedLock);
+		g_Events.push_back(Error);
+	}
+
+	// Index of the first [event] at or after [from] in g_Events, -1 if none
+	int FindEvent(ERROR_TYPE event, int from = 0)
+	{
+		std::lock_guard<std::mutex> lock(g_ReceivedLock);
+		for (int i = from; i < (int)g_Events.size(); i++)
+			if (g_Events[i] == event)
+				return i;
+		return -1;
+	}
+
+	// Socket_Read_Handler() and Socket_Pull_Data() of STM32-Server.cpp
+	void ReadHandler(ERROR_TYPE Error, size_t BytesReceived)
+	{
+		if (SUCCESSFUL == Error || BytesReceived)
+		{
+			g_Socket->AppendAsyncReadResult(&wifiRxBuffer, BytesReceived);
+			size_t ActualBytes;
+			do {
+				ActualBytes = 0;
+				g_Socket->Read(&wifiRxBuffer, WIFI_RX_BUFFER_LEN, 100, &ActualBytes);
+			} while (ActualBytes == WIFI_RX_BUFFER_LEN);
+			g_WiFi->TCPProcessEvents();
+			wifiRxBuffer.Clear();
+
+			uint8_t Data[WIFI_RX_BUFFER_LEN * 2];
+			for (uint8_t linkID = 0; linkID < WIFI_MAX_SOCK_NUM; linkID++)
+			{
+				int16_t Received;
+				while (g_WiFi->TCPPending(linkID) > 0 and
+					(Received = g_WiFi->TCPReceive(linkID, Data, sizeof(Data))) > 0)
+				{
+					std::lock_guard<std::mutex> lock(g_ReceivedLock);
+					g_Received.append((const char *)Data, Received);
+					if (g_Reply == REPLY_QUEUED)
+						g_WiFi->TCPQueue(linkID, Data, Received);
+					else if (g_Reply == REPLY_COALESCED)
+					{
+						g_WiFi->TCPSetCoalescing(true);
+						g_WiFi->TCPWrite(linkID, Data, Received);
+					}
+				}
+			}
+			g_Socket->Read(nullptr, 1U);
+		}
+	}
+
+	uint16_t FreePort()
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof address;
+		bind(fd, (const sockaddr *)&address, sizeof address);
+		getsockname(fd, (sockaddr *)&address, &len);
+		close(fd);
+		return ntohs(address.sin_port);
+	}
+
+	int Connect(uint16_t port)
+	{
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(port);
+		if (connect(fd, (const sockaddr *)&address, sizeof address) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	// Reads until [size] bytes came or [timeoutInMS] passed
+	std::string ReadPeer(int fd, size_t size, uint32_t timeoutInMS)
+	{
+		std::string data;
+		uint32_t start = HAL_GetTick();
+		while (data.size() < size and HAL_GetTick() - start < timeoutInMS)
+		{
+			pollfd p = { fd, POLLIN, 0 };
+			if (poll(&p, 1, 10) <= 0)
+				continue;
+			char buf[512];
+			ssize_t n = read(fd, buf, std::min(sizeof(buf), size - data.size()));
+			if (n <= 0)
+				break;
+			data.append(buf, n);
+		}
+		return data;
+	}
+
+	bool WaitFor(std::function<bool()> done, uint32_t timeoutInMS)
+	{
+		uint32_t start = HAL_GetTick();
+		while (not done())
+		{
+			if (HAL_GetTick() - start >= timeoutInMS)
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return true;
+	}
+
+	std::string Received()
+	{
+		std::lock_guard<std::mutex> lock(g_ReceivedLock);
+		return g_Received;
+	}
+
+	// Start()
+	// Spawns the emulator with [args] and opens a passive receive server on
+	// [port] the way RunServer() does.
+	bool Start(const std::vector<std::string>& args, uint16_t port)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			return false;
+		g_EmulatorPid = fork();
+		if (g_EmulatorPid == 0)
+		{
+			close(fds[0]);
+			std::vector<std::string> strings = { g_Emulator, "--fd", std::to_string(fds[1]), "--join", "100" };
+			strings.insert(strings.end(), args.begin(), args.end());
+			if (g_Verbose)
+				strings.push_back("--verbose");
+			std::vector<char *> argv;
+			for (std::string& s : strings)
+				argv.push_back(&s[0]);
+			argv.push_back(nullptr);
+			execv(g_Emulator, argv.data());
+			perror(g_Emulator);
+			_exit(127);
+		}
+		close(fds[1]);
+		g_Fd = fds[0];
+		g_Received.clear();
+		g_Reply = REPLY_NONE;
+		g_Events.clear();
+
+		g_WiFi = new ESP8266Device();
+		g_Socket = new STM32TCPSocket(STM32Serial::Options(),
+			STM32TCP::Options(STM32TCP::Options::MODE_SERVER, STM32TCP::Options::VERSION4,
+				STM32TCP::Options::TCP, true, true),
+			g_WiFi);
+		g_Socket->RegisterReadHandler(ReadHandler);
+		g_Socket->RegisterConnectHandler(ConnectHandler);
+		if (g_Socket->Open(nullptr, port, "Xeon", "Himanshu") != SUCCESSFUL)
+			return false;
+		wifiRxBuffer.Clear();
+		g_Socket->Read(nullptr, 1U);
+		return true;
+	}
+
+	void Stop()
+	{
+		StopCallbacks();
+		delete g_Socket;					// And g_WiFi
+		g_Socket = nullptr;
+		g_WiFi = nullptr;
+		kill(g_EmulatorPid, SIGTERM);
+		waitpid(g_EmulatorPid, nullptr, 0);
+		close(g_Fd);
+	}
+}
+
+///////////
+// Tests //
+///////////
+
+// Echo stays on despite ATE0, so every AT+CIPRECVDATA answer starts with
+// the command line, which also contains "+CIPRECVDATA".
+static void TestPassiveReceiveWithEcho()
+{
+	uint16_t port = FreePort();
+	CHECK(Start({ "--keep-echo" }, port));
+
+	int peer = Connect(port);
+	CHECK(peer >= 0);
+	std::string sent = "hello passive";
+	CHECK(write(peer, sent.data(), sent.size()) == (ssize_t)sent.size());
+	CHECK(WaitFor([&] { return Received().size() >= sent.size(); }, 3000));
+	CHECK(Received() == sent);
+
+	// More than one pull: ReadHandler() takes 256 bytes at a time
+	std::string burst;
+	for (int i = 0; i < 700; i++)
+		burst += (char)('a' + i % 26);
+	CHECK(write(peer, burst.data(), burst.size()) == (ssize_t)burst.size());
+	CHECK(WaitFor([&] { return Received().size() >= sent.size() + burst.size(); }, 3000));
+	CHECK(Received() == sent + burst);
+	CHECK(g_WiFi->TCPPending(0) == 0);
+
+	close(peer);
+	Stop();
+}
+
+// The read handler only queues its replies. The queued one goes out from
+// the Poll() after the handler; the coalesced one is younger than the
+// flush deadline then, and goes out from an idle wake-up of the read.
+static void TestPollSendsQueuedData()
+{
+	uint16_t port = FreePort();
+	CHECK(Start({}, port));
+
+	int peer = Connect(port);
+	CHECK(peer >= 0);
+	g_Reply = REPLY_QUEUED;
+	std::string ping = "ping queued";
+	CHECK(write(peer, ping.data(), ping.size()) == (ssize_t)ping.size());
+	CHECK(ReadPeer(peer, ping.size(), 3000) == ping);
+
+	g_Reply = REPLY_COALESCED;
+	ping = "ping coalesced";
+	CHECK(write(peer, ping.data(), ping.size()) == (ssize_t)ping.size());
+	CHECK(ReadPeer(peer, ping.size(), 3000) == ping);
+
+	close(peer);
+	Stop();
+}
+
+// The emulator drops the association a second after every join. Nothing
+// but the socket's own polling notices and rejoins; afterwards a new
+// connection to the server gets its data through.
+static void TestRejoinAfterDrop()
+{
+	uint16_t port = FreePort();
+	CHECK(Start({ "--wifi-drop", "1" }, port));
+
+	const ERROR_TYPE Lost = STM32TCPSocket::JoinProgress(STM32TCPSocket::JOIN_LOST);
+	int lost = -1, online = -1;
+	CHECK(WaitFor([&] { return (lost = FindEvent(Lost)) >= 0; }, 3000));
+	CHECK(WaitFor([&] { return lost >= 0 and (online = FindEvent(SUCCESSFUL, lost)) >= 0; }, 3000));
+	CHECK(FindEvent(STM32TCPSocket::JoinProgress(STM32TCPSocket::JOIN_ATTEMPT), lost) > lost);
+	CHECK(g_Socket->IsConnected());
+
+	int peer = Connect(port);
+	CHECK(peer >= 0);
+	std::string sent = "after rejoin";
+	CHECK(write(peer, sent.data(), sent.size()) == (ssize_t)sent.size());
+	CHECK(WaitFor([&] { return Received() == sent; }, 500));
+
+	close(peer);
+	Stop();
+}
+
+int main(int argc, char * argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "usage: %s <esp8266_emulator> [--verbose]\n", argv[0]);
+		return 2;
+	}
+	g_Emulator = argv[1];
+	g_Verbose = (argc > 2 and strcmp(argv[2], "--verbose") == 0);
+	if (g_Verbose)
+		Log::Mask = 0xFFFFFFFFU;
+	signal(SIGPIPE, SIG_IGN);
+	alarm(120);							// A hung exchange fails the run
+
+	TestPassiveReceiveWithEcho();
+	TestPollSendsQueuedData();
+	TestRejoinAfterDrop();
+	if (g_Failed)
+		printf("%d check(s) failed\n", g_Failed);
+	else
+		printf("All checks passed\n");
+	return g_Failed ? 1 : 0;
+}
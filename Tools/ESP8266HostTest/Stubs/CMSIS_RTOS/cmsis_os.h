@@ -0,0 +1,4 @@
+#pragma once
+
+// Reached as <../CMSIS_RTOS/cmsis_os.h> from the Stubs/Inc include path.
+#include "../Inc/cmsis_os.h"
@@ -0,0 +1,8 @@
+#pragma once
+
+// Host stand-in for FreeRTOS.h: only the types the headers mention.
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
@@ -0,0 +1,15 @@
+#pragma once
+
+// Host stand-in for CMSIS-RTOS: osDelay() sleeps the calling thread.
+
+#include <stdint.h>
+
+typedef enum
+{
+	osOK = 0
+} osStatus;
+
+#ifdef __cplusplus
+extern "C"
+#endif
+osStatus osDelay(uint32_t millisec);
@@ -0,0 +1,3 @@
+#pragma once
+
+#include "stm32f2xx_hal.h"
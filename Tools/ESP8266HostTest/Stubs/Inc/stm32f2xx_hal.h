@@ -0,0 +1,36 @@
+#pragma once
+
+// Host stand-in for the HAL: the types and calls the ESP8266 library and
+// STM32TCPSocket use, implemented by ESP8266HostTest.cpp.
+
+#include <stdint.h>
+
+typedef enum
+{
+	HAL_OK = 0,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+#define HAL_MAX_DELAY 0xFFFFFFFFU
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct { uint32_t ODR; } GPIO_TypeDef;
+typedef struct { uint32_t RxXferCount; } UART_HandleTypeDef;
+typedef struct { uint32_t State; } RNG_HandleTypeDef;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+uint32_t HAL_GetTick(void);
+void HAL_GPIO_WritePin(GPIO_TypeDef * GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState);
+HAL_StatusTypeDef HAL_RNG_GenerateRandomNumber(RNG_HandleTypeDef * hrng, uint32_t * random32bit);
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,462 @@
+// Deferred log decoder
+//
+// Turns the USART3 output of a LOG_DEFERRED build back into the text a
+// normal build prints. Format frames only carry the address of their
+// format string; the strings themselves are read from the .logfmt section
+// of the firmware ELF, which must be the one running on the board. See
+// Core/Inc/STM32/STM32Log.h for the frame layout.
+//
+// Usage:
+//    LogDecoder [options] <firmware.elf> [capture]
+// The capture is a file or a serial device already set to 115200 8N1
+// (e.g. with stty); without one the stream is read from stdin.
+//    --time               Prefix each frame with its HAL tick as seconds
+//    --stats              Print frame and error counts on stderr at the end
+//
+// Bytes that don't form a valid frame (noise, a partial frame at the start
+// of the capture, output of a build without LOG_DEFERRED) are skipped until
+// the next frame that checks out.
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -o log_decoder LogDecoder.cpp
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_SYNC 0xA5
+#define FRAME_HEADER 3				// sync, length
+#define FRAME_MIN_LENGTH 5			// type, tick
+
+static bool g_Time = false;
+
+struct Stats
+{
+	unsigned long frames = 0;
+	unsigned long skipped = 0;		// Bytes outside valid frames
+	unsigned long unknownFormat = 0;
+} g_Stats;
+
+//////////////////////
+// Format Strings   //
+//////////////////////
+struct FormatTable
+{
+	std::vector<char> data;
+	uint32_t address = 0;
+
+	const char * Lookup(uint32_t id) const
+	{
+		if (id < address or id - address >= data.size())
+			return nullptr;
+		const char * p = &data[id - address];
+		if (memchr(p, '\0', data.size() - (id - address)) == nullptr)
+			return nullptr;
+		return p;
+	}
+};
+
+template <typename T>
+static T readLE(const uint8_t * p)
+{
+	T value = 0;
+	for (size_t i = 0; i < sizeof(T); i++)
+		value |= (T)p[i] << (8 * i);
+	return value;
+}
+
+// loadFormats()
+// Reads the .logfmt section of a 32 bit little endian ELF.
+static bool loadFormats(const char * path, FormatTable& table)
+{
+	FILE * f = fopen(path, "rb");
+	if (f == nullptr)
+	{
+		perror(path);
+		return false;
+	}
+	std::vector<uint8_t> elf;
+	uint8_t chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof chunk, f)) > 0)
+		elf.insert(elf.end(), chunk, chunk + n);
+	fclose(f);
+
+	if (elf.size() < 52 or memcmp(elf.data(), "\x7f" "ELF", 4) != 0 or elf[4] != 1 or elf[5] != 1)
+	{
+		fprintf(stderr, "%s: not a 32 bit little endian ELF file\n", path);
+		return false;
+	}
+	uint32_t shoff = readLE<uint32_t>(&elf[0x20]);
+	uint16_t shentsize = readLE<uint16_t>(&elf[0x2E]);
+	uint16_t shnum = readLE<uint16_t>(&elf[0x30]);
+	uint16_t shstrndx = readLE<uint16_t>(&elf[0x32]);
+	if (shentsize < 40 or shstrndx >= shnum or (uint64_t)shoff + (uint64_t)shnum * shentsize > elf.size())
+	{
+		fprintf(stderr, "%s: bad section header table\n", path);
+		return false;
+	}
+
+	auto section = [&](uint16_t i) { return &elf[shoff + i * shentsize]; };
+	const uint8_t * strtab = section(shstrndx);
+	uint32_t namesOffset = readLE<uint32_t>(strtab + 16);
+	uint32_t namesSize = readLE<uint32_t>(strtab + 20);
+	if ((uint64_t)namesOffset + namesSize > elf.size())
+		return false;
+
+	for (uint16_t i = 0; i < shnum; i++)
+	{
+		const uint8_t * sh = section(i);
+		uint32_t name = readLE<uint32_t>(sh);
+		if (name >= namesSize or strncmp((const char *)&elf[namesOffset + name], ".logfmt", namesSize - name) != 0)
+			continue;
+		uint32_t addr = readLE<uint32_t>(sh + 12);
+		uint32_t offset = readLE<uint32_t>(sh + 16);
+		uint32_t size = readLE<uint32_t>(sh + 20);
+		if ((uint64_t)offset + size > elf.size())
+			return false;
+		table.address = addr;
+		table.data.assign(elf.begin() + offset, elf.begin() + offset + size);
+		return true;
+	}
+	fprintf(stderr, "%s: no .logfmt section (built without LOG_DEFERRED?)\n", path);
+	return false;
+}
+
+///////////////
+// Arguments //
+///////////////
+struct Arg
+{
+	char tag;					// i u l q d p s
+	uint64_t bits = 0;
+	double real = 0;
+	std::string text;
+
+	bool IsInteger() const { return strchr("iulqp", tag) != nullptr; }
+	int64_t Signed() const
+	{
+		if (tag == 'i')
+			return (int32_t)(uint32_t)bits;
+		return (int64_t)bits;
+	}
+};
+
+static bool parseArgs(const uint8_t * p, const uint8_t * end, std::vector<Arg>& args)
+{
+	while (p < end)
+	{
+		Arg arg;
+		arg.tag = *p++;
+		size_t size;
+		switch (arg.tag)
+		{
+		case 'i': case 'u': case 'p': size = 4; break;
+		case 'l': case 'q': case 'd': size = 8; break;
+		case 's':
+			if (end - p < 2)
+				return false;
+			size = readLE<uint16_t>(p);
+			p += 2;
+			break;
+		default:
+			return false;
+		}
+		if ((size_t)(end - p) < size)
+			return false;
+		if (arg.tag == 's')
+			arg.text.assign((const char *)p, size);
+		else if (arg.tag == 'd')
+		{
+			uint64_t raw = readLE<uint64_t>(p);
+			memcpy(&arg.real, &raw, sizeof raw);
+		}
+		else
+			arg.bits = (size == 4) ? readLE<uint32_t>(p) : readLE<uint64_t>(p);
+		p += size;
+		args.push_back(arg);
+	}
+	return true;
+}
+
+// render()
+// printf() over recorded arguments. Each conversion is handed to the host's
+// snprintf with the length modifier replaced to fit the recorded value.
+static std::string render(const char * format, const std::vector<Arg>& args)
+{
+	std::string out;
+	size_t next = 0;
+	auto take = [&]() -> const Arg * { return (next < args.size()) ? &args[next++] : nullptr; };
+
+	for (const char * p = format; *p; p++)
+	{
+		if (*p != '%')
+		{
+			out += *p;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			out += '%';
+			p++;
+			continue;
+		}
+
+		// %[flags][width][.precision][length]conversion
+		std::string spec = "%";
+		const char * q = p + 1;
+		while (*q and strchr("-+ #0", *q))
+			spec += *q++;
+		for (int part = 0; part < 2; part++)
+		{
+			if (part == 1)
+			{
+				if (*q != '.')
+					break;
+				spec += *q++;
+			}
+			if (*q == '*')
+			{
+				const Arg * star = take();
+				spec += std::to_string((star and star->IsInteger()) ? (long long)star->Signed() : 0LL);
+				q++;
+			}
+			else
+				while (*q >= '0' and *q <= '9')
+					spec += *q++;
+		}
+		while (*q and strchr("hlLqjzt", *q))
+			q++;
+		char conversion = *q;
+		if (conversion == '\0')
+			break;
+		p = q;
+
+		const Arg * arg = take();
+		char text[512];
+		text[0] = '\0';
+		if (arg == nullptr)
+			snprintf(text, sizeof text, "<missing>");
+		else if (strchr("di", conversion) and arg->IsInteger())
+			snprintf(text, sizeof text, (spec + "lld").c_str(), (long long)arg->Signed());
+		else if (strchr("uoxXc", conversion) and arg->IsInteger())
+		{
+			unsigned long long value = (arg->tag == 'i') ? (unsigned long long)(uint32_t)arg->bits : arg->bits;
+			if (conversion == 'c')
+				snprintf(text, sizeof text, (spec + "c").c_str(), (int)value);
+			else
+				snprintf(text, sizeof text, (spec + "ll" + conversion).c_str(), value);
+		}
+		else if (strchr("fFeEgGaA", conversion) and arg->tag == 'd')
+			snprintf(text, sizeof text, (spec + conversion).c_str(), arg->real);
+		else if (conversion == 's' and arg->tag == 's')
+		{
+			std::string formatted(arg->text.size() + 256, '\0');
+			int n = snprintf(&formatted[0], formatted.size(), (spec + "s").c_str(), arg->text.c_str());
+			if (n > 0)
+				out.append(formatted.c_str(), std::min((size_t)n, formatted.size() - 1));
+			continue;
+		}
+		else if (conversion == 'p' and arg->IsInteger())
+			snprintf(text, sizeof text, "0x%08llx", (unsigned long long)arg->bits);
+		else
+			snprintf(text, sizeof text, "<%c?>", conversion);
+		out += text;
+	}
+	return out;
+}
+
+////////////
+// Frames //
+////////////
+static void printTick(uint32_t tick)
+{
+	if (g_Time)
+		printf("[%6u.%03u] ", tick / 1000, tick % 1000);
+}
+
+static void decodeFrame(const FormatTable& formats, char type, uint32_t tick, const uint8_t * p, const uint8_t * end)
+{
+	switch (type)
+	{
+	case 'F':
+	{
+		if (end - p < 4)
+			return;
+		uint32_t id = readLE<uint32_t>(p);
+		std::vector<Arg> args;
+		const char * format = formats.Lookup(id);
+		printTick(tick);
+		if (format == nullptr or not parseArgs(p + 4, end, args))
+		{
+			g_Stats.unknownFormat++;
+			printf("<format 0x%08x?>\n", id);
+			return;
+		}
+		fputs(render(format, args).c_str(), stdout);
+		break;
+	}
+
+	case 'B':
+	{
+		// Same text as STM32Debug::TRACE_BUFFER()
+		if (end - p < 3)
+			return;
+		// Frames hold whole lines; offset carries the position across them.
+		static size_t offset = 0;
+		if (end - p < 3)
+			return;
+		uint8_t flags = p[0];
+		size_t perLine = p[1] ? p[1] : 32;
+		uint8_t markerLength = p[2];
+		p += 3;
+		if (end - p < markerLength)
+			return;
+		std::string marker((const char *)p, markerLength);
+		p += markerLength;
+		if (flags & 0x01)
+		{
+			printTick(tick);
+			offset = 0;
+		}
+		do {
+			size_t count = std::min((size_t)(end - p), perLine);
+			printf("\r\n%s: ", marker.c_str());
+			if (flags & 0x04)
+				printf("%0*zX: ", (offset > 0xFFFF) ? 8 : 4, offset);
+			for (size_t i = 0; i < count; i++)
+				printf("%02X ", p[i]);
+			if (flags & 0x08)
+			{
+				printf("%*s|", (int)(3 * (perLine - count)), "");
+				for (size_t i = 0; i < count; i++)
+					putchar((p[i] >= 0x20 and p[i] < 0x7F) ? p[i] : '.');
+				putchar('|');
+			}
+			p += count;
+			offset += count;
+		} while (p < end);
+		if (flags & 0x02)
+			printf("\r\n");
+		break;
+	}
+
+	case 'T':
+		printTick(tick);
+		fwrite(p, 1, end - p, stdout);
+		break;
+	}
+}
+
+// decode()
+// Consumes as many whole frames from the front of [stream] as it holds.
+static void decode(const FormatTable& formats, std::vector<uint8_t>& stream)
+{
+	size_t pos = 0;
+	while (pos < stream.size())
+	{
+		if (stream[pos] != FRAME_SYNC)
+		{
+			pos++;
+			g_Stats.skipped++;
+			continue;
+		}
+		if (stream.size() - pos < FRAME_HEADER)
+			break;
+		uint16_t length = readLE<uint16_t>(&stream[pos + 1]);
+		if (length < FRAME_MIN_LENGTH)
+		{
+			pos++;
+			g_Stats.skipped++;
+			continue;
+		}
+		if (stream.size() - pos < (size_t)FRAME_HEADER + length + 1)
+			break;
+
+		const uint8_t * frame = &stream[pos];
+		uint8_t check = 0;
+		for (size_t i = 1; i < (size_t)FRAME_HEADER + length; i++)
+			check ^= frame[i];
+		char type = frame[3];
+		if (check != frame[FRAME_HEADER + length] or not strchr("FBT", type))
+		{
+			pos++;
+			g_Stats.skipped++;
+			continue;
+		}
+
+		g_Stats.frames++;
+		decodeFrame(formats, type, readLE<uint32_t>(frame + 4), frame + 8, frame + FRAME_HEADER + length);
+		pos += FRAME_HEADER + length + 1;
+	}
+	stream.erase(stream.begin(), stream.begin() + pos);
+	fflush(stdout);
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [--time] [--stats] <firmware.elf> [capture]\n", name);
+}
+
+int main(int argc, char ** argv)
+{
+	bool stats = false;
+	static const struct option options[] = {
+		{ "time", no_argument, nullptr, 't' },
+		{ "stats", no_argument, nullptr, 's' },
+		{ "help", no_argument, nullptr, 'h' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "tsh", options, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+		case 't': g_Time = true; break;
+		case 's': stats = true; break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 2;
+		}
+	}
+	if (optind >= argc or argc - optind > 2)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	FormatTable formats;
+	if (not loadFormats(argv[optind], formats))
+		return 1;
+
+	FILE * in = stdin;
+	if (argc - optind == 2)
+	{
+		in = fopen(argv[optind + 1], "rb");
+		if (in == nullptr)
+		{
+			perror(argv[optind + 1]);
+			return 1;
+		}
+	}
+
+	std::vector<uint8_t> stream;
+	uint8_t chunk[4096];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof chunk, in)) > 0)
+	{
+		stream.insert(stream.end(), chunk, chunk + n);
+		decode(formats, stream);
+	}
+	g_Stats.skipped += stream.size();	// Incomplete frame at the end
+
+	if (stats)
+		fprintf(stderr, "%lu frames, %lu bytes skipped, %lu unknown formats\n",
+			g_Stats.frames, g_Stats.skipped, g_Stats.unknownFormat);
+	return 0;
+}
@@ -0,0 +1,190 @@
+// Timeline to Chrome trace converter
+//
+// Reads the "@TL" lines Timeline::Dump() prints on the log UART (see
+// Core/Inc/STM32/STM32Timeline.h) out of a capture and writes Chrome trace
+// JSON, for chrome://tracing or ui.perfetto.dev. Other lines in the capture
+// are ignored, so the whole log can be fed in; for a LOG_DEFERRED build,
+// run it through LogDecoder first. With several dumps in the capture the
+// last one is converted.
+//
+// Usage:
+//    TimelineTrace [capture] > trace.json
+// Without a capture the text is read from stdin.
+//
+// The trace has two processes:
+//    "CPU"     one row per task, a slice for every time it ran
+//    "Events"  one row per task (0: interrupts) with the AT command, send
+//              and receive spans and instants it recorded
+//
+// Build: g++ -std=gnu++11 -O2 -Wall -o timeline_trace TimelineTrace.cpp
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Event
+{
+	uint32_t cycles;
+	char kind;
+	unsigned task;
+	unsigned id;
+	unsigned long arg;
+};
+
+struct Dump
+{
+	unsigned long clock = 0;
+	unsigned long overwritten = 0;
+	std::map<unsigned, std::string> ids;
+	std::map<unsigned, std::string> tasks;
+	std::vector<Event> events;
+};
+
+// JSON string body: the names come from the firmware, quote them anyway.
+static std::string quote(const std::string& text)
+{
+	std::string out;
+	for (char c : text)
+	{
+		if (c == '"' or c == '\\')
+			out += '\\';
+		if ((unsigned char)c >= 0x20)
+			out += c;
+	}
+	return out;
+}
+
+// parse()
+// Output: false if the capture holds no complete dump
+static bool parse(FILE * in, Dump& dump)
+{
+	char line[256];
+	bool inDump = false, complete = false;
+	Dump current;
+	while (fgets(line, sizeof(line), in))
+	{
+		const char * p = strstr(line, "@TL ");
+		if (p == nullptr)
+			continue;
+		p += 4;
+		char word[16], name[64];
+		unsigned long a;
+		unsigned b;
+		Event e;
+		if (sscanf(p, "begin %lu", &a) == 1)
+		{
+			current = Dump();
+			current.clock = a;
+			inDump = true;
+		}
+		else if (not inDump)
+			continue;
+		else if (sscanf(p, "id %u %63s", &b, name) == 2)
+			current.ids[b] = name;
+		else if (sscanf(p, "task %u %63[^\r\n]", &b, name) == 2)
+			current.tasks[b] = name;
+		else if (sscanf(p, "ev %x %c %u %u %lx", &e.cycles, &e.kind, &e.task, &e.id, &e.arg) == 5)
+			current.events.push_back(e);
+		else if (sscanf(p, "end %lu", &a) == 1)
+		{
+			current.overwritten = a;
+			dump = current;
+			inDump = false;
+			complete = true;
+		}
+		else if (sscanf(p, "%15s", word) == 1)
+			fprintf(stderr, "Skipping \"@TL %s ...\"\n", word);
+	}
+	return complete;
+}
+
+static void emit(const Dump& dump)
+{
+	const int CPU = 1, EVENTS = 2;
+	bool first = true;
+	auto open = [&first]() { printf(first ? "\n  {" : ",\n  {"); first = false; };
+
+	printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	open();
+	printf("\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"args\": {\"name\": \"CPU\"}}", CPU);
+	open();
+	printf("\"ph\": \"M\", \"name\": \"process_name\", \"pid\": %d, \"args\": {\"name\": \"Events\"}}", EVENTS);
+	open();
+	printf("\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"Interrupts\"}}", EVENTS);
+	for (const auto& task : dump.tasks)
+		for (int pid : { CPU, EVENTS })
+		{
+			open();
+			printf("\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+				pid, task.first, quote(task.second).c_str());
+		}
+
+	// The cycle counter wraps every few tens of seconds; events are in
+	// recording order, so each step from the previous one is small.
+	uint64_t time = 0;
+	uint32_t previous = dump.events.empty() ? 0 : dump.events.front().cycles;
+	bool running = false;
+	unsigned runningTask = 0;
+	for (const Event& e : dump.events)
+	{
+		time += (int64_t)(int32_t)(e.cycles - previous);
+		previous = e.cycles;
+		double us = (double)time * 1e6 / dump.clock;
+
+		if (e.kind == 'S')		// Recorded from PendSV: the task switched to is the argument
+		{
+			unsigned next = e.arg;
+			if (running)
+			{
+				open();
+				printf("\"ph\": \"E\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f}", CPU, runningTask, us);
+			}
+			auto task = dump.tasks.find(next);
+			open();
+			printf("\"ph\": \"B\", \"name\": \"%s\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f}",
+				(task == dump.tasks.end()) ? "task" : quote(task->second).c_str(), CPU, next, us);
+			running = true;
+			runningTask = next;
+			continue;
+		}
+
+		auto id = dump.ids.find(e.id);
+		std::string name = (id == dump.ids.end()) ? "event " + std::to_string(e.id) : quote(id->second);
+		const char * phase = (e.kind == 'B') ? "B" : (e.kind == 'E') ? "E" : "i";
+		open();
+		printf("\"ph\": \"%s\", \"name\": \"%s\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"args\": {\"arg\": %lu}%s}",
+			phase, name.c_str(), EVENTS, e.task, us, e.arg, (e.kind == 'I') ? ", \"s\": \"t\"" : "");
+	}
+	printf("\n]}\n");
+}
+
+int main(int argc, char ** argv)
+{
+	FILE * in = stdin;
+	if (argc > 2 or (argc == 2 and argv[1][0] == '-' and argv[1][1] != '\0'))
+	{
+		fprintf(stderr, "Usage: %s [capture] > trace.json\n", argv[0]);
+		return 2;
+	}
+	if (argc == 2 and strcmp(argv[1], "-") != 0 and (in = fopen(argv[1], "r")) == nullptr)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	Dump dump;
+	if (not parse(in, dump) or dump.clock == 0)
+	{
+		fprintf(stderr, "No complete timeline dump found\n");
+		return 1;
+	}
+	if (dump.overwritten)
+		fprintf(stderr, "%lu older events were overwritten\n", dump.overwritten);
+	emit(dump);
+	return 0;
+}